@@ -10,6 +10,15 @@
 #include <errno.h>
 #include <string.h>
 #include <signal.h>
+#include <limits.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#ifdef __linux__
+#include <sched.h>
+#endif
 #include <mpi.h>
 
 #include "cram_file.h"
@@ -26,158 +35,2582 @@ static MPI_Comm local_world;
     } \
   } while (0)
 
+// Fortran handles for MPI_COMM_WORLD and local_world, cached in MPI_Init.
+// Fortran wrappers compare against these instead of converting every
+// communicator with MPI_Comm_f2c before swapping.
+static MPI_Fint fortran_comm_world  = -1;
+static MPI_Fint fortran_local_world = -1;
+
+static inline MPI_Comm cram_comm_f2c(MPI_Fint comm) {
+  if (comm == fortran_comm_world || comm == fortran_local_world) {
+    return local_world;
+  }
+  return PMPI_Comm_f2c(comm);
+}
+
+static inline MPI_Fint cram_comm_c2f(MPI_Comm comm) {
+  if (comm == local_world) {
+    return fortran_local_world;
+  }
+  return PMPI_Comm_c2f(comm);
+}
+
+static void cache_fortran_handles() {
+  fortran_comm_world  = PMPI_Comm_c2f(MPI_COMM_WORLD);
+  fortran_local_world = PMPI_Comm_c2f(local_world);
+}
+
+// Generated Fortran wrappers use the functions above for communicators.
+{{handle_conversion MPI_Comm cram_comm_f2c cram_comm_c2f}}
+
+//
+// Acceptable output modes for Cram.
+//
+typedef enum {
+    cram_output_system,   // Stick with system's original stdout/stderr settings.
+    cram_output_none,     // All processes freopen stdout and stderr to /dev/null
+    cram_output_rank0,    // Rank 0 in each job opens its own stdout/stderr; others /dev/null
+    cram_output_all,      // All ranks in all jobs open their own stdout/stderr
+} cram_output_mode_t;
+
+
+// Global for Cram output mode, set in MPI_Init.
+static cram_output_mode_t cram_output_mode = cram_output_rank0;
+
+// Original stderr pointer.  So that we can print last-ditch error messages.
+static FILE *original_stderr = NULL;
+
+//
+// Stream for last-ditch error messages.
+//
+static FILE *error_stream() {
+    return original_stderr ? original_stderr : stderr;
+}
+
+// Some information about this job.
+static int job_id = -1;
+static int local_rank = -1;
+
+// Wall-clock limit for this job in seconds (CRAM_TIME_LIMIT), or 0.
+static int time_limit = 0;
+
+// Set by the watchdog thread when the time limit passes.
+static volatile int time_limit_passed = 0;
+
+//
+// Gets the output mode from the CRAM_OUTPUT environment variable.
+// Possible values are:
+//
+//   NONE   -> cram_output_none
+//   RANK0  -> cram_output_rank0
+//   ALL    -> cram_output_all
+//
+// These map to corresponding cram_output_mode_t values.
+//
+static cram_output_mode_t get_output_mode() {
+  const char *mode = getenv("CRAM_OUTPUT");
+
+  if (!mode || strcasecmp(mode, "rank0") == 0) {
+      return cram_output_rank0;
+
+  } else if (strcasecmp(mode, "system") == 0) {
+      return cram_output_system;
+
+  } else if (strcasecmp(mode, "none") == 0) {
+      return cram_output_none;
+
+  } else if (strcasecmp(mode, "all") == 0) {
+      return cram_output_all;
+  }
+  return cram_output_rank0;
+}
+
+
+// Directory under each job's working directory for sharded output.
+#define OUTPUT_SHARD_ROOT "cram-out"
+
+// Default number of jobs whose output files share a shard directory.
+#define DEFAULT_OUTPUT_SHARD_SIZE 1000
+
+//
+// Gets the number of jobs per output directory.  With CRAM_OUTPUT_LAYOUT
+// set to SHARDED, output files for jobs 0-999 go in cram-out/0000 under
+// their working directories, jobs 1000-1999 in cram-out/0001, and so on,
+// so that millions of files aren't created in one directory.
+// CRAM_OUTPUT_SHARD_SIZE sets the number of jobs per directory.  Returns
+// 0 for the default flat layout (FLAT).
+//
+static int get_output_shard_size() {
+  const char *layout = getenv("CRAM_OUTPUT_LAYOUT");
+  if (!layout || strcasecmp(layout, "sharded") != 0) {
+      return 0;
+  }
+
+  const char *shard_size = getenv("CRAM_OUTPUT_SHARD_SIZE");
+  if (shard_size && atoi(shard_size) > 0) {
+      return atoi(shard_size);
+  }
+  return DEFAULT_OUTPUT_SHARD_SIZE;
+}
+
+//
+// Directory for this job's output files, relative to its working
+// directory: empty for the flat layout, or e.g. "cram-out/0012/".  The
+// first call creates the directory if it doesn't exist, so make it from
+// the working directory once the job id is known.  cram stage creates
+// shard directories ahead of time, so this is usually one failed mkdir.
+//
+static const char *output_dir() {
+  static char dir[64];
+  static int ready = 0;
+  if (ready) {
+      return dir;
+  }
+  ready = 1;
+
+  int shard_size = get_output_shard_size();
+  if (shard_size > 0) {
+      snprintf(dir, sizeof(dir), OUTPUT_SHARD_ROOT "/%04d", job_id / shard_size);
+      if (mkdir(dir, 0777) != 0 && errno == ENOENT) {
+          mkdir(OUTPUT_SHARD_ROOT, 0777);
+          mkdir(dir, 0777);
+      }
+      strcat(dir, "/");
+  }
+  return dir;
+}
+
+
+//
+// Startup modes for Cram.
+//
+typedef enum {
+    cram_startup_sync,    // All jobs wait on MPI_COMM_WORLD before any of them starts.
+    cram_startup_async,   // Each job starts as soon as its own processes are ready.
+} cram_startup_mode_t;
+
+//
+// Gets the startup mode from the CRAM_STARTUP environment variable.
+// Possible values are:
+//
+//   SYNC   -> cram_startup_sync
+//   ASYNC  -> cram_startup_async
+//
+static cram_startup_mode_t get_startup_mode() {
+  const char *mode = getenv("CRAM_STARTUP");
+
+  if (mode && strcasecmp(mode, "async") == 0) {
+      return cram_startup_async;
+  }
+  return cram_startup_sync;
+}
+
+
+// Phases of startup timed in MPI_Init.
+enum {
+    cram_time_bcast,
+    cram_time_split,
+    cram_time_setup,
+    cram_time_open,
+    cram_time_total,
+    cram_num_times
+};
+
+static void print_startup_times(FILE *out, const double *times) {
+    fprintf(out,   "   Job broadcast:   %.6f sec\n", times[cram_time_bcast]);
+    fprintf(out,   "   MPI_Comm_split:  %.6f sec\n", times[cram_time_split]);
+    fprintf(out,   "   Job setup:       %.6f sec\n", times[cram_time_setup]);
+    fprintf(out,   "   File open:       %.6f sec\n", times[cram_time_open]);
+    fprintf(out,   "  --------------------------------------\n");
+    fprintf(out,   "   Total:           %.6f sec\n", times[cram_time_total]);
+    fprintf(out,   "  \n");
+}
+
+
+#if MPI_VERSION >= 3
+// In async startup mode, startup times are reduced to rank 0 in the
+// background, and the summary is printed when rank 0 finalizes.
+static double startup_times[cram_num_times];
+static double max_startup_times[cram_num_times];
+static MPI_Request startup_summary_request = MPI_REQUEST_NULL;
+#endif // MPI_VERSION >= 3
+
+//
+// Starts a nonblocking reduction of this process's startup times to rank 0.
+// Every process in MPI_COMM_WORLD, including unused ones, must call this.
+//
+static void start_startup_summary(const double *times) {
+#if MPI_VERSION >= 3
+    memcpy(startup_times, times, sizeof(startup_times));
+    PMPI_Ireduce(startup_times, max_startup_times, cram_num_times, MPI_DOUBLE,
+                 MPI_MAX, 0, MPI_COMM_WORLD, &startup_summary_request);
+#endif // MPI_VERSION >= 3
+}
+
+//
+// Completes the reduction started by start_startup_summary(), if there is
+// one, and prints the summary on rank 0.  Called before PMPI_Finalize.
+//
+static void finish_startup_summary() {
+#if MPI_VERSION >= 3
+    if (startup_summary_request == MPI_REQUEST_NULL) {
+        return;
+    }
+    PMPI_Wait(&startup_summary_request, MPI_STATUS_IGNORE);
+
+    int rank;
+    PMPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    if (rank == 0) {
+        FILE *out = error_stream();
+        fprintf(out, "===========================================================\n");
+        fprintf(out, " Cram startup summary (slowest process in each phase):\n");
+        print_startup_times(out, max_startup_times);
+        fprintf(out, "===========================================================\n");
+    }
+#endif // MPI_VERSION >= 3
+}
+
+
+//
+// Redirect I/O to the supplied output and error files, saving stderr in
+// original_stderr (if possible on the particular platform).
+//
+static void redirect_io(const char *out, const char *err) {
+    freopen(out, "w", stdout);
+
+    // If each process has its own output stream, then write errors to the
+    // per-process error stream, not to the original error stream.
+    if (cram_output_mode == cram_output_all) {
+        freopen(err, "w", stderr);
+        original_stderr = stderr;
+        return;
+    }
+
+    // in GLIBC, stdout and stderr are assignable.  Prefer assigning to stdout
+    // and stderr if possible, becasue BG/Q does not allow dup, dup2, fcntl, etc.
+    // to work on the built-in stderr.  There is therefore not a portable way
+    // to do this if we care about BG/Q.
+#ifdef __GLIBC__
+    original_stderr = stderr;
+    stderr = fopen(err, "w");
+#else  // not __GLIBC__
+    // dup the fd for stderr, underneath libc.  This doesn't work on BG/Q.
+    int fd = dup(fileno(stderr));
+    freopen(err, "w", stderr);
+    original_stderr = fdopen(fd, "a");
+
+    // if the fdopen fails for some reason, just use the new error stream for this.
+    if (!original_stderr) {
+        original_stderr = stderr;
+        if (cram_output_mode == cram_output_rank0) {
+            fprintf(stderr, "WARNING: Cram couldn't preserve the original stderr stream while opening a new one.\n");
+            fprintf(stderr, "WARNING: You may not receive notifcations of errors if they do not happen on rank 0 in each job.");
+        }
+    }
+#endif // not __GLIBC__
+}
+
+
+// ------------------------------------------------------------------------
+// Node-local output staging
+// ------------------------------------------------------------------------
+//
+// With CRAM_STAGE_DIR set, output files are written to node-local storage
+// while jobs run, then copied to their usual names in the jobs' working
+// directories when processes finalize.  With CRAM_STAGE_FLUSH=NODE, one
+// process per node does all the copying once every process on the node
+// has finalized.  Processes whose jobs fail always copy their own output
+// right away, so that a retry can't be overwritten by the failed run.
+//
+
+// Size of reads and writes when copying staged files.
+#define STAGE_COPY_SIZE (4 << 20)
+
+//
+// How staged output is copied to its final location.
+//
+typedef enum {
+    cram_flush_rank,   // Each process copies its own files.
+    cram_flush_node,   // One process per node copies everyone's files.
+} cram_flush_mode_t;
+
+// Whether this process's output is currently staged.
+static int output_staged = 0;
+
+// Staged and final paths of this process's stdout and stderr.  Empty if
+// the stream isn't staged (e.g. it goes to /dev/null).
+static char staged_out[PATH_MAX], staged_err[PATH_MAX];
+static char final_out[PATH_MAX],  final_err[PATH_MAX];
+
+// Processes on this node, for CRAM_STAGE_FLUSH=NODE.
+static MPI_Comm stage_node_comm = MPI_COMM_NULL;
+
+//
+// Gets the flush mode from the CRAM_STAGE_FLUSH environment variable.
+// Possible values are:
+//
+//   RANK   -> cram_flush_rank
+//   NODE   -> cram_flush_node
+//
+static cram_flush_mode_t get_flush_mode() {
+  const char *mode = getenv("CRAM_STAGE_FLUSH");
+
+  if (mode && strcasecmp(mode, "node") == 0) {
+      return cram_flush_node;
+  }
+  return cram_flush_rank;
+}
+
+//
+// Sets up staging for all processes.  Collective over MPI_COMM_WORLD if
+// output is flushed by node.
+//
+static void setup_output_staging() {
+#if MPI_VERSION >= 3
+    if (getenv("CRAM_STAGE_DIR") && get_flush_mode() == cram_flush_node) {
+        PMPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, 0,
+                             MPI_INFO_NULL, &stage_node_comm);
+    }
+#endif // MPI_VERSION >= 3
+}
+
+//
+// Builds the final path of an output file in cwd and its staged path in
+// dir.  Returns false if either path is too long, or if the staged path
+// won't fit in size bytes.
+//
+static int stage_paths(const char *cwd, const char *dir, const char *name,
+                       const char *suffix, size_t size, char *final, char *staged) {
+    int final_len  = snprintf(final, PATH_MAX, "%s/%s", cwd, name);
+    int staged_len = snprintf(staged, PATH_MAX, "%s/cram.%d.%s", dir, getpid(), suffix);
+    return (final_len >= 0 && final_len < PATH_MAX &&
+            staged_len >= 0 && staged_len < PATH_MAX && (size_t)staged_len < size);
+}
+
+//
+// Replaces output file names with staged names, if staging is enabled,
+// and remembers the final names.  Call from the job's working directory.
+// If the paths are too long, output isn't staged.
+//
+static void stage_output(char *out, char *err, size_t size) {
+    const char *dir = getenv("CRAM_STAGE_DIR");
+    if (!dir) {
+        return;
+    }
+
+    char cwd[PATH_MAX];
+    if (!getcwd(cwd, sizeof(cwd))) {
+        return;
+    }
+
+    int stage_out = (strcmp(out, "/dev/null") != 0);
+    int stage_err = (strcmp(err, "/dev/null") != 0);
+    if ((stage_out && !stage_paths(cwd, dir, out, "out", size, final_out, staged_out)) ||
+        (stage_err && !stage_paths(cwd, dir, err, "err", size, final_err, staged_err))) {
+        fprintf(error_stream(), "Warning: output paths for rank %d on cram job %d are "
+                "too long to stage in '%s'.  Writing output directly.\n",
+                local_rank, job_id, dir);
+        final_out[0] = final_err[0] = staged_out[0] = staged_err[0] = '\0';
+        return;
+    }
+
+    if (stage_out) {
+        snprintf(out, size, "%s", staged_out);
+        output_staged = 1;
+    }
+    if (stage_err) {
+        snprintf(err, size, "%s", staged_err);
+        output_staged = 1;
+    }
+}
+
+//
+// Copies a staged file to its final location in large writes, and removes
+// the staged file if the copy succeeded.
+//
+static void copy_staged_file(const char *staged, const char *final) {
+    int in = open(staged, O_RDONLY);
+    int out = open(final, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    char *buf = malloc(STAGE_COPY_SIZE);
+
+    int ok = (in >= 0 && out >= 0 && buf);
+    while (ok) {
+        ssize_t bytes = read(in, buf, STAGE_COPY_SIZE);
+        if (bytes <= 0) {
+            ok = (bytes == 0);
+            break;
+        }
+        for (ssize_t done = 0; ok && done < bytes; ) {
+            ssize_t written = write(out, buf + done, bytes - done);
+            ok = (written > 0);
+            done += written;
+        }
+    }
+
+    if (!ok) {
+        fprintf(error_stream(), "Error: Couldn't copy staged output %s to %s: %s\n",
+                staged, final, strerror(errno));
+    }
+    free(buf);
+    if (in >= 0) close(in);
+    if (out >= 0 && close(out) != 0) {
+        ok = 0;
+    }
+    if (ok) {
+        unlink(staged);
+    }
+}
+
+//
+// Once staged files are copied, anything the process writes after
+// MPI_Finalize is appended directly to the final files.
+//
+static void reopen_final_output() {
+    if (staged_out[0]) {
+        freopen(final_out, "a", stdout);
+    }
+    if (staged_err[0]) {
+        freopen(final_err, "a", stderr);
+    }
+}
+
+//
+// Copies this process's staged output to its final location right away.
+//
+static void copy_own_staged_output() {
+    if (!output_staged) {
+        return;
+    }
+    output_staged = 0;
+
+    fflush(stdout);
+    fflush(stderr);
+    if (staged_out[0]) {
+        copy_staged_file(staged_out, final_out);
+    }
+    if (staged_err[0]) {
+        copy_staged_file(staged_err, final_err);
+    }
+    reopen_final_output();
+}
+
+//
+// Copies staged output to its final location before finalizing.  With
+// CRAM_STAGE_FLUSH=NODE, this is collective over all processes on the
+// node, including ones with nothing to copy.
+//
+static void flush_staged_output() {
+#if MPI_VERSION >= 3
+    if (stage_node_comm != MPI_COMM_NULL) {
+        fflush(stdout);
+        fflush(stderr);
+
+        // Pack pairs of null-terminated staged and final paths.
+        char pairs[4 * PATH_MAX];
+        int len = 0;
+        if (output_staged) {
+            if (staged_out[0]) {
+                len += sprintf(pairs + len, "%s", staged_out) + 1;
+                len += sprintf(pairs + len, "%s", final_out) + 1;
+            }
+            if (staged_err[0]) {
+                len += sprintf(pairs + len, "%s", staged_err) + 1;
+                len += sprintf(pairs + len, "%s", final_err) + 1;
+            }
+        }
+
+        int node_rank, node_size;
+        PMPI_Comm_rank(stage_node_comm, &node_rank);
+        PMPI_Comm_size(stage_node_comm, &node_size);
+
+        int *lens = NULL, *displs = NULL;
+        char *all_pairs = NULL;
+        if (node_rank == 0) {
+            lens = malloc(node_size * sizeof(int));
+            displs = malloc(node_size * sizeof(int));
+        }
+        PMPI_Gather(&len, 1, MPI_INT, lens, 1, MPI_INT, 0, stage_node_comm);
+
+        int total = 0;
+        if (node_rank == 0) {
+            for (int i=0; i < node_size; i++) {
+                displs[i] = total;
+                total += lens[i];
+            }
+            all_pairs = malloc(total ? total : 1);
+        }
+        PMPI_Gatherv(pairs, len, MPI_CHAR, all_pairs, lens, displs, MPI_CHAR,
+                     0, stage_node_comm);
+
+        if (node_rank == 0) {
+            for (int offset = 0; offset < total; ) {
+                const char *staged = all_pairs + offset;
+                const char *final = staged + strlen(staged) + 1;
+                copy_staged_file(staged, final);
+                offset = (final - all_pairs) + strlen(final) + 1;
+            }
+            free(all_pairs);
+            free(displs);
+            free(lens);
+        }
+
+        // Don't write to the final files until the copy is done.
+        PMPI_Barrier(stage_node_comm);
+        if (output_staged) {
+            output_staged = 0;
+            reopen_final_output();
+        }
+        return;
+    }
+#endif // MPI_VERSION >= 3
+    copy_own_staged_output();
+}
+
+
+// ------------------------------------------------------------------------
+// MPI calls from helper threads
+// ------------------------------------------------------------------------
+//
+// The time limit watchdog is a thread, so that it can end a process that
+// is stuck computing and still finalize and report.  The application may
+// not allow MPI calls from other threads while its own are in MPI, so a
+// helper thread only takes MPI when no intercepted call is in progress,
+// and holds new ones off until it is done.  Routines that aren't
+// intercepted are local and quick, so they aren't counted.
+//
+// A thread that ends the process (because its job failed, crashed, or
+// timed out) keeps MPI for good.  Other threads that enter MPI after that
+// stop there until the process exits.
+//
+
+// Who holds MPI apart from intercepted calls.
+typedef enum {
+    cram_mpi_free = 0,   // Nobody.  Intercepted calls may proceed.
+    cram_mpi_helper,     // A helper thread, until it releases it.
+    cram_mpi_ending      // The thread that is ending this process.
+} cram_mpi_owner_t;
+
+static int mpi_owner = cram_mpi_free;
+
+// Intercepted calls in progress.  Only counted when some helper needs
+// MPI, since counting costs two atomic operations per call.  Set once at
+// the end of MPI_Init, when no intercepted call is in progress.
+static int calls_in_mpi = 0;
+static int track_mpi_calls = 0;
+
+// Whether this thread is the one ending the process.
+static __thread int ending_here = 0;
+
+//
+// Stops the calling thread until the process exits.
+//
+static void park_thread() {
+    for (;;) {
+        pause();
+    }
+}
+
+//
+// Counts an intercepted call.  Waits while a helper thread has MPI, and
+// parks the thread if another one is ending the process.
+//
+static inline void enter_mpi_call() {
+    if (!track_mpi_calls) {
+        return;
+    }
+    for (;;) {
+        __atomic_add_fetch(&calls_in_mpi, 1, __ATOMIC_SEQ_CST);
+        int owner = __atomic_load_n(&mpi_owner, __ATOMIC_SEQ_CST);
+        if (owner == cram_mpi_free || ending_here) {
+            return;
+        }
+        __atomic_sub_fetch(&calls_in_mpi, 1, __ATOMIC_SEQ_CST);
+        if (owner == cram_mpi_ending) {
+            park_thread();
+        }
+        while (__atomic_load_n(&mpi_owner, __ATOMIC_SEQ_CST) == cram_mpi_helper) {
+            sched_yield();
+        }
+    }
+}
+
+static inline void leave_mpi_call() {
+    if (track_mpi_calls) {
+        __atomic_sub_fetch(&calls_in_mpi, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+//
+// Takes MPI for a helper thread if no intercepted call is in progress.
+// Returns whether it did.  Release it with helper_release().
+//
+static int helper_acquire() {
+    int expected = cram_mpi_free;
+    if (!__atomic_compare_exchange_n(&mpi_owner, &expected, cram_mpi_helper, 0,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+        return 0;
+    }
+    if (__atomic_load_n(&calls_in_mpi, __ATOMIC_SEQ_CST) > 0) {
+        __atomic_store_n(&mpi_owner, cram_mpi_free, __ATOMIC_SEQ_CST);
+        return 0;
+    }
+    return 1;
+}
+
+static void helper_release() {
+    __atomic_store_n(&mpi_owner, cram_mpi_free, __ATOMIC_SEQ_CST);
+}
+
+//
+// Makes the calling thread the one that ends the process.  A helper that
+// holds MPI ends the process itself with this.  Other threads wait for
+// any helper to finish, and park if another thread got here first.
+//
+static void claim_ending() {
+    if (ending_here) {
+        return;
+    }
+    for (;;) {
+        int expected = cram_mpi_free;
+        if (__atomic_compare_exchange_n(&mpi_owner, &expected, cram_mpi_ending, 0,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+            break;
+        }
+        if (expected == cram_mpi_ending) {
+            park_thread();
+        }
+        sched_yield();
+    }
+    ending_here = 1;
+}
+
+//
+// Turns MPI held by this helper thread into MPI held for ending.
+//
+static void helper_claim_ending() {
+    ending_here = 1;
+    __atomic_store_n(&mpi_owner, cram_mpi_ending, __ATOMIC_SEQ_CST);
+}
+
+
+// ------------------------------------------------------------------------
+// Progress reporting
+// ------------------------------------------------------------------------
+//
+// With CRAM_PROGRESS_FILE set, rank 0 exposes a table with one entry per
+// job in an MPI window.  Rank 0 of each job puts its job's status and
+// duration in the table when it starts and finishes, and a process whose
+// job fails marks it failed.  A thread on rank 0 rewrites the progress
+// file every CRAM_PROGRESS_INTERVAL seconds from a snapshot of the table.
+// Puts can land in the table at any time, so it is only copied under an
+// exclusive lock on the window.  With MPI_THREAD_MULTIPLE, the thread
+// takes the lock itself.  Otherwise it takes MPI as a helper thread while
+// rank 0 isn't in an intercepted call (see MPI calls from helper threads).
+// If rank 0 is waiting in a blocking call instead, the thread asks for a
+// fresh snapshot, and rank 0 copies it while it waits.  Either way, the
+// file is refreshed every interval while rank 0 computes.
+//
+
+// Default seconds between progress file updates.
+#define DEFAULT_PROGRESS_INTERVAL 10
+
+// How long the writer waits for a fresh snapshot, and how often it tries
+// to take MPI meanwhile.  If rank 0 is stuck in a call that it can't copy
+// from, the file is written from the last snapshot.
+#define PROGRESS_REFRESH_WAIT_NSEC 1000000000
+#define PROGRESS_RETRY_NSEC 10000000
+
+//
+// Status of a job in the progress table.
+//
+typedef enum {
+    cram_progress_pending = 0,
+    cram_progress_running,
+    cram_progress_finished,
+    cram_progress_failed,
+    cram_progress_timed_out,
+    cram_num_progress
+} cram_progress_t;
+
+// One entry in the progress table.
+typedef struct {
+    double duration;   // Seconds from start to finish or failure.
+    int status;        // A cram_progress_t.
+    int pad;
+} progress_entry_t;
+
+// Window on the progress table, which only rank 0 allocates.
+static MPI_Win progress_win = MPI_WIN_NULL;
+static progress_entry_t *progress_table = NULL;
+static int progress_num_jobs = 0;
+
+// Copy of the table for the writer thread, and whether the thread wants
+// it refreshed.  Both are guarded by progress_lock, but threads in MPI
+// read progress_refresh without it to see whether to take the lock.
+static progress_entry_t *progress_snapshot = NULL;
+static volatile int progress_refresh = 0;
+
+// Whether the writer thread may lock the window itself.
+static int progress_thread_locks = 0;
+
+// When this process's job started, by PMPI_Wtime.
+static double job_start_time = 0;
+
+// Progress file and writer thread on rank 0.
+static const char *progress_file = NULL;
+static int progress_interval = DEFAULT_PROGRESS_INTERVAL;
+static time_t progress_start_time;
+static pthread_t progress_thread;
+static pthread_mutex_t progress_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t progress_cond = PTHREAD_COND_INITIALIZER;
+static int progress_done = 0;
+
+//
+// Writes the progress file from the table on rank 0.  The file is written
+// to a temporary name and renamed, so readers never see a partial file.
+//
+static void write_progress_file(const progress_entry_t *table, int done) {
+    int counts[cram_num_progress] = { 0 };
+    double min_duration = 0, max_duration = 0, sum_duration = 0;
+
+    for (int i=0; i < progress_num_jobs; i++) {
+        progress_entry_t entry = table[i];
+        if (entry.status < 0 || entry.status >= cram_num_progress) {
+            continue;
+        }
+        if (entry.status == cram_progress_finished) {
+            if (counts[cram_progress_finished] == 0 || entry.duration < min_duration) {
+                min_duration = entry.duration;
+            }
+            if (entry.duration > max_duration) {
+                max_duration = entry.duration;
+            }
+            sum_duration += entry.duration;
+        }
+        counts[entry.status]++;
+    }
+
+    char tmp_name[PATH_MAX];
+    snprintf(tmp_name, sizeof(tmp_name), "%s.tmp", progress_file);
+    FILE *file = fopen(tmp_name, "w");
+    if (!file) {
+        return;
+    }
+
+    int finished = counts[cram_progress_finished];
+    fprintf(file, "elapsed: %ld\n", (long)(time(NULL) - progress_start_time));
+    fprintf(file, "jobs: %d\n", progress_num_jobs);
+    fprintf(file, "pending: %d\n", counts[cram_progress_pending]);
+    fprintf(file, "running: %d\n", counts[cram_progress_running]);
+    fprintf(file, "finished: %d\n", finished);
+    fprintf(file, "failed: %d\n", counts[cram_progress_failed]);
+    fprintf(file, "timed_out: %d\n", counts[cram_progress_timed_out]);
+    fprintf(file, "min_duration: %.3f\n", min_duration);
+    fprintf(file, "mean_duration: %.3f\n", finished ? sum_duration / finished : 0);
+    fprintf(file, "max_duration: %.3f\n", max_duration);
+    fprintf(file, "done: %d\n", done);
+    fclose(file);
+
+    rename(tmp_name, progress_file);
+}
+
+//
+// Copies the progress table into the snapshot.  Locking the window
+// completes any puts in flight, and keeps new ones out while we copy.
+// Call with progress_lock held.
+//
+static void copy_progress_table() {
+    PMPI_Win_lock(MPI_LOCK_EXCLUSIVE, 0, 0, progress_win);
+    memcpy(progress_snapshot, progress_table,
+           progress_num_jobs * sizeof(progress_entry_t));
+    PMPI_Win_unlock(0, progress_win);
+}
+
+//
+// Copies the table on a thread of rank 0 that is in MPI, if the writer
+// thread asked for it.  Called while intercepted MPI calls wait, so it
+// doesn't wait for the writer.
+//
+static void refresh_progress() {
+    if (!progress_table || progress_thread_locks) {
+        return;
+    }
+    if (pthread_mutex_trylock(&progress_lock) != 0) {
+        return;
+    }
+    if (progress_refresh) {
+        copy_progress_table();
+        progress_refresh = 0;
+        pthread_cond_signal(&progress_cond);
+    }
+    pthread_mutex_unlock(&progress_lock);
+}
+
+//
+// Adds nsec nanoseconds to a time.
+//
+static void add_nsec(struct timespec *time, long nsec) {
+    time->tv_nsec += nsec;
+    time->tv_sec += time->tv_nsec / 1000000000;
+    time->tv_nsec %= 1000000000;
+}
+
+//
+// Gets a fresh snapshot of the table for the writer thread, if it can
+// within PROGRESS_REFRESH_WAIT_NSEC.  Call with progress_lock held.
+//
+static void update_snapshot() {
+    if (progress_thread_locks) {
+        copy_progress_table();
+        return;
+    }
+
+    struct timespec give_up;
+    clock_gettime(CLOCK_REALTIME, &give_up);
+    add_nsec(&give_up, PROGRESS_REFRESH_WAIT_NSEC);
+
+    progress_refresh = 1;
+    while (!progress_done && progress_refresh) {
+        if (helper_acquire()) {
+            copy_progress_table();
+            helper_release();
+            progress_refresh = 0;
+            break;
+        }
+
+        struct timespec retry;
+        clock_gettime(CLOCK_REALTIME, &retry);
+        add_nsec(&retry, PROGRESS_RETRY_NSEC);
+        if (pthread_cond_timedwait(&progress_cond, &progress_lock, &retry) == ETIMEDOUT &&
+            (retry.tv_sec > give_up.tv_sec ||
+             (retry.tv_sec == give_up.tv_sec && retry.tv_nsec >= give_up.tv_nsec))) {
+            break;
+        }
+    }
+}
+
+//
+// Writer thread on rank 0.
+//
+static void *progress_writer(void *arg) {
+    pthread_mutex_lock(&progress_lock);
+    while (!progress_done) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += progress_interval;
+        while (!progress_done &&
+               pthread_cond_timedwait(&progress_cond, &progress_lock, &deadline) != ETIMEDOUT) {
+        }
+        if (!progress_done) {
+            update_snapshot();
+            write_progress_file(progress_snapshot, 0);
+        }
+    }
+    pthread_mutex_unlock(&progress_lock);
+    return NULL;
+}
+
+//
+// Sets up the progress table.  Collective over MPI_COMM_WORLD.  file is
+// only valid on rank 0.
+//
+static void setup_progress(int rank, const cram_file_t *file) {
+    progress_file = getenv("CRAM_PROGRESS_FILE");
+    if (!progress_file) {
+        return;
+    }
+
+    MPI_Aint size = 0;
+    if (rank == 0) {
+        progress_num_jobs = file->num_jobs;
+        size = progress_num_jobs * sizeof(progress_entry_t);
+        progress_table = calloc(progress_num_jobs, sizeof(progress_entry_t));
+        progress_snapshot = calloc(progress_num_jobs, sizeof(progress_entry_t));
+
+        int provided;
+        PMPI_Query_thread(&provided);
+        progress_thread_locks = (provided == MPI_THREAD_MULTIPLE);
+
+        const char *interval = getenv("CRAM_PROGRESS_INTERVAL");
+        if (interval && atoi(interval) > 0) {
+            progress_interval = atoi(interval);
+        }
+    }
+    PMPI_Win_create(progress_table, size, 1, MPI_INFO_NULL, MPI_COMM_WORLD,
+                    &progress_win);
+
+    if (rank == 0) {
+        progress_start_time = time(NULL);
+        write_progress_file(progress_snapshot, 0);
+        fprintf(stderr,   " Writing progress to %s every %d sec.\n",
+                progress_file, progress_interval);
+    }
+}
+
+//
+// Starts the writer thread on rank 0.  Call at the very end of MPI_Init,
+// since the writer may take MPI from then on.
+//
+static void start_progress_writer() {
+    if (!progress_table) {
+        return;
+    }
+    if (!progress_thread_locks) {
+        track_mpi_calls = 1;
+    }
+    pthread_create(&progress_thread, NULL, progress_writer, NULL);
+}
+
+//
+// Records this process's job's status in the progress table on rank 0.
+//
+static void update_progress(cram_progress_t status) {
+    if (progress_win == MPI_WIN_NULL || job_id < 0) {
+        return;
+    }
+
+    progress_entry_t entry;
+    entry.duration = PMPI_Wtime() - job_start_time;
+    entry.status = status;
+    entry.pad = 0;
+
+    PMPI_Win_lock(MPI_LOCK_SHARED, 0, 0, progress_win);
+    PMPI_Put(&entry, sizeof(entry), MPI_BYTE, 0, job_id * sizeof(entry),
+             sizeof(entry), MPI_BYTE, progress_win);
+    PMPI_Win_unlock(0, progress_win);
+}
+
+//
+// Frees the progress table, and writes the final progress file on rank 0.
+// Collective over MPI_COMM_WORLD; call just before PMPI_Finalize.
+//
+static void finish_progress() {
+    if (progress_win == MPI_WIN_NULL) {
+        return;
+    }
+
+#if MPI_VERSION >= 3
+    // Rank 0 often finishes first.  Keep its snapshot fresh until the
+    // other jobs are done, since freeing the window blocks until then.
+    // Every process must use the nonblocking barrier for it to match.
+    MPI_Request request;
+    PMPI_Ibarrier(MPI_COMM_WORLD, &request);
+    if (progress_table) {
+        int done = 0;
+        while (!done) {
+            refresh_progress();
+            PMPI_Test(&request, &done, MPI_STATUS_IGNORE);
+        }
+    } else {
+        PMPI_Wait(&request, MPI_STATUS_IGNORE);
+    }
+#endif // MPI_VERSION >= 3
+
+    // Stop the writer first, since it may be using the window.
+    if (progress_table) {
+        pthread_mutex_lock(&progress_lock);
+        progress_done = 1;
+        pthread_cond_signal(&progress_cond);
+        pthread_mutex_unlock(&progress_lock);
+        pthread_join(progress_thread, NULL);
+    }
+
+    // Every put is complete once the window is freed.
+    PMPI_Win_free(&progress_win);
+
+    if (progress_table) {
+        write_progress_file(progress_table, 1);
+        free(progress_table);
+        free(progress_snapshot);
+        progress_table = NULL;
+        progress_snapshot = NULL;
+    }
+}
+
+
+// ------------------------------------------------------------------------
+// Retrying failed jobs on spare processes
+// ------------------------------------------------------------------------
+//
+// With CRAM_RETRIES set, processes that aren't needed by any job are kept
+// as a pool of spares instead of exiting.  The first spare is the
+// coordinator: processes report their job's failure to it, and it reruns
+// the job on free spares, up to CRAM_RETRIES times.  Each spare runs at
+// most one job.
+//
+
+// Tag for messages to and from the coordinator.
+#define CRAM_RETRY_TAG 7676
+
+// Split color for spare processes.  Job ids are always smaller.
+#define CRAM_SPARE_COLOR INT_MAX
+
+// Status of a job, as reported to the coordinator.
+typedef enum {
+    cram_job_done,
+    cram_job_failed,
+    cram_job_timed_out
+} cram_job_status_t;
+
+// Maximum number of times to retry each job.
+static int max_retries = 0;
+
+// World rank of the coordinator, or -1 if there isn't one.
+static int coordinator = -1;
+
+// Which run of its job this process is in.  0 is the original run.
+static int retry_attempt = 0;
+
+// Whether this process has already reported its job's status.
+static int status_reported = 0;
+
+// All spare processes, and all processes in original jobs plus the
+// coordinator.  The coordinator stops when everyone in watch_comm is done.
+static MPI_Comm spare_comm = MPI_COMM_NULL;
+static MPI_Comm watch_comm = MPI_COMM_NULL;
+
+// A job that has failed at least once.
+typedef struct {
+    int job_id;
+    int attempt;      // Current attempt; 0 is the original run.
+    int num_procs;
+    int ranks_left;   // Ranks of the current attempt that haven't finished.
+    int running;      // Whether the current attempt is still running.
+} failed_job_t;
+
+//
+// Gets the retry count from the CRAM_RETRIES environment variable.
+//
+static int get_max_retries() {
+  const char *retries = getenv("CRAM_RETRIES");
+  return retries ? atoi(retries) : 0;
+}
+
+//
+// Tells the coordinator how this process's job ended.  Processes in
+// original jobs only report failures, then wait on watch_comm; processes
+// rerunning a job report either way so that the coordinator knows when
+// the rerun is done.
+//
+static void report_job_status(cram_job_status_t status) {
+#if MPI_VERSION >= 3
+    if (coordinator < 0 || job_id < 0 || status_reported) {
+        return;
+    }
+    status_reported = 1;
+
+    int size;
+    PMPI_Comm_size(local_world, &size);
+    int msg[4] = { status, job_id, retry_attempt, size };
+
+    if (retry_attempt > 0) {
+        PMPI_Send(msg, 4, MPI_INT, 0, CRAM_RETRY_TAG, spare_comm);
+    } else {
+        // The coordinator stops once everyone has joined the barrier
+        // below, so the report must be received before this process joins.
+        if (status != cram_job_done) {
+            PMPI_Ssend(msg, 4, MPI_INT, coordinator, CRAM_RETRY_TAG, MPI_COMM_WORLD);
+        }
+        // Must match the coordinator's MPI_Ibarrier, so this can't be
+        // a blocking barrier.
+        MPI_Request request;
+        PMPI_Ibarrier(watch_comm, &request);
+        PMPI_Wait(&request, MPI_STATUS_IGNORE);
+    }
+#endif // MPI_VERSION >= 3
+}
+
+#if MPI_VERSION >= 3
+//
+// Sends a failed job to free spares, starting at spare rank first_spare.
+//
+static void launch_retry(const failed_job_t *job, int first_spare) {
+    int count = 3 + job->num_procs;
+    int *msg = malloc(count * sizeof(int));
+    msg[0] = job->job_id;
+    msg[1] = job->attempt;
+    msg[2] = job->num_procs;
+    for (int i=0; i < job->num_procs; i++) {
+        msg[3 + i] = first_spare + i;
+    }
+    for (int i=0; i < job->num_procs; i++) {
+        PMPI_Send(msg, count, MPI_INT, first_spare + i, CRAM_RETRY_TAG, spare_comm);
+    }
+    free(msg);
+}
+
+//
+// Main loop of the coordinator.  Handles status reports until every
+// original job and every rerun is done, then releases unused spares.
+//
+static void coordinate_retries() {
+    int num_spares;
+    PMPI_Comm_size(spare_comm, &num_spares);
+    int next_spare = 1;   // spare 0 is the coordinator.
+
+    failed_job_t *failed = NULL;
+    int num_failed = 0, num_running = 0, num_recovered = 0;
+
+    MPI_Request watch_request;
+    PMPI_Ibarrier(watch_comm, &watch_request);
+    int watch_done = 0;
+
+    MPI_Comm comms[2] = { MPI_COMM_WORLD, spare_comm };
+    while (!watch_done || num_running > 0) {
+        int got_message = 0;
+        for (int c=0; c < 2; c++) {
+            int flag;
+            MPI_Status status;
+            PMPI_Iprobe(MPI_ANY_SOURCE, CRAM_RETRY_TAG, comms[c], &flag, &status);
+            if (!flag) {
+                continue;
+            }
+            got_message = 1;
+
+            int msg[4];
+            PMPI_Recv(msg, 4, MPI_INT, status.MPI_SOURCE, CRAM_RETRY_TAG,
+                      comms[c], MPI_STATUS_IGNORE);
+
+            failed_job_t *job = NULL;
+            for (int i=0; i < num_failed; i++) {
+                if (failed[i].job_id == msg[1]) {
+                    job = &failed[i];
+                    break;
+                }
+            }
+
+            if (msg[0] == cram_job_done) {
+                if (job && job->running && job->attempt == msg[2]
+                    && --job->ranks_left == 0) {
+                    job->running = 0;
+                    num_running--;
+                    num_recovered++;
+                    fprintf(stderr, "Cram: job %d succeeded on retry %d.\n",
+                            job->job_id, job->attempt);
+                }
+                continue;
+            }
+
+            // First report of an original job's failure.
+            if (!job) {
+                failed = realloc(failed, (num_failed + 1) * sizeof(failed_job_t));
+                job = &failed[num_failed++];
+                job->job_id = msg[1];
+                job->attempt = 0;
+                job->num_procs = msg[3];
+                job->running = 1;
+            }
+
+            // Other ranks in the same attempt may also report; only act once.
+            if (!job->running || job->attempt != msg[2]) {
+                continue;
+            }
+            job->running = 0;
+            if (job->attempt > 0) {
+                num_running--;
+            }
+
+            const char *what = (msg[0] == cram_job_timed_out) ? "timed out" : "failed";
+            if (job->attempt >= max_retries) {
+                fprintf(stderr, "Cram: job %d %s after %d retries.\n",
+                        job->job_id, what, job->attempt);
+
+            } else if (num_spares - next_spare < job->num_procs) {
+                fprintf(stderr, "Cram: job %d %s, but there are not enough "
+                        "spare processes to retry it.\n", job->job_id, what);
+
+            } else {
+                job->attempt++;
+                job->ranks_left = job->num_procs;
+                job->running = 1;
+                num_running++;
+                fprintf(stderr, "Cram: job %d %s.  Retrying on %d spare "
+                        "processes (retry %d of %d).\n", job->job_id, what,
+                        job->num_procs, job->attempt, max_retries);
+                launch_retry(job, next_spare);
+                next_spare += job->num_procs;
+            }
+        }
+
+        if (!watch_done) {
+            PMPI_Test(&watch_request, &watch_done, MPI_STATUS_IGNORE);
+        }
+        if (!got_message) {
+            usleep(1000);
+        }
+    }
+
+    // Release the spares we didn't use.
+    int release = -1;
+    for (; next_spare < num_spares; next_spare++) {
+        PMPI_Send(&release, 1, MPI_INT, next_spare, CRAM_RETRY_TAG, spare_comm);
+    }
+
+    if (num_failed > 0) {
+        fprintf(stderr, "Cram: %d jobs failed, %d recovered on retry.\n",
+                num_failed, num_recovered);
+    }
+    free(failed);
+}
+
+//
+// Waits on a spare for a job to rerun.  Returns false if the spare was
+// released, or true with job_id, retry_attempt, and comm set for the job.
+//
+static int wait_for_retry(MPI_Comm *comm) {
+    MPI_Status status;
+    PMPI_Probe(0, CRAM_RETRY_TAG, spare_comm, &status);
+
+    int count;
+    PMPI_Get_count(&status, MPI_INT, &count);
+    int *msg = malloc(count * sizeof(int));
+    PMPI_Recv(msg, count, MPI_INT, 0, CRAM_RETRY_TAG, spare_comm, MPI_STATUS_IGNORE);
+
+    int assigned = (msg[0] >= 0);
+    if (assigned) {
+        job_id = msg[0];
+        retry_attempt = msg[1];
+
+        // Only the spares running this job take part in creating its comm.
+        MPI_Group spare_group, job_group;
+        PMPI_Comm_group(spare_comm, &spare_group);
+        PMPI_Group_incl(spare_group, msg[2], &msg[3], &job_group);
+        PMPI_Comm_create_group(spare_comm, job_group, CRAM_RETRY_TAG, comm);
+        PMPI_Group_free(&job_group);
+        PMPI_Group_free(&spare_group);
+    }
+    free(msg);
+    return assigned;
+}
+#endif // MPI_VERSION >= 3
+
+//
+// Sets up the spare pool after MPI_COMM_WORLD has been split into jobs.
+// Collective over MPI_COMM_WORLD.  file is only valid on rank 0.
+//
+static void setup_retries(int rank, const cram_file_t *file) {
+#if MPI_VERSION >= 3
+    int size;
+    PMPI_Comm_size(MPI_COMM_WORLD, &size);
+
+    // Spares are the processes after the last job.
+    int total_procs;
+    if (rank == 0) {
+        total_procs = file->total_procs;
+    }
+    PMPI_Bcast(&total_procs, 1, MPI_INT, 0, MPI_COMM_WORLD);
+
+    if (total_procs == size) {
+        if (rank == 0) {
+            fprintf(stderr, " CRAM_RETRIES is set, but there are no spare processes.\n");
+        }
+        max_retries = 0;
+        return;
+    }
+
+    coordinator = total_procs;
+    if (job_id == -1) {
+        spare_comm = local_world;
+    }
+
+    int watching = (job_id >= 0 || rank == coordinator);
+    PMPI_Comm_split(MPI_COMM_WORLD, watching ? 0 : MPI_UNDEFINED, rank, &watch_comm);
+
+    if (rank == 0) {
+        fprintf(stderr,   " Failed jobs will be retried up to %d times on %d spare processes.\n",
+                max_retries, size - total_procs - 1);
+    }
+#else // MPI_VERSION < 3
+    if (rank == 0) {
+        fprintf(stderr, " CRAM_RETRIES requires MPI-3.  Failed jobs will not be retried.\n");
+    }
+    max_retries = 0;
+#endif // MPI_VERSION < 3
+}
+
+//
+// Runs a spare process.  The coordinator handles failures and returns
+// false when all jobs are done.  Other spares wait until they are released
+// (false) or picked to rerun a job (true, with comm set for the job).
+//
+static int run_spare(MPI_Comm *comm) {
+#if MPI_VERSION >= 3
+    int spare_rank;
+    PMPI_Comm_rank(spare_comm, &spare_rank);
+    if (spare_rank == 0) {
+        coordinate_retries();
+        return 0;
+    }
+    return wait_for_retry(comm);
+#else // MPI_VERSION < 3
+    return 0;
+#endif // MPI_VERSION < 3
+}
+
+
+// ------------------------------------------------------------------------
+// Time limits
+// ------------------------------------------------------------------------
+//
+// Jobs packed with cram pack -t have CRAM_TIME_LIMIT in their environment.
+// Every process in such a job starts a watchdog thread at the end of
+// MPI_Init, and times out on its own.  When the limit passes, the watchdog
+// sets a flag, and a process that is in or enters an intercepted MPI call
+// ends its job from there.  If the process isn't in MPI, because it is
+// computing, the watchdog ends it from its own thread.
+//
+
+// Watchdog thread, and whether it should stop.  Guarded by watchdog_lock.
+static pthread_t watchdog_thread;
+static int watchdog_running = 0;
+static int watchdog_done = 0;
+static pthread_mutex_t watchdog_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t watchdog_cond = PTHREAD_COND_INITIALIZER;
+
+// How often the watchdog tries to take MPI after the limit passes.
+#define WATCHDOG_RETRY_NSEC 10000000
+
+static void exit_failed_process(cram_job_status_t status);
+
+//
+// Ends this process's job because its time limit has passed.
+//
+static void exit_timed_out_process() {
+    fprintf(error_stream(), "Rank %d on cram job %d exceeded its time limit of %d sec.\n",
+            local_rank, job_id, time_limit);
+    exit_failed_process(cram_job_timed_out);
+}
+
+//
+// Ends this process's job if its time limit has passed.  Interceptors call
+// this after the MPI call returns, so the process finishes any operation
+// its peers are blocked in before it exits, and between tests while they
+// wait.
+//
+static inline void check_time_limit() {
+    if (time_limit_passed) {
+        exit_timed_out_process();
+    }
+}
+
+//
+// Watchdog thread.  Sleeps until the time limit, then ends the process as
+// soon as no intercepted MPI call is in progress.
+//
+static void *watchdog(void *arg) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += time_limit;
+
+    pthread_mutex_lock(&watchdog_lock);
+    while (!watchdog_done &&
+           pthread_cond_timedwait(&watchdog_cond, &watchdog_lock, &deadline) != ETIMEDOUT) {
+    }
+    if (!watchdog_done) {
+        time_limit_passed = 1;
+    }
+
+    while (!watchdog_done) {
+        if (helper_acquire()) {
+            helper_claim_ending();
+            pthread_mutex_unlock(&watchdog_lock);
+            exit_timed_out_process();
+        }
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        add_nsec(&deadline, WATCHDOG_RETRY_NSEC);
+        pthread_cond_timedwait(&watchdog_cond, &watchdog_lock, &deadline);
+    }
+    pthread_mutex_unlock(&watchdog_lock);
+    return NULL;
+}
+
+//
+// Starts the watchdog if this process's job has a time limit.  Call at
+// the very end of MPI_Init, since the watchdog may finalize from then on.
+//
+static void start_watchdog() {
+    const char *limit = getenv("CRAM_TIME_LIMIT");
+    time_limit = limit ? atoi(limit) : 0;
+    if (time_limit <= 0) {
+        return;
+    }
+
+    track_mpi_calls = 1;
+    if (pthread_create(&watchdog_thread, NULL, watchdog, NULL) == 0) {
+        watchdog_running = 1;
+    }
+}
+
+//
+// Stops the watchdog, before this process finalizes.
+//
+static void stop_watchdog() {
+    if (!watchdog_running) {
+        return;
+    }
+    pthread_mutex_lock(&watchdog_lock);
+    watchdog_done = 1;
+    pthread_cond_signal(&watchdog_cond);
+    pthread_mutex_unlock(&watchdog_lock);
+
+    // The watchdog stops itself when it ends the process.
+    if (!pthread_equal(pthread_self(), watchdog_thread)) {
+        pthread_join(watchdog_thread, NULL);
+    }
+    watchdog_running = 0;
+}
+
+
+// ------------------------------------------------------------------------
+// Job-scoped abort
+// ------------------------------------------------------------------------
+//
+// MPI_Abort and fatal MPI errors would normally take down every job in the
+// allocation.  Instead, the failing process tells the rest of its job over
+// a private duplicate of local_world, and each process in the job exits
+// cleanly when it notices: on a later MPI call that takes a communicator,
+// or while it waits in a blocking call (see Interruptible blocking calls).
+// Processes that die with a signal or exit with an error tell the rest of
+// their job the same way, so that processes waiting on them don't hang.
+//
+
+// Tag for abort notifications on abort_comm.
+#define CRAM_ABORT_TAG 7677
+
+// Why a process told the rest of its job to exit.
+typedef enum {
+    cram_notice_abort,    // MPI_Abort or a fatal MPI error, with its error code.
+    cram_notice_exit,     // A non-zero exit, with its exit code.
+    cram_notice_signal    // A fatal signal, with its number.
+} cram_notice_t;
+
+// Private duplicate of local_world, and a receive posted for notifications.
+// A notification is a cram_notice_t and a value.
+static MPI_Comm abort_comm = MPI_COMM_NULL;
+static MPI_Request abort_request = MPI_REQUEST_NULL;
+static int abort_notice[2];
+
+// Held while testing or cancelling abort_request, which threads share.
+static pthread_mutex_t abort_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//
+// Cancels the pending abort notification receive, before finalizing.
+//
+static void cancel_abort_watch() {
+    pthread_mutex_lock(&abort_lock);
+    if (abort_request != MPI_REQUEST_NULL) {
+        PMPI_Cancel(&abort_request);
+        PMPI_Wait(&abort_request, MPI_STATUS_IGNORE);
+    }
+    pthread_mutex_unlock(&abort_lock);
+}
+
+//
+// Finalizes a process whose job failed and exits cleanly, so that the
+// failure doesn't take down the other jobs.
+//
+static void exit_failed_process(cram_job_status_t status) {
+    // Keep other threads out of MPI, and stop the watchdog.
+    claim_ending();
+    stop_watchdog();
+
+    // Act like everything is ok.  Nothing to see here...
+    int finalized;
+    PMPI_Finalized(&finalized);
+    if (!finalized) {
+        copy_own_staged_output();
+        cancel_abort_watch();
+        update_progress(status == cram_job_timed_out ?
+                        cram_progress_timed_out : cram_progress_failed);
+        report_job_status(status);
+        finish_startup_summary();
+        flush_staged_output();
+        finish_progress();
+        PMPI_Finalize();
+    }
+    exit(0);
+}
+
+//
+// Tells every other process in this job why this one is exiting.  The
+// calling thread becomes the one that ends this process.
+//
+static void notify_job(cram_notice_t reason, int value) {
+    claim_ending();
+    if (abort_comm == MPI_COMM_NULL) {
+        return;
+    }
+
+    int rank, size;
+    PMPI_Comm_rank(abort_comm, &rank);
+    PMPI_Comm_size(abort_comm, &size);
+
+    int notice[2] = { reason, value };
+    MPI_Request *requests = malloc(size * sizeof(MPI_Request));
+    int r = 0;
+    for (int i=0; i < size; i++) {
+        if (i != rank) {
+            PMPI_Isend(notice, 2, MPI_INT, i, CRAM_ABORT_TAG, abort_comm,
+                       &requests[r++]);
+        }
+    }
+    PMPI_Waitall(r, requests, MPI_STATUSES_IGNORE);
+    free(requests);
+}
+
+//
+// Tells every other process in this job to exit, then exits.
+//
+static void abort_job(int errorcode) {
+    notify_job(cram_notice_abort, errorcode);
+    exit_failed_process(cram_job_failed);
+}
+
+//
+// Tests for a notification, and exits if another process in this job has
+// sent one.  Only one thread tests the request at a time; others skip it.
+//
+static void poll_job_abort() {
+    if (pthread_mutex_trylock(&abort_lock) != 0) {
+        return;
+    }
+    int flag = 0;
+    MPI_Status status;
+    if (abort_request != MPI_REQUEST_NULL) {
+        PMPI_Test(&abort_request, &flag, &status);
+    }
+    pthread_mutex_unlock(&abort_lock);
+
+    if (flag) {
+        const char *what = "aborted with error";
+        if (abort_notice[0] == cram_notice_exit) {
+            what = "exited with error";
+        } else if (abort_notice[0] == cram_notice_signal) {
+            what = "died with signal";
+        }
+        fprintf(error_stream(), "Rank %d on cram job %d exiting because rank %d %s %d.\n",
+                local_rank, job_id, status.MPI_SOURCE, what, abort_notice[1]);
+        exit_failed_process(cram_job_failed);
+    }
+}
+
+//
+// Exits if another process in this job has aborted.  Testing the
+// request makes MPI poll for progress, which is expensive in tight communication loops, so this
+// tests once every ABORT_POLL_CALLS calls.  Counting is cheaper than
+// reading a clock on every call.  Each thread counts its own calls.
+//
+#define ABORT_POLL_CALLS 64
+static __thread unsigned abort_poll_count = 0;
+
+static inline void check_job_abort() {
+    if (abort_request == MPI_REQUEST_NULL) {
+        return;
+    }
+
+    if (++abort_poll_count < ABORT_POLL_CALLS) {
+        return;
+    }
+    abort_poll_count = 0;
+    poll_job_abort();
+}
+
+//
+// Error handler for local_world.  Fatal MPI errors abort only this job.
+//
+static void job_error_handler(MPI_Comm *comm, int *error, ...) {
+    char message[MPI_MAX_ERROR_STRING];
+    int len;
+    PMPI_Error_string(*error, message, &len);
+    fprintf(error_stream(), "Rank %d on cram job %d hit MPI error: %s\n",
+            local_rank, job_id, message);
+    abort_job(*error);
+}
+
+//
+// Sets up job-scoped abort for this process's job.
+// Collective over local_world.
+//
+static void setup_job_abort() {
+    PMPI_Comm_dup(local_world, &abort_comm);
+    PMPI_Irecv(abort_notice, 2, MPI_INT, MPI_ANY_SOURCE, CRAM_ABORT_TAG,
+               abort_comm, &abort_request);
+
+    // Communicators derived from local_world inherit this handler.
+    MPI_Errhandler handler;
+    PMPI_Comm_create_errhandler(job_error_handler, &handler);
+    PMPI_Comm_set_errhandler(local_world, handler);
+    PMPI_Errhandler_free(&handler);
+}
+
+
+// ------------------------------------------------------------------------
+// Interruptible blocking calls
+// ------------------------------------------------------------------------
+//
+// A process blocked in MPI_Recv or a collective on a peer that has failed
+// would never return to an interceptor to notice.  So the interceptors
+// for blocking routines start the nonblocking version of the operation
+// and test it in a loop, checking for aborts and the time limit between
+// tests, like the polling PMPI_Wait does anyway.  MPI_Wait and friends
+// are intercepted for the same reason, though they take no communicator.
+// Nonblocking collectives need MPI-3; without it, collectives block.
+//
+
+//
+// Checks whether this process's job should end while it waits in MPI,
+// and refreshes the progress snapshot on rank 0 if the writer asked.
+//
+static inline void check_while_waiting() {
+    check_time_limit();
+    check_job_abort();
+    if (progress_refresh) {
+        refresh_progress();
+    }
+}
+
+//
+// Waits for a request like PMPI_Wait, while checking for aborts.
+//
+static int wait_request(MPI_Request *request, MPI_Status *status) {
+    int done = 0;
+    int err;
+    while ((err = PMPI_Test(request, &done, status)) == MPI_SUCCESS && !done) {
+        check_while_waiting();
+    }
+    return err;
+}
+
+static int wait_all(int count, MPI_Request requests[], MPI_Status statuses[]) {
+    int done = 0;
+    int err;
+    while ((err = PMPI_Testall(count, requests, &done, statuses)) == MPI_SUCCESS
+           && !done) {
+        check_while_waiting();
+    }
+    return err;
+}
+
+static int wait_any(int count, MPI_Request requests[], int *index,
+                    MPI_Status *status) {
+    int done = 0;
+    int err;
+    while ((err = PMPI_Testany(count, requests, index, &done, status)) == MPI_SUCCESS
+           && !done) {
+        check_while_waiting();
+    }
+    return err;
+}
+
+static int wait_some(int count, MPI_Request requests[], int *outcount,
+                     int indices[], MPI_Status statuses[]) {
+    int err;
+    while ((err = PMPI_Testsome(count, requests, outcount, indices, statuses))
+           == MPI_SUCCESS && *outcount == 0) {
+        check_while_waiting();
+    }
+    return err;
+}
+
+//
+// Waits for a nonblocking operation that was just started, if it started.
+//
+static inline int finish_request(int err, MPI_Request *request, MPI_Status *status) {
+    return (err == MPI_SUCCESS) ? wait_request(request, status) : err;
+}
+
+#if MPI_VERSION >= 3
+static int interruptible_MPI_Send(const void *buf, int count, MPI_Datatype type,
+                                  int dest, int tag, MPI_Comm comm) {
+    MPI_Request request;
+    return finish_request(PMPI_Isend(buf, count, type, dest, tag, comm, &request),
+                          &request, MPI_STATUS_IGNORE);
+}
+
+static int interruptible_MPI_Ssend(const void *buf, int count, MPI_Datatype type,
+                                   int dest, int tag, MPI_Comm comm) {
+    MPI_Request request;
+    return finish_request(PMPI_Issend(buf, count, type, dest, tag, comm, &request),
+                          &request, MPI_STATUS_IGNORE);
+}
+
+static int interruptible_MPI_Recv(void *buf, int count, MPI_Datatype type,
+                                  int source, int tag, MPI_Comm comm,
+                                  MPI_Status *status) {
+    MPI_Request request;
+    return finish_request(PMPI_Irecv(buf, count, type, source, tag, comm, &request),
+                          &request, status);
+}
+
+static int interruptible_MPI_Sendrecv(const void *sendbuf, int sendcount,
+                                      MPI_Datatype sendtype, int dest, int sendtag,
+                                      void *recvbuf, int recvcount,
+                                      MPI_Datatype recvtype, int source, int recvtag,
+                                      MPI_Comm comm, MPI_Status *status) {
+    MPI_Request requests[2];
+    int err = PMPI_Irecv(recvbuf, recvcount, recvtype, source, recvtag, comm,
+                         &requests[0]);
+    if (err != MPI_SUCCESS) {
+        return err;
+    }
+    err = PMPI_Isend(sendbuf, sendcount, sendtype, dest, sendtag, comm, &requests[1]);
+    if (err != MPI_SUCCESS) {
+        return err;
+    }
+
+    MPI_Status statuses[2];
+    err = wait_all(2, requests, statuses);
+    if (status != MPI_STATUS_IGNORE) {
+        *status = statuses[0];
+    }
+    return err;
+}
+
+static int interruptible_MPI_Probe(int source, int tag, MPI_Comm comm,
+                                   MPI_Status *status) {
+    int found = 0;
+    int err;
+    while ((err = PMPI_Iprobe(source, tag, comm, &found, status)) == MPI_SUCCESS
+           && !found) {
+        check_while_waiting();
+    }
+    return err;
+}
+
+static int interruptible_MPI_Barrier(MPI_Comm comm) {
+    MPI_Request request;
+    return finish_request(PMPI_Ibarrier(comm, &request), &request, MPI_STATUS_IGNORE);
+}
+
+static int interruptible_MPI_Bcast(void *buf, int count, MPI_Datatype type,
+                                   int root, MPI_Comm comm) {
+    MPI_Request request;
+    return finish_request(PMPI_Ibcast(buf, count, type, root, comm, &request),
+                          &request, MPI_STATUS_IGNORE);
+}
+
+static int interruptible_MPI_Reduce(const void *sendbuf, void *recvbuf, int count,
+                                    MPI_Datatype type, MPI_Op op, int root,
+                                    MPI_Comm comm) {
+    MPI_Request request;
+    return finish_request(PMPI_Ireduce(sendbuf, recvbuf, count, type, op, root,
+                                       comm, &request),
+                          &request, MPI_STATUS_IGNORE);
+}
+
+static int interruptible_MPI_Allreduce(const void *sendbuf, void *recvbuf, int count,
+                                       MPI_Datatype type, MPI_Op op, MPI_Comm comm) {
+    MPI_Request request;
+    return finish_request(PMPI_Iallreduce(sendbuf, recvbuf, count, type, op,
+                                          comm, &request),
+                          &request, MPI_STATUS_IGNORE);
+}
+
+static int interruptible_MPI_Gather(const void *sendbuf, int sendcount,
+                                    MPI_Datatype sendtype, void *recvbuf,
+                                    int recvcount, MPI_Datatype recvtype,
+                                    int root, MPI_Comm comm) {
+    MPI_Request request;
+    return finish_request(PMPI_Igather(sendbuf, sendcount, sendtype, recvbuf,
+                                       recvcount, recvtype, root, comm, &request),
+                          &request, MPI_STATUS_IGNORE);
+}
+
+static int interruptible_MPI_Gatherv(const void *sendbuf, int sendcount,
+                                     MPI_Datatype sendtype, void *recvbuf,
+                                     const int recvcounts[], const int displs[],
+                                     MPI_Datatype recvtype, int root, MPI_Comm comm) {
+    MPI_Request request;
+    return finish_request(PMPI_Igatherv(sendbuf, sendcount, sendtype, recvbuf,
+                                        recvcounts, displs, recvtype, root, comm,
+                                        &request),
+                          &request, MPI_STATUS_IGNORE);
+}
+
+static int interruptible_MPI_Scatter(const void *sendbuf, int sendcount,
+                                     MPI_Datatype sendtype, void *recvbuf,
+                                     int recvcount, MPI_Datatype recvtype,
+                                     int root, MPI_Comm comm) {
+    MPI_Request request;
+    return finish_request(PMPI_Iscatter(sendbuf, sendcount, sendtype, recvbuf,
+                                        recvcount, recvtype, root, comm, &request),
+                          &request, MPI_STATUS_IGNORE);
+}
+
+static int interruptible_MPI_Scatterv(const void *sendbuf, const int sendcounts[],
+                                      const int displs[], MPI_Datatype sendtype,
+                                      void *recvbuf, int recvcount,
+                                      MPI_Datatype recvtype, int root, MPI_Comm comm) {
+    MPI_Request request;
+    return finish_request(PMPI_Iscatterv(sendbuf, sendcounts, displs, sendtype,
+                                         recvbuf, recvcount, recvtype, root, comm,
+                                         &request),
+                          &request, MPI_STATUS_IGNORE);
+}
+
+static int interruptible_MPI_Allgather(const void *sendbuf, int sendcount,
+                                       MPI_Datatype sendtype, void *recvbuf,
+                                       int recvcount, MPI_Datatype recvtype,
+                                       MPI_Comm comm) {
+    MPI_Request request;
+    return finish_request(PMPI_Iallgather(sendbuf, sendcount, sendtype, recvbuf,
+                                          recvcount, recvtype, comm, &request),
+                          &request, MPI_STATUS_IGNORE);
+}
+
+static int interruptible_MPI_Allgatherv(const void *sendbuf, int sendcount,
+                                        MPI_Datatype sendtype, void *recvbuf,
+                                        const int recvcounts[], const int displs[],
+                                        MPI_Datatype recvtype, MPI_Comm comm) {
+    MPI_Request request;
+    return finish_request(PMPI_Iallgatherv(sendbuf, sendcount, sendtype, recvbuf,
+                                           recvcounts, displs, recvtype, comm,
+                                           &request),
+                          &request, MPI_STATUS_IGNORE);
+}
+
+static int interruptible_MPI_Alltoall(const void *sendbuf, int sendcount,
+                                      MPI_Datatype sendtype, void *recvbuf,
+                                      int recvcount, MPI_Datatype recvtype,
+                                      MPI_Comm comm) {
+    MPI_Request request;
+    return finish_request(PMPI_Ialltoall(sendbuf, sendcount, sendtype, recvbuf,
+                                         recvcount, recvtype, comm, &request),
+                          &request, MPI_STATUS_IGNORE);
+}
+
+static int interruptible_MPI_Alltoallv(const void *sendbuf, const int sendcounts[],
+                                       const int sdispls[], MPI_Datatype sendtype,
+                                       void *recvbuf, const int recvcounts[],
+                                       const int rdispls[], MPI_Datatype recvtype,
+                                       MPI_Comm comm) {
+    MPI_Request request;
+    return finish_request(PMPI_Ialltoallv(sendbuf, sendcounts, sdispls, sendtype,
+                                          recvbuf, recvcounts, rdispls, recvtype,
+                                          comm, &request),
+                          &request, MPI_STATUS_IGNORE);
+}
+
+static int interruptible_MPI_Alltoallw(const void *sendbuf, const int sendcounts[],
+                                       const int sdispls[],
+                                       const MPI_Datatype sendtypes[],
+                                       void *recvbuf, const int recvcounts[],
+                                       const int rdispls[],
+                                       const MPI_Datatype recvtypes[],
+                                       MPI_Comm comm) {
+    MPI_Request request;
+    return finish_request(PMPI_Ialltoallw(sendbuf, sendcounts, sdispls, sendtypes,
+                                          recvbuf, recvcounts, rdispls, recvtypes,
+                                          comm, &request),
+                          &request, MPI_STATUS_IGNORE);
+}
+
+static int interruptible_MPI_Reduce_scatter(const void *sendbuf, void *recvbuf,
+                                            const int recvcounts[],
+                                            MPI_Datatype type, MPI_Op op,
+                                            MPI_Comm comm) {
+    MPI_Request request;
+    return finish_request(PMPI_Ireduce_scatter(sendbuf, recvbuf, recvcounts, type,
+                                               op, comm, &request),
+                          &request, MPI_STATUS_IGNORE);
+}
+
+static int interruptible_MPI_Reduce_scatter_block(const void *sendbuf, void *recvbuf,
+                                                  int recvcount, MPI_Datatype type,
+                                                  MPI_Op op, MPI_Comm comm) {
+    MPI_Request request;
+    return finish_request(PMPI_Ireduce_scatter_block(sendbuf, recvbuf, recvcount,
+                                                     type, op, comm, &request),
+                          &request, MPI_STATUS_IGNORE);
+}
+
+static int interruptible_MPI_Scan(const void *sendbuf, void *recvbuf, int count,
+                                  MPI_Datatype type, MPI_Op op, MPI_Comm comm) {
+    MPI_Request request;
+    return finish_request(PMPI_Iscan(sendbuf, recvbuf, count, type, op, comm,
+                                     &request),
+                          &request, MPI_STATUS_IGNORE);
+}
+
+static int interruptible_MPI_Exscan(const void *sendbuf, void *recvbuf, int count,
+                                    MPI_Datatype type, MPI_Op op, MPI_Comm comm) {
+    MPI_Request request;
+    return finish_request(PMPI_Iexscan(sendbuf, recvbuf, count, type, op, comm,
+                                       &request),
+                          &request, MPI_STATUS_IGNORE);
+}
+#else // MPI_VERSION < 3
+// Before MPI-3, signatures aren't const-correct and there are no
+// nonblocking collectives, so these block.
+#define interruptible_MPI_Send                 PMPI_Send
+#define interruptible_MPI_Ssend                PMPI_Ssend
+#define interruptible_MPI_Recv                 PMPI_Recv
+#define interruptible_MPI_Sendrecv             PMPI_Sendrecv
+#define interruptible_MPI_Probe                PMPI_Probe
+#define interruptible_MPI_Barrier              PMPI_Barrier
+#define interruptible_MPI_Bcast                PMPI_Bcast
+#define interruptible_MPI_Reduce               PMPI_Reduce
+#define interruptible_MPI_Allreduce            PMPI_Allreduce
+#define interruptible_MPI_Gather               PMPI_Gather
+#define interruptible_MPI_Gatherv              PMPI_Gatherv
+#define interruptible_MPI_Scatter              PMPI_Scatter
+#define interruptible_MPI_Scatterv             PMPI_Scatterv
+#define interruptible_MPI_Allgather            PMPI_Allgather
+#define interruptible_MPI_Allgatherv           PMPI_Allgatherv
+#define interruptible_MPI_Alltoall             PMPI_Alltoall
+#define interruptible_MPI_Alltoallv            PMPI_Alltoallv
+#define interruptible_MPI_Alltoallw            PMPI_Alltoallw
+#define interruptible_MPI_Reduce_scatter       PMPI_Reduce_scatter
+#define interruptible_MPI_Reduce_scatter_block PMPI_Reduce_scatter_block
+#define interruptible_MPI_Scan                 PMPI_Scan
+#define interruptible_MPI_Exscan               PMPI_Exscan
+#endif // MPI_VERSION < 3
+
+
+//
+// Handler for fatal signals prints to original stderr to tell the user which
+// process died, tells the rest of its job, then exits cleanly.
+//
+void segv_sigaction(int signal, siginfo_t *si, void *ctx) {
+    fprintf(error_stream(), "Rank %d on cram job %d died with signal %d.\n",
+            local_rank, job_id, signal);
+    notify_job(cram_notice_signal, signal);
+    exit_failed_process(cram_job_failed);
+}
+
+static void finish_job();
+
+//
+// Atexit handler that disallows processes exiting with codes other than 0.
+// On some systems (BG/Q), this results in the entire MPI job being killed,
+// and we'd rather most of our cram jobs live full and productive lives.
+// Processes that exit with 0 without calling MPI_Finalize are finalized
+// here, so that the retry coordinator and progress table hear they're done.
+//
+void on_exit_handler(int err, void *arg) {
+    if (err != 0) {
+        fprintf(error_stream(), "Rank %d on cram job %d exited with error %d.\n",
+                local_rank, job_id, err);
+        notify_job(cram_notice_exit, err);
+        exit_failed_process(cram_job_failed);
+    }
+
+    int finalized;
+    PMPI_Finalized(&finalized);
+    if (!finalized) {
+        enter_mpi_call();
+        finish_job();
+        PMPI_Finalize();
+    }
+}
+
+//
+// In a cram run, there are many simulatneous jobs, some of which may fail.
+// This function sets up signal handlers and other handlers that attempt to
+// keep the whole job from dying when a single process dies.
+//
+static void setup_crash_handlers() {
+    // Set up signal handlers so that SEGV and other fatal signals are caught.
+    struct sigaction sa;
+    sa.sa_sigaction = segv_sigaction;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = 0;
+    const int fatal_signals[] = { SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT };
+    for (size_t i=0; i < sizeof(fatal_signals) / sizeof(fatal_signals[0]); i++) {
+        sigaction(fatal_signals[i], &sa, NULL);
+    }
+
+    // Register exit handler to mask procs that return with error.
+    on_exit(on_exit_handler, NULL);
+}
+
+
+// ------------------------------------------------------------------------
+// Threads per rank
+// ------------------------------------------------------------------------
+//
+// Jobs packed with cram pack --threads have CRAM_THREADS_PER_RANK in their
+// environment.  Cram gives each process in such a job its own set of that
+// many CPUs, so that co-located hybrid jobs don't oversubscribe cores.
+//
+
+// OpenMP reads OMP_NUM_THREADS before main(), which is too late for the
+// job's environment to take effect.  If the application uses OpenMP, this
+// is defined, and Cram sets the thread count directly.
+extern void omp_set_num_threads(int) __attribute__((weak));
+
+// Whether any job in the cram file has threads per rank, from the flags
+// in its header.  Set on every process in MPI_Init.
+static int threaded_jobs = 0;
+
+//
+// Looks up the threads per rank in a job's environment.  Returns 0 if the
+// job doesn't set it.
+//
+static int get_job_threads(const cram_job_t *job) {
+  for (int i=0; i < job->num_env_vars; i++) {
+    if (strcmp(job->keys[i], "CRAM_THREADS_PER_RANK") == 0) {
+      return atoi(job->values[i]);
+    }
+  }
+  return 0;
+}
+
+//
+// Sets the number of OpenMP threads for a job that has threads per rank.
+//
+static void set_job_threads(int threads) {
+  if (threads > 0 && omp_set_num_threads) {
+    omp_set_num_threads(threads);
+  }
+}
+
+//
+// Binds this process to threads CPUs.  Collective over MPI_COMM_WORLD if
+// any job has threads per rank; processes that aren't running a threaded
+// job pass 0.
+//
+// Processes on a node take consecutive CPUs, in rank order, from all the
+// CPUs the launcher allowed processes on the node to use.  If there are
+// more threads than CPUs, assignments wrap around and node rank 0 warns.
+//
+static void bind_job_threads(int threads) {
+  set_job_threads(threads);
+  if (!threaded_jobs) {
+    return;  // no threaded jobs, so leave the launcher's binding alone.
+  }
+
+#if MPI_VERSION >= 3 && defined(CPU_SETSIZE)
+  MPI_Comm node_comm;
+  PMPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, 0,
+                       MPI_INFO_NULL, &node_comm);
+  int node_rank;
+  PMPI_Comm_rank(node_comm, &node_rank);
+
+  // CPUs available on this node are the union of every process's mask.
+  cpu_set_t own_cpus, node_cpus;
+  CPU_ZERO(&own_cpus);
+  sched_getaffinity(0, sizeof(own_cpus), &own_cpus);
+  PMPI_Allreduce(&own_cpus, &node_cpus, sizeof(cpu_set_t), MPI_BYTE, MPI_BOR,
+                 node_comm);
+  int num_cpus = CPU_COUNT(&node_cpus);
+
+  // Find where this process's CPUs start, and how many are needed.
+  int first = 0;
+  PMPI_Exscan(&threads, &first, 1, MPI_INT, MPI_SUM, node_comm);
+  if (node_rank == 0) {
+    first = 0;  // Exscan leaves rank 0's result undefined.
+  }
+  int node_threads;
+  PMPI_Reduce(&threads, &node_threads, 1, MPI_INT, MPI_SUM, 0, node_comm);
+  if (node_rank == 0 && node_threads > num_cpus) {
+    char host[MPI_MAX_PROCESSOR_NAME];
+    int len;
+    PMPI_Get_processor_name(host, &len);
+    fprintf(stderr, "Warning: Cram jobs on %s need %d threads, but only %d CPUs "
+            "are available.  Some CPUs will be shared.\n",
+            host, node_threads, num_cpus);
+  }
+  PMPI_Comm_free(&node_comm);
+
+  if (threads <= 0 || num_cpus == 0) {
+    return;
+  }
+
+  cpu_set_t job_cpus;
+  CPU_ZERO(&job_cpus);
+  int index = 0;
+  for (int cpu=0; cpu < CPU_SETSIZE && index < num_cpus; cpu++) {
+    if (!CPU_ISSET(cpu, &node_cpus)) continue;
+
+    // Take the threads CPUs from first on, wrapping around past the last.
+    // The offset of CPU index from first is in [0, num_cpus).
+    int offset = ((index - first) % num_cpus + num_cpus) % num_cpus;
+    if (offset < threads) {
+      CPU_SET(cpu, &job_cpus);
+    }
+    index++;
+  }
+  sched_setaffinity(0, sizeof(job_cpus), &job_cpus);
+#endif // MPI_VERSION >= 3 && defined(CPU_SETSIZE)
+}
+
+
+// ------------------------------------------------------------------------
+// Node-local job cache
+// ------------------------------------------------------------------------
 //
-// Acceptable output modes for Cram.
+// With CRAM_CACHE_DIR set to a node-local directory, each process saves
+// its job there once jobs are distributed.  The file name has a key for
+// the cram file's path and the process's rank, and the file starts with
+// a hash of the cram file's contents and the size of MPI_COMM_WORLD, so
+// a later launch of the same, unchanged cram file with the same layout
+// finds it.  A node hits if all of its processes find their jobs.  If
+// every node hits, the broadcast is skipped.  Otherwise jobs are
+// distributed as usual, and processes that missed overwrite their files.
 //
-typedef enum {
-    cram_output_system,   // Stick with system's original stdout/stderr settings.
-    cram_output_none,     // All processes freopen stdout and stderr to /dev/null
-    cram_output_rank0,    // Rank 0 in each job opens its own stdout/stderr; others /dev/null
-    cram_output_all,      // All ranks in all jobs open their own stdout/stderr
-} cram_output_mode_t;
 
+// This process's cache file, and whether it held this process's job.
+static char cache_file[PATH_MAX];
+static int cache_hit = 0;
 
-// Global for Cram output mode, set in MPI_Init.
-static cram_output_mode_t cram_output_mode = cram_output_rank0;
+// What a cache file must start with to hold this launch's job.
+static uint64_t cache_contents = 0;
+static int cache_size = 0;
 
-// Original stderr pointer.  So that we can print last-ditch error messages.
-static FILE *original_stderr = NULL;
+//
+// Hashes len bytes into hash, 64 bits at a time.  This is FNV-1a over
+// words rather than bytes, which is several times faster and still good
+// enough to tell files apart; it is not meant to resist forgery.
+//
+static uint64_t hash_bytes(uint64_t hash, const void *data, size_t len) {
+    const unsigned char *bytes = (const unsigned char*)data;
+    for (; len >= sizeof(uint64_t); len -= sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, bytes, sizeof(word));
+        hash = (hash ^ word) * 0x100000001b3ULL;
+        bytes += sizeof(word);
+    }
+    for (; len > 0; len--) {
+        hash = (hash ^ *bytes++) * 0x100000001b3ULL;
+    }
+    return hash;
+}
 
-// Some information about this job.
-static int job_id = -1;
-static int local_rank = -1;
+//
+// Hash of the contents of a cram file open on rank 0.  Reads the whole
+// file once, and leaves it where it was.  Returns 0 if the file can't be
+// read, which nothing then matches.
+//
+static uint64_t cache_contents_hash(const cram_file_t *file) {
+    off_t pos = ftello(file->fd);
+    if (pos < 0 || fseeko(file->fd, 0, SEEK_SET) != 0) {
+        return 0;
+    }
+
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    char buf[1 << 16];
+    size_t len;
+    while ((len = fread(buf, 1, sizeof(buf), file->fd)) > 0) {
+        hash = hash_bytes(hash, buf, len);
+    }
+    if (ferror(file->fd)) {
+        hash = 0;
+    }
+    clearerr(file->fd);
+    if (fseeko(file->fd, pos, SEEK_SET) != 0) {
+        hash = 0;
+    }
+    return hash;
+}
 
 //
-// Gets the output mode from the CRAM_OUTPUT environment variable.
-// Possible values are:
+// Removes this cram file's cache files in dir for ranks that the current
+// launch doesn't have.  Files for the ranks it has are overwritten as
+// they miss, so a cram file leaves at most one set of cache files on a
+// node.
 //
-//   NONE   -> cram_output_none
-//   RANK0  -> cram_output_rank0
-//   ALL    -> cram_output_all
+static void evict_cached_jobs(const char *dir, unsigned long long key, int size) {
+    DIR *d = opendir(dir);
+    if (!d) {
+        return;
+    }
+
+    char prefix[32];
+    int prefix_len = snprintf(prefix, sizeof(prefix), "cram-%016llx-", key);
+    struct dirent *entry;
+    while ((entry = readdir(d))) {
+        int rank;
+        char end[8];
+        if (strncmp(entry->d_name, prefix, prefix_len) != 0 ||
+            sscanf(entry->d_name + prefix_len, "%d%7s", &rank, end) != 2 ||
+            strcmp(end, ".job") != 0 || rank < size) {
+            continue;
+        }
+        char name[PATH_MAX];
+        snprintf(name, sizeof(name), "%s/%s", dir, entry->d_name);
+        unlink(name);
+    }
+    closedir(d);
+}
+
 //
-// These map to corresponding cram_output_mode_t values.
+// Looks for this process's job in the cache.  Returns true with job and
+// id set if every node hit, in which case there is nothing to broadcast.
+// Prints how many nodes hit on rank 0.  Collective over MPI_COMM_WORLD.
+// cram_file and filename are only valid on rank 0.
 //
-static cram_output_mode_t get_output_mode() {
-  const char *mode = getenv("CRAM_OUTPUT");
+static int load_cached_job(int rank, const char *filename,
+                           const cram_file_t *cram_file,
+                           cram_job_t *job, int *id) {
+    const char *dir = getenv("CRAM_CACHE_DIR");
+    if (!dir) {
+        return 0;
+    }
 
-  if (!mode || strcasecmp(mode, "rank0") == 0) {
-      return cram_output_rank0;
+    // Key on the absolute path, so a cram file rewritten in place maps to
+    // the same cache files, and the contents decide whether they're stale.
+    unsigned long long keys[2] = { 0, 0 };
+    if (rank == 0) {
+        char path[PATH_MAX];
+        if (!realpath(filename, path)) {
+            snprintf(path, sizeof(path), "%s", filename);
+        }
+        keys[0] = hash_bytes(0xcbf29ce484222325ULL, path, strlen(path));
+        keys[1] = cache_contents_hash(cram_file);
+    }
+    PMPI_Bcast(keys, 2, MPI_UNSIGNED_LONG_LONG, 0, MPI_COMM_WORLD);
+    cache_contents = keys[1];
+    PMPI_Comm_size(MPI_COMM_WORLD, &cache_size);
 
-  } else if (strcasecmp(mode, "system") == 0) {
-      return cram_output_system;
+    snprintf(cache_file, sizeof(cache_file), "%s/cram-%016llx-%d.job",
+             dir, keys[0], rank);
 
-  } else if (strcasecmp(mode, "none") == 0) {
-      return cram_output_none;
+    FILE *file = fopen(cache_file, "r");
+    if (file) {
+        uint64_t contents;
+        int size;
+        cache_hit = (fread(&contents, sizeof(contents), 1, file) == 1 &&
+                     fread(&size, sizeof(int), 1, file) == 1 &&
+                     contents != 0 && contents == cache_contents &&
+                     size == cache_size &&
+                     fread(id, sizeof(int), 1, file) == 1 &&
+                     (*id < 0 || cram_job_read(file, job)));
+        fclose(file);
+    }
 
-  } else if (strcasecmp(mode, "all") == 0) {
-      return cram_output_all;
-  }
-  return cram_output_rank0;
-}
+    // Without MPI-3, each process counts as its own node.
+    int node_hit = cache_hit;
+    int node_rank = 0;
+#if MPI_VERSION >= 3
+    MPI_Comm node_comm;
+    PMPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, rank,
+                         MPI_INFO_NULL, &node_comm);
+    PMPI_Allreduce(&cache_hit, &node_hit, 1, MPI_INT, MPI_LAND, node_comm);
+    PMPI_Comm_rank(node_comm, &node_rank);
+    PMPI_Comm_free(&node_comm);
+#endif // MPI_VERSION >= 3
+
+    if (!node_hit && node_rank == 0) {
+        evict_cached_jobs(dir, keys[0], cache_size);
+    }
+
+    int nodes[2] = { node_rank == 0 && node_hit, node_rank == 0 && !node_hit };
+    int total_nodes[2];
+    PMPI_Allreduce(nodes, total_nodes, 2, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
+    if (rank == 0) {
+        fprintf(stderr, " Job cache: %d nodes hit, %d missed.\n",
+                total_nodes[0], total_nodes[1]);
+    }
 
+    if (total_nodes[1] > 0) {
+        if (cache_hit && *id >= 0) {
+            cram_job_free(job);
+        }
+        return 0;
+    }
+    return 1;
+}
 
 //
-// Redirect I/O to the supplied output and error files, saving stderr in
-// original_stderr (if possible on the particular platform).
+// Saves this process's job in the cache, if caching is on and the cache
+// didn't already have it.  The file is written to a temporary name and
+// renamed, so a partial file is never loaded.
 //
-static void redirect_io(const char *out, const char *err) {
-    freopen(out, "w", stdout);
+static void save_cached_job(const cram_job_t *job, int id) {
+    if (!cache_file[0] || cache_hit || !cache_contents) {
+        return;
+    }
 
-    // If each process has its own output stream, then write errors to the
-    // per-process error stream, not to the original error stream.
-    if (cram_output_mode == cram_output_all) {
-        freopen(err, "w", stderr);
-        original_stderr = stderr;
+    char tmp_name[PATH_MAX + 8];
+    snprintf(tmp_name, sizeof(tmp_name), "%s.tmp", cache_file);
+    FILE *file = fopen(tmp_name, "w");
+    if (!file) {
         return;
     }
 
-    // in GLIBC, stdout and stderr are assignable.  Prefer assigning to stdout
-    // and stderr if possible, becasue BG/Q does not allow dup, dup2, fcntl, etc.
-    // to work on the built-in stderr.  There is therefore not a portable way
-    // to do this if we care about BG/Q.
-#ifdef __GLIBC__
-    original_stderr = stderr;
-    stderr = fopen(err, "w");
-#else  // not __GLIBC__
-    // dup the fd for stderr, underneath libc.  This doesn't work on BG/Q.
-    int fd = dup(fileno(stderr));
-    freopen(err, "w", stderr);
-    original_stderr = fdopen(fd, "a");
+    int ok = (fwrite(&cache_contents, sizeof(cache_contents), 1, file) == 1 &&
+              fwrite(&cache_size, sizeof(int), 1, file) == 1 &&
+              fwrite(&id, sizeof(int), 1, file) == 1 &&
+              (id < 0 || cram_job_write(job, file)));
+    ok = (fclose(file) == 0) && ok;
+    if (ok) {
+        rename(tmp_name, cache_file);
+    } else {
+        unlink(tmp_name);
+    }
+}
 
-    // if the fdopen fails for some reason, just use the new error stream for this.
-    if (!original_stderr) {
-        original_stderr = stderr;
-        if (cram_output_mode == cram_output_rank0) {
-            fprintf(stderr, "WARNING: Cram couldn't preserve the original stderr stream while opening a new one.\n");
-            fprintf(stderr, "WARNING: You may not receive notifcations of errors if they do not happen on rank 0 in each job.");
+// ------------------------------------------------------------------------
+// Job streams
+// ------------------------------------------------------------------------
+//
+// A job stream is a cram file that a generator is still writing, e.g.
+// through a FIFO.  Rank 0 reads it and sends each job to the next free
+// processes as soon as the job arrives, and they start it right away, so
+// launching overlaps generating the jobs.  Rank 0 doesn't run a job.
+//
+// The number of jobs isn't known until the stream ends, so features that
+// are set up across MPI_COMM_WORLD before jobs start are off: progress
+// files, retries, the job cache, thread binding, and flushing staged
+// output by node.  Startup is always asynchronous.
+//
+
+// Whether jobs come from a job stream.  Set on every process in MPI_Init.
+static int streaming = 0;
+
+//
+// Receives this process's job from the stream, and sets job_id and
+// local_world.  file is only valid on rank 0, which closes it when the
+// stream ends.
+//
+static void stream_jobs(int rank, cram_file_t *file, cram_job_t *job) {
+#if MPI_VERSION >= 3
+    if (rank == 0) {
+        const char *ignored[] = { "CRAM_PROGRESS_FILE", "CRAM_RETRIES",
+                                  "CRAM_CACHE_DIR", "CRAM_DISTRIBUTION",
+                                  "CRAM_STAGE_FLUSH" };
+        for (int i=0; i < sizeof(ignored) / sizeof(ignored[0]); i++) {
+            if (getenv(ignored[i])) {
+                fprintf(stderr, " %s is ignored for job streams.\n", ignored[i]);
+            }
         }
     }
-#endif // not __GLIBC__
+
+    cram_file_stream_jobs(file, job, &job_id, &local_world, MPI_COMM_WORLD);
+
+    if (rank == 0) {
+        fprintf(stderr,   " Started %d jobs from the stream, using %d processes.\n",
+                file->num_jobs, file->total_procs);
+        fprintf(stderr,   "===========================================================\n");
+        cram_file_close(file);
+    }
+#else // MPI_VERSION < 3
+    if (rank == 0) {
+        fprintf(stderr, "Error: Job streams require MPI-3.\n");
+    }
+    PMPI_Abort(MPI_COMM_WORLD, 1);
+#endif // MPI_VERSION < 3
 }
 
+// ------------------------------------------------------------------------
+// MPI profiling
+// ------------------------------------------------------------------------
+//
+// With CRAM_PROFILE=1, the interceptors at the end of this file count
+// calls, bytes, and time for each MPI routine that takes a communicator.
+// When a job finalizes, its processes' counts are reduced on local_world,
+// and rank 0 of the job writes a summary to cram.<jobid>.profile next to
+// the job's output files (see output_dir).  With CRAM_PROFILE_FILE also
+// set, each job instead appends its summary to that file, one line per
+// routine, in a single write.
+//
+// Bytes are the sizes of the count and datatype arguments a routine is
+// called with, except those only the root of a collective reads.  Nonblocking routines are only timed until they return,
+// and routines without a communicator (MPI_Wait, etc.) aren't counted.
+//
+
+// Ids of the intercepted routines.
+typedef enum {
+{{forallfn_with_type func MPI_Comm MPI_Init MPI_Init_thread MPI_Abort}}  cram_profile_{{func}},
+{{endforallfn_with_type}}  cram_profile_num_functions
+} cram_profile_function_t;
+
+static const char *profile_function_names[] = {
+{{forallfn_with_type func MPI_Comm MPI_Init MPI_Init_thread MPI_Abort}}  "{{func}}",
+{{endforallfn_with_type}}};
+
+// Counts for one routine, summed over processes when reduced.  These are
+// all doubles so that one reduction covers them.  Keep
+// PROFILE_NUM_COUNTS in sync with the number of fields.
+#define PROFILE_NUM_COUNTS 3
+typedef struct {
+    double calls;
+    double bytes;
+    double time;
+} profile_counts_t;
+
+// Whether the interceptors are profiling, and this process's counts.
+static int profiling = 0;
+static profile_counts_t profile_counts[cram_profile_num_functions];
 
 //
-// Handler for SEGV prints to original stderr to tell the user which process
-// died, then exits cleanly.
+// Adds the size of a count and datatype argument to profile_bytes, a
+// local in each interceptor.  apply_to_counts leaves out arguments that
+// only the root of a collective reads; arguments for an MPI_IN_PLACE
+// buffer are ignored by MPI, so they're skipped here.
 //
-void segv_sigaction(int signal, siginfo_t *si, void *ctx) {
-    fprintf(original_stderr, "Rank %d on cram job %d died with signal %d.\n",
-            local_rank, job_id, signal);
+#define add_profile_bytes(buf, count, type) \
+  do { \
+    if ((buf) != MPI_IN_PLACE && (count) > 0 && (type) != MPI_DATATYPE_NULL) { \
+      int type_size; \
+      PMPI_Type_size(type, &type_size); \
+      profile_bytes += (double)(count) * type_size; \
+    } \
+  } while (0)
 
-    // Act like everything is ok.  Nothing to see here...
-    int finalized;
-    PMPI_Finalized(&finalized);
-    if (!finalized) {
-        PMPI_Finalize();
-    }
-    exit(0);
+//
+// Records one call to an intercepted routine that started at start.
+//
+static inline void profile_call(cram_profile_function_t fn, double bytes, double start) {
+    profile_counts[fn].calls += 1;
+    profile_counts[fn].bytes += bytes;
+    profile_counts[fn].time  += PMPI_Wtime() - start;
 }
 
 //
-// Atexit handler that disallows processes exiting with codes other than 0.
-// On some systems (BG/Q), this results in the entire MPI job being killed,
-// and we'd rather most of our cram jobs live full and productive lives.
+// Turns on profiling if CRAM_PROFILE is set.  Call once the job's
+// environment is set up.
 //
-void on_exit_handler(int err, void *arg) {
-    if (err != 0) {
-        fprintf(original_stderr, "Rank %d on cram job %d exited with error %d.\n",
-                local_rank, job_id, err);
+static void setup_profile() {
+    const char *profile = getenv("CRAM_PROFILE");
+    profiling = (profile && atoi(profile) > 0);
+}
+
+//
+// Sorts routine ids by descending total time.
+//
+static const profile_counts_t *sorted_profile_counts;
+static int compare_profile_time(const void *a, const void *b) {
+    double ta = sorted_profile_counts[*(const int*)a].time;
+    double tb = sorted_profile_counts[*(const int*)b].time;
+    return (ta < tb) - (ta > tb);
+}
+
+//
+// Formats the CRAM_PROFILE_FILE line for routine id into buf, like
+// snprintf.  Returns the line's full length.
+//
+static int format_profile_line(char *buf, size_t size, int procs, int id,
+                               const profile_counts_t *counts,
+                               const double *max_times) {
+    const profile_counts_t *c = &counts[id];
+    return snprintf(buf, size, "%d %d %s %.0f %.0f %.6f %.6f\n",
+                    job_id, procs, profile_function_names[id],
+                    c->calls, c->bytes, c->time, max_times[id]);
+}
+
+//
+// Writes a job's reduced counts, slowest routines first.  max_times has
+// the slowest process's time in each routine, then the job's elapsed time.
+//
+static void write_job_profile(int procs, const profile_counts_t *counts,
+                              const double *max_times) {
+    int ids[cram_profile_num_functions];
+    int num_ids = 0;
+    for (int i=0; i < cram_profile_num_functions; i++) {
+        if (counts[i].calls > 0) {
+            ids[num_ids++] = i;
+        }
+    }
+    sorted_profile_counts = counts;
+    qsort(ids, num_ids, sizeof(int), compare_profile_time);
+
+    const char *profile_file = getenv("CRAM_PROFILE_FILE");
+    if (profile_file) {
+        // Build all the lines first, so that they go in with one write.
+        size_t len = 0;
+        for (int i=0; i < num_ids; i++) {
+            len += format_profile_line(NULL, 0, procs, ids[i], counts, max_times);
+        }
+        char *lines = malloc(len + 1);
+        if (!lines) {
+            fprintf(error_stream(), "Error: cram job %d couldn't allocate its profile.\n",
+                    job_id);
+            return;
+        }
+        size_t offset = 0;
+        for (int i=0; i < num_ids; i++) {
+            offset += format_profile_line(lines + offset, len + 1 - offset, procs,
+                                          ids[i], counts, max_times);
+        }
 
-        // Act like everything is ok.  Nothing to see here...
-        int finalized;
-        PMPI_Finalized(&finalized);
-        if (!finalized) {
-            PMPI_Finalize();
+        int fd = open(profile_file, O_WRONLY | O_APPEND | O_CREAT, 0644);
+        if (fd < 0 || write(fd, lines, len) != (ssize_t)len) {
+            fprintf(error_stream(), "Error: cram job %d couldn't write profile to '%s'.\n",
+                    job_id, profile_file);
         }
-        exit(0);
+        if (fd >= 0) {
+            close(fd);
+        }
+        free(lines);
+        return;
+    }
+
+    char file_name[128];
+    snprintf(file_name, sizeof(file_name), "%scram.%d.profile", output_dir(), job_id);
+    FILE *file = fopen(file_name, "w");
+    if (!file) {
+        fprintf(error_stream(), "Error: cram job %d couldn't write profile to '%s'.\n",
+                job_id, file_name);
+        return;
+    }
+
+    fprintf(file, "# Cram profile for job %d: %d processes, %.6f sec\n",
+            job_id, procs, max_times[cram_profile_num_functions]);
+    fprintf(file, "# %-22s %12s %16s %12s %12s\n",
+            "function", "calls", "bytes", "total sec", "max sec");
+    for (int i=0; i < num_ids; i++) {
+        const profile_counts_t *c = &counts[ids[i]];
+        fprintf(file, "%-24s %12.0f %16.0f %12.6f %12.6f\n",
+                profile_function_names[ids[i]], c->calls, c->bytes, c->time,
+                max_times[ids[i]]);
     }
+    fclose(file);
 }
 
 //
-// In a cram run, there are many simulatneous jobs, some of which may fail.
-// This function sets up signal handlers and other handlers that attempt to
-// keep the whole job from dying when a single process dies.
+// Reduces this job's counts on local_world and writes the summary on the
+// job's rank 0.  Collective over local_world; call from MPI_Finalize.
+// With MPI-3, this keeps checking for aborts while it waits, so that it
+// doesn't hang if another process in the job has failed.
 //
-static void setup_crash_handlers() {
-    // Set up signal handlers so that SEGV is called.
-    struct sigaction sa;
-    sa.sa_sigaction = segv_sigaction;
-    sigemptyset(&sa.sa_mask);
-    sa.sa_flags = 0;
-    int err = sigaction(SIGSEGV, &sa, NULL);
+static void finish_profile() {
+    if (!profiling) {
+        return;
+    }
+    profiling = 0;
 
-    // Register exit handler to mask procs that return with error.
-    on_exit(on_exit_handler, NULL);
+    double times[cram_profile_num_functions + 1];
+    for (int i=0; i < cram_profile_num_functions; i++) {
+        times[i] = profile_counts[i].time;
+    }
+    times[cram_profile_num_functions] = PMPI_Wtime() - job_start_time;
+
+    int count = PROFILE_NUM_COUNTS * cram_profile_num_functions;
+    profile_counts_t counts[cram_profile_num_functions];
+    double max_times[cram_profile_num_functions + 1];
+
+#if MPI_VERSION >= 3
+    MPI_Request requests[2];
+    PMPI_Ireduce(profile_counts, counts, count, MPI_DOUBLE, MPI_SUM, 0,
+                 local_world, &requests[0]);
+    PMPI_Ireduce(times, max_times, cram_profile_num_functions + 1, MPI_DOUBLE,
+                 MPI_MAX, 0, local_world, &requests[1]);
+    int done = 0;
+    while (!done) {
+        check_job_abort();
+        PMPI_Testall(2, requests, &done, MPI_STATUSES_IGNORE);
+    }
+#else
+    PMPI_Reduce(profile_counts, counts, count, MPI_DOUBLE, MPI_SUM, 0, local_world);
+    PMPI_Reduce(times, max_times, cram_profile_num_functions + 1, MPI_DOUBLE,
+                MPI_MAX, 0, local_world);
+#endif // MPI_VERSION >= 3
+
+    if (local_rank == 0) {
+        int procs;
+        PMPI_Comm_size(local_world, &procs);
+        write_job_profile(procs, counts, max_times);
+    }
 }
 
 
 //
-// MPI_Init does all the communicator setup
+// Does all the communicator setup once MPI is initialized.  Both MPI_Init
+// and MPI_Init_thread call this after the real init routine.
 //
-{{fn func MPI_Init}}{
-  // First call PMPI_Init()
-  {{callfn}}
-
+static void cram_init(int *argc, char ***argv) {
   // Get this process's rank.
   int rank;
   PMPI_Comm_rank(MPI_COMM_WORLD, &rank);
@@ -198,7 +2631,8 @@ static void setup_crash_handlers() {
       fprintf(stderr, "===========================================================\n");
     }
     local_world = MPI_COMM_WORLD;
-    return MPI_SUCCESS;
+    cache_fortran_handles();
+    return;
   }
 
   // Read the whole file in on rank 1 (it's compressed, so this should scale fairly well,
@@ -212,35 +2646,107 @@ static void setup_crash_handlers() {
       PMPI_Abort(MPI_COMM_WORLD, errno);
     }
 
-    fprintf(stderr,   " Splitting this MPI job into %d jobs.\n", cram_file.num_jobs);
-    fprintf(stderr,   " This will use %d total processes.\n", cram_file.total_procs);
+    streaming = cram_file.stream;
+    threaded_jobs = (cram_file.flags & CRAM_FILE_THREADS) != 0;
+    if (streaming) {
+      fprintf(stderr,   " Starting jobs as they are written to the job stream.\n");
+    } else {
+      fprintf(stderr,   " Splitting this MPI job into %d jobs.\n", cram_file.num_jobs);
+      fprintf(stderr,   " This will use %d total processes.\n", cram_file.total_procs);
+    }
   }
+  int file_info[2] = { streaming, threaded_jobs };
+  PMPI_Bcast(file_info, 2, MPI_INT, 0, MPI_COMM_WORLD);
+  streaming = file_info[0];
+  threaded_jobs = file_info[1];
 
-  // Receive our job from the root process.
+  // Receive our job from the root process, unless it's cached on this node.
+  // Jobs from a stream come with their own communicator.
   cram_job_t cram_job;
   double start_time = PMPI_Wtime();
-  cram_file_bcast_jobs(&cram_file, 0, &cram_job, &job_id, MPI_COMM_WORLD);
+  if (streaming) {
+    stream_jobs(rank, &cram_file, &cram_job);
+  } else if (!load_cached_job(rank, cram_filename, &cram_file,
+                              &cram_job, &job_id)) {
+    cram_file_bcast_jobs(&cram_file, 0, &cram_job, &job_id, MPI_COMM_WORLD);
+    save_cached_job(&cram_job, job_id);
+  }
   double bcast_time = PMPI_Wtime();
 
-  // Use the job id to split MPI_COMM_WORLD.
-  PMPI_Comm_split(MPI_COMM_WORLD, job_id, rank, &local_world);
+  if (streaming) {
+    set_job_threads(job_id >= 0 ? get_job_threads(&cram_job) : 0);
+  } else {
+    // Use the job id to split MPI_COMM_WORLD.  Unneeded ranks (job id -1)
+    // must pass MPI_UNDEFINED, since split colors can't be negative.  If
+    // failed jobs are retried, they are kept together as spares instead.
+    max_retries = get_max_retries();
+    int color = job_id;
+    if (job_id == -1) {
+      color = (max_retries > 0) ? CRAM_SPARE_COLOR : MPI_UNDEFINED;
+    }
+    PMPI_Comm_split(MPI_COMM_WORLD, color, rank, &local_world);
+    setup_output_staging();
+    setup_progress(rank, &cram_file);
+    if (max_retries > 0) {
+      setup_retries(rank, &cram_file);
+    }
+    bind_job_threads(job_id >= 0 ? get_job_threads(&cram_job) : 0);
+  }
   double split_time = PMPI_Wtime();
 
+  // In async mode, jobs only synchronize within local_world.
+  cram_startup_mode_t startup_mode =
+    streaming ? cram_startup_async : get_startup_mode();
+
   // Throw away unneeded ranks.
   if (job_id == -1) {
-    PMPI_Barrier(MPI_COMM_WORLD); // matches barrier later.
-    PMPI_Finalize();
-    exit(0);
+    if (startup_mode == cram_startup_async) {
+      // contribute to the summary rank 0 gathers.
+      double times[cram_num_times] = { 0 };
+      times[cram_time_bcast] = bcast_time - start_time;
+      times[cram_time_split] = split_time - bcast_time;
+      times[cram_time_total] = split_time - start_time;
+      start_startup_summary(times);
+      finish_startup_summary();
+    } else {
+      PMPI_Barrier(MPI_COMM_WORLD); // matches barrier later.
+    }
+
+    if (spare_comm == MPI_COMM_NULL || !run_spare(&local_world)) {
+      flush_staged_output();
+      finish_progress();
+      PMPI_Finalize();
+      exit(0);
+    }
+
+    // This spare was picked to rerun a failed job.  Look it up locally.
+    cram_file_t retry_file;
+    if (!cram_file_open(cram_filename, &retry_file) ||
+        !cram_file_find_job(&retry_file, job_id, &cram_job)) {
+      fprintf(stderr, "Error: Failed to read job %d from cram file '%s'.\n",
+              job_id, cram_filename);
+      report_job_status(cram_job_failed);
+      flush_staged_output();
+      finish_progress();
+      PMPI_Finalize();
+      exit(0);
+    }
+    cram_file_close(&retry_file);
+
+    // Reruns start after the other jobs are bound, so they aren't pinned.
+    set_job_threads(get_job_threads(&cram_job));
   }
 
+  cache_fortran_handles();
+
   // set up this job's environment based on the job descriptor.
-  cram_job_setup(&cram_job, {{0}}, (const char***){{1}});
+  cram_job_setup(&cram_job, argc, (const char***)argv);
   PMPI_Comm_rank(local_world, &local_rank);
   double setup_time = PMPI_Wtime();
 
   cram_output_mode = get_output_mode();
-  char out_file_name[1024];
-  char err_file_name[1024];
+  char out_file_name[PATH_MAX];
+  char err_file_name[PATH_MAX];
 
   if (cram_output_mode != cram_output_system) {
       sprintf(out_file_name, "/dev/null");
@@ -250,35 +2756,56 @@ static void setup_crash_handlers() {
           // Redirect I/O to a separate file for each cram job.
           // These files will be in the job's working directory.
           if (local_rank == 0) {
-              sprintf(out_file_name, "cram.%d.out", job_id);
-              sprintf(err_file_name, "cram.%d.err", job_id);
+              snprintf(out_file_name, sizeof(out_file_name), "%scram.%d.out",
+                       output_dir(), job_id);
+              snprintf(err_file_name, sizeof(err_file_name), "%scram.%d.err",
+                       output_dir(), job_id);
           }
 
       } else if (cram_output_mode == cram_output_all) {
-          sprintf(out_file_name, "cram.%d.%d.out", job_id, local_rank);
-          sprintf(err_file_name, "cram.%d.%d.err", job_id, local_rank);
+          snprintf(out_file_name, sizeof(out_file_name), "%scram.%d.%d.out",
+                   output_dir(), job_id, local_rank);
+          snprintf(err_file_name, sizeof(err_file_name), "%scram.%d.%d.err",
+                   output_dir(), job_id, local_rank);
       }
 
+      stage_output(out_file_name, err_file_name, sizeof(out_file_name));
+
       // don't freopen on root until after printing status.
       if (rank != 0) {
           redirect_io(out_file_name, err_file_name);
       }
   }
 
-  // wait for lots of files to open.
-  PMPI_Barrier(MPI_COMM_WORLD);
+  // wait for lots of files to open.  In async mode, only wait for the
+  // processes in this job, so that jobs don't wait on each other.  Reruns
+  // of failed jobs always start on their own.
+  if (startup_mode == cram_startup_async || retry_attempt > 0) {
+    PMPI_Barrier(local_world);
+  } else {
+    PMPI_Barrier(MPI_COMM_WORLD);
+  }
   double freopen_time = PMPI_Wtime();
 
+  double times[cram_num_times];
+  times[cram_time_bcast] = bcast_time   - start_time;
+  times[cram_time_split] = split_time   - bcast_time;
+  times[cram_time_setup] = setup_time   - split_time;
+  times[cram_time_open]  = freopen_time - setup_time;
+  times[cram_time_total] = freopen_time - start_time;
+
   if (rank == 0) {
     fprintf(stderr,   "\n");
-    fprintf(stderr,   " Successfully set up job:\n");
-    fprintf(stderr,   "   Job broadcast:   %.6f sec\n", bcast_time   - start_time);
-    fprintf(stderr,   "   MPI_Comm_split:  %.6f sec\n", split_time   - bcast_time);
-    fprintf(stderr,   "   Job setup:       %.6f sec\n", setup_time   - split_time);
-    fprintf(stderr,   "   File open:       %.6f sec\n", freopen_time - setup_time);
-    fprintf(stderr,   "  --------------------------------------\n");
-    fprintf(stderr,   "   Total:           %.6f sec\n", freopen_time - start_time);
-    fprintf(stderr,   "  \n");
+    if (startup_mode == cram_startup_async) {
+      fprintf(stderr, " Successfully set up job 0 (asynchronous startup):\n");
+    } else {
+      fprintf(stderr, " Successfully set up job:\n");
+    }
+    print_startup_times(stderr, times);
+    if (startup_mode == cram_startup_async) {
+      fprintf(stderr, " Other jobs start independently.  A summary for all\n");
+      fprintf(stderr, " processes is printed when rank 0 calls MPI_Finalize.\n");
+    }
     fprintf(stderr,   "===========================================================\n");
 
     if (cram_output_mode != cram_output_system) {
@@ -289,17 +2816,186 @@ static void setup_crash_handlers() {
     cram_file_close(&cram_file);
   }
 
+  if (startup_mode == cram_startup_async && retry_attempt == 0) {
+    start_startup_summary(times);
+  }
+
   // Now that I/O is set up, register some handlers for crashes.
   setup_crash_handlers();
+  setup_job_abort();
+
+  // The job is running.
+  setup_profile();
+  job_start_time = PMPI_Wtime();
+  if (local_rank == 0) {
+    update_progress(cram_progress_running);
+  }
 
   cram_job_free(&cram_job);
+
+  // Last, since these threads may use MPI from here on.
+  start_progress_writer();
+  start_watchdog();
+}
+
+
+//
+// MPI_Init and MPI_Init_thread initialize MPI, then set up Cram.
+//
+{{fn func MPI_Init}}{
+  {{callfn}}
+  cram_init({{0}}, {{1}});
 }{{endfn}}
 
-// This generates interceptors that will catch every MPI routine
-// *except* MPI_Init.  The interceptors just make sure that if
-// they are called with an argument of type MPI_Comm that has a
-// value of MPI_COMM_WORLD, they switch it to local_world.
-{{fnall func MPI_Init}}{
-  {{apply_to_type MPI_Comm swap_world}}
+{{fn func MPI_Init_thread}}{
+  {{callfn}}
+  cram_init({{0}}, {{1}});
+}{{endfn}}
+
+//
+// Before finalizing, stop the time limit watchdog, write the job's profile,
+// tell the retry coordinator this process is done, complete the startup
+// summary if it is still pending, copy staged output to its final
+// location, and record the job's progress.  MPI_Finalize does this, and so
+// does the exit handler for processes that exit without finalizing.
+//
+static void finish_job() {
+  stop_watchdog();
+  finish_profile();
+  cancel_abort_watch();
+  if (local_rank == 0) {
+    update_progress(cram_progress_finished);
+  }
+  report_job_status(cram_job_done);
+  finish_startup_summary();
+  flush_staged_output();
+  finish_progress();
+}
+
+{{fn func MPI_Finalize}}{
+  enter_mpi_call();
+  finish_job();
+  {{callfn}}
+  leave_mpi_call();
+}{{endfn}}
+
+//
+// MPI_Abort ends only the calling process's job, not the whole allocation.
+//
+{{fn func MPI_Abort}}{
+  if (abort_comm == MPI_COMM_NULL) {
+    // Cram is disabled, or MPI_Init hasn't finished.
+    {{callfn}}
+  } else {
+    fprintf(error_stream(), "Rank %d on cram job %d called MPI_Abort with error %d.\n",
+            local_rank, job_id, {{1}});
+    abort_job({{1}});
+  }
+}{{endfn}}
+
+// MPI routines that can block on other processes.  Their interceptors
+// wait in a loop that checks for aborts and the time limit.
+{{fn func MPI_Send MPI_Ssend MPI_Recv MPI_Sendrecv MPI_Probe
+          MPI_Barrier MPI_Bcast MPI_Reduce MPI_Allreduce
+          MPI_Gather MPI_Gatherv MPI_Scatter MPI_Scatterv
+          MPI_Allgather MPI_Allgatherv MPI_Alltoall MPI_Alltoallv MPI_Alltoallw
+          MPI_Reduce_scatter MPI_Reduce_scatter_block? MPI_Scan MPI_Exscan}}{
+  if (abort_comm == MPI_COMM_NULL) {
+    // Cram is disabled, or MPI_Init hasn't finished.
+    {{callfn}}
+  } else {
+    enter_mpi_call();
+    check_job_abort();
+    {{apply_to_type MPI_Comm swap_world}}
+    if (profiling) {
+      double profile_bytes = 0;
+      {{apply_to_counts add_profile_bytes}}
+      double profile_start = PMPI_Wtime();
+      {{ret_val}} = interruptible_{{func}}({{args}});
+      profile_call(cram_profile_{{func}}, profile_bytes, profile_start);
+    } else {
+      {{ret_val}} = interruptible_{{func}}({{args}});
+    }
+    check_time_limit();
+    leave_mpi_call();
+  }
+}{{endfn}}
+
+// Waiting on requests can block too.  These routines take no communicator,
+// so they aren't profiled.  They're counted while they wait, though, so
+// the watchdog doesn't end the process in the middle of one.
+{{fn func MPI_Wait}}{
+  if (abort_comm == MPI_COMM_NULL) {
+    {{callfn}}
+  } else {
+    enter_mpi_call();
+    {{ret_val}} = wait_request({{args}});
+    leave_mpi_call();
+  }
+}{{endfn}}
+
+{{fn func MPI_Waitall}}{
+  if (abort_comm == MPI_COMM_NULL) {
+    {{callfn}}
+  } else {
+    enter_mpi_call();
+    {{ret_val}} = wait_all({{args}});
+    leave_mpi_call();
+  }
+}{{endfn}}
+
+{{fn func MPI_Waitany}}{
+  if (abort_comm == MPI_COMM_NULL) {
+    {{callfn}}
+  } else {
+    enter_mpi_call();
+    {{ret_val}} = wait_any({{args}});
+    leave_mpi_call();
+  }
+}{{endfn}}
+
+{{fn func MPI_Waitsome}}{
+  if (abort_comm == MPI_COMM_NULL) {
+    {{callfn}}
+  } else {
+    enter_mpi_call();
+    {{ret_val}} = wait_some({{args}});
+    leave_mpi_call();
+  }
+}{{endfn}}
+
+// Applications often poll requests in a loop, so these are counted too.
+{{fn func MPI_Test MPI_Testall MPI_Testany MPI_Testsome}}{
+  enter_mpi_call();
   {{callfn}}
-}{{endfnall}}
+  leave_mpi_call();
+}{{endfn}}
+
+// This generates interceptors for every other MPI routine that takes an
+// MPI_Comm.  The interceptors just make sure that if they are called with
+// an argument of type MPI_Comm that has a value of MPI_COMM_WORLD, they
+// switch it to local_world.  They also exit if another process in the job
+// has aborted or the time limit has passed, and count calls when profiling
+// is on.  Other routines without a communicator argument (MPI_Wtime, etc.)
+// are not intercepted, so they go straight to the MPI library.
+{{fnall_with_type func MPI_Comm MPI_Init MPI_Init_thread MPI_Abort
+                  MPI_Send MPI_Ssend MPI_Recv MPI_Sendrecv MPI_Probe
+                  MPI_Barrier MPI_Bcast MPI_Reduce MPI_Allreduce
+                  MPI_Gather MPI_Gatherv MPI_Scatter MPI_Scatterv
+                  MPI_Allgather MPI_Allgatherv MPI_Alltoall MPI_Alltoallv MPI_Alltoallw
+                  MPI_Reduce_scatter MPI_Reduce_scatter_block MPI_Scan MPI_Exscan}}{
+  enter_mpi_call();
+  check_job_abort();
+  {{apply_to_type MPI_Comm swap_world}}
+  if (profiling) {
+    double profile_bytes = 0;
+    {{apply_to_counts add_profile_bytes}}
+    double profile_start = PMPI_Wtime();
+    {{callfn}}
+    profile_call(cram_profile_{{func}}, profile_bytes, profile_start);
+  } else {
+    {{callfn}}
+  }
+  check_time_limit();
+  leave_mpi_call();
+}{{endfnall_with_type}}
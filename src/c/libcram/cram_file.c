@@ -25,11 +25,17 @@
 #include <unistd.h>
 #include <stdbool.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
 #include <assert.h>
 #include <arpa/inet.h>
+#include <pthread.h>
 
 #include "cram_file.h"
 
@@ -39,25 +45,52 @@
 // Tag for cram messages
 #define CRAM_TAG 7675
 
-// Offsets of file header fields
-#define MAGIC_OFFSET       0
-#define VERSION_OFFSET     4
-#define NJOBS_OFFSET       8
-#define NPROCS_OFFSET      12
-#define MAX_JOB_OFFSET     16
+// Job count in the header of a job stream, whose counts aren't known
+// until it ends.
+#define STREAM_NUM_JOBS UINT64_MAX
 
-// offset of first job record
-#define JOB_RECORD_OFFSET  20
+// Microseconds to wait before checking a job stream for more data.
+#define STREAM_POLL_USEC 10000
+
+// Seconds to wait for the header of a file that is still being created,
+// if CRAM_STREAM_TIMEOUT isn't set.
+#define HEADER_TIMEOUT 60
+
+// Oldest and newest file format versions this library can read.  Version
+// 2 uses 32-bit ints everywhere.  Version 3 has 64-bit header fields and
+// varint counts and lengths in job records.  Version 4 adds a string table
+// that working directories and arguments can start with.  Version 5 adds
+// header flags.
+#define MIN_VERSION 2
+#define MAX_VERSION 5
 
 // max concurrent ranks to send job records to at once.
 #define MAX_CONCURRENT_PEERS 512
 
+// Default number of job records to read ahead of sends.  0 means root
+// reads and sends in lockstep, with no reader thread.
+#define DEFAULT_READ_AHEAD 0
+
+// Default number of ranks to send job records to in each scatter.
+#define DEFAULT_SCATTER_CHUNK 16384
+
 // Ideal number of bytes to use for Lustre read buffers: 2MB.
 #define LUSTRE_BUFFER_SIZE 2097152
 
 // Default cram executable name: means we should use argv[0] for exe.
 #define CRAM_DEFAULT_EXE "<exe>"
 
+// Process environment, replaced wholesale by cram_job_setup.
+extern char **environ;
+
+//
+// Ways cram_job_setup can install a job's environment.
+//
+typedef enum {
+  cram_env_swap,    // Build a complete environ array in one allocation and swap it in.
+  cram_env_setenv,  // Call setenv() once per variable (slow for large environments).
+} cram_env_mode_t;
+
 
 // ------------------------------------------------------------------------
 // Globals used by fortran arg routines
@@ -71,14 +104,37 @@ const char **cram_argv = NULL;
 // ------------------------------------------------------------------------
 
 ///
-/// Find strings efficiently in a sorted array using bsearch.
+/// Find strings efficiently in a sorted array using binary search.
+///
+static inline bool contains(size_t num_elts,
+                            const char **sorted_array,
+                            const char *string) {
+  size_t lo = 0, hi = num_elts;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    int cmp = strcmp(string, sorted_array[mid]);
+    if (cmp == 0) {
+      return true;
+    } else if (cmp < 0) {
+      hi = mid;
+    } else {
+      lo = mid + 1;
+    }
+  }
+  return false;
+}
+
+
+///
+/// Report an error in a cram file that we can't continue after, and abort.
 ///
-static inline size_t index_of(size_t num_elts,
-                              const char **sorted_array,
-                              const char *string) {
-  const char **pos = bsearch(string, sorted_array, num_elts, sizeof(char*),
-                             (int(*)(const void*, const void*))strcmp);
-  return (pos - sorted_array);
+static void decode_error(const char *message) {
+  fprintf(stderr, "%s\n", message);
+#ifdef CRAM_NO_MPI
+  exit(1);
+#else
+  PMPI_Abort(MPI_COMM_WORLD, 1);
+#endif // CRAM_NO_MPI
 }
 
 
@@ -120,6 +176,126 @@ static int file_read_int(const cram_file_t *file) {
 }
 
 
+///
+/// Read a varint from a FILE*.  Varints hold 7 bits per byte, low bits
+/// first, and all but the last byte have their high bit set.
+///
+static uint64_t file_read_varint(const cram_file_t *file) {
+  uint64_t value = 0;
+  for (int shift=0; shift < 64; shift += 7) {
+    int byte = getc(file->fd);
+    if (byte == EOF) {
+      fprintf(stderr, "Error reading cram file.  Unexpected end of file.\n");
+      exit(1);
+    }
+    value |= (uint64_t)(byte & 0x7f) << shift;
+    if (byte < 0x80) {
+      return value;
+    }
+  }
+  fprintf(stderr, "Error reading cram file.  Invalid varint.\n");
+  exit(1);
+}
+
+
+///
+/// Seconds since an arbitrary start, for timeouts.
+///
+static double monotonic_time() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+
+///
+/// Read size bytes from a file that may still be being written, like a
+/// job stream.  Bytes the writer hasn't written yet are waited for, for up
+/// to timeout seconds without new data if timeout is nonzero.  Returns
+/// false on a read error or timeout.
+///
+/// Files are opened with O_NONBLOCK, so reading an idle FIFO fails with
+/// EAGAIN instead of blocking, and we poll it for the time that is left.
+/// The end of a regular file, or of a FIFO without a writer, can't be
+/// polled, so we check it again every STREAM_POLL_USEC.
+///
+static bool stream_read(cram_file_t *file, char *buf, size_t size,
+                        size_t timeout) {
+  double deadline = monotonic_time() + timeout;
+  while (size > 0) {
+    size_t bytes = fread(buf, 1, size, file->fd);
+    buf += bytes;
+    size -= bytes;
+    if (size == 0) {
+      break;
+    }
+    if (ferror(file->fd) && errno != EAGAIN && errno != EWOULDBLOCK) {
+      return false;
+    }
+    bool at_end = feof(file->fd);
+    clearerr(file->fd);
+
+    double now = monotonic_time();
+    if (bytes > 0) {
+      deadline = now + timeout;
+    } else if (timeout && now >= deadline) {
+      errno = ETIMEDOUT;
+      return false;
+    }
+
+    // Wait for the writer.
+    if (at_end) {
+      usleep(STREAM_POLL_USEC);
+    } else {
+      struct pollfd fifo = { fileno(file->fd), POLLIN, 0 };
+      int ms = timeout ? (int)((deadline - now) * 1000) + 1 : -1;
+      if (poll(&fifo, 1, ms) < 0 && errno != EINTR) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+
+///
+/// Read a big-endian unsigned int of size bytes from a file's header,
+/// waiting for it like stream_read.
+///
+static bool header_read_uint(cram_file_t *file, size_t size, uint64_t *value,
+                             size_t timeout) {
+  unsigned char buf[8];
+  if (!stream_read(file, (char*)buf, size, timeout)) {
+    return false;
+  }
+  *value = 0;
+  for (int i=0; i < size; i++) {
+    *value = (*value << 8) | buf[i];
+  }
+  return true;
+}
+
+
+///
+/// Read a varint from a file's header, waiting for it like stream_read.
+///
+static bool header_read_varint(cram_file_t *file, uint64_t *value,
+                               size_t timeout) {
+  *value = 0;
+  for (int shift=0; shift < 64; shift += 7) {
+    unsigned char byte;
+    if (!stream_read(file, (char*)&byte, 1, timeout)) {
+      return false;
+    }
+    *value |= (uint64_t)(byte & 0x7f) << shift;
+    if (byte < 0x80) {
+      return true;
+    }
+  }
+  return false;
+}
+
+
 ///
 /// Read a cram int from a buffer
 ///
@@ -130,40 +306,237 @@ static int buf_read_int(const char *buf, size_t *offset) {
 }
 
 
+///
+/// Read a varint from a buffer.  Nearly all counts and lengths are under
+/// 128, so the common case is one load and one well-predicted branch.
+///
+static inline uint64_t buf_read_varint(const char *buf, size_t *offset) {
+  const unsigned char *bytes = (const unsigned char*)&buf[*offset];
+  uint64_t value = bytes[0];
+  if (value < 0x80) {
+    *offset += 1;
+    return value;
+  }
+
+  value &= 0x7f;
+  size_t i = 1;
+  int shift = 7;
+  do {
+    value |= (uint64_t)(bytes[i] & 0x7f) << shift;
+    shift += 7;
+  } while (bytes[i++] >= 0x80);
+
+  *offset += i;
+  return value;
+}
+
+
+///
+/// Read a varint from a buffer of size bytes that may be corrupt.  Returns
+/// false if the varint runs past the end of the buffer or is too long.
+///
+static bool buf_read_varint_checked(const char *buf, size_t size,
+                                    size_t *offset, uint64_t *value) {
+  *value = 0;
+  for (int shift=0; shift < 64 && *offset < size; shift += 7) {
+    unsigned char byte = buf[(*offset)++];
+    *value |= (uint64_t)(byte & 0x7f) << shift;
+    if (byte < 0x80) {
+      return true;
+    }
+  }
+  return false;
+}
+
+
+///
+/// Read a count or length from a job record in the given file version.
+///
+static inline size_t buf_read_count(const char *buf, size_t *offset,
+                                    int version) {
+  if (version >= 3) {
+    return buf_read_varint(buf, offset);
+  }
+  return (uint32_t)buf_read_int(buf, offset);
+}
+
+
 ///
 /// Read a cram string from a buffer
 ///
-static char *buf_read_string(const char *buf, size_t *offset) {
-  size_t size = buf_read_int(buf, offset);
+static char *buf_read_string(const char *buf, size_t *offset, int version) {
+  size_t size = buf_read_count(buf, offset, version);
   char *string = strndup(&buf[*offset], size);
   *offset += size;
   return string;
 }
 
 
-static size_t get_cram_buffer_size() {
-  const char *bufsize_string = getenv("CRAM_BUFFER_SIZE");
-  if (!bufsize_string) {
-    return LUSTRE_BUFFER_SIZE;
+///
+/// A working directory or argument from a job record.  In version 4 files,
+/// these may start with a string from the string table.
+///
+typedef struct {
+  const char *prefix;      //!< String from the string table, or NULL.
+  size_t prefix_len;       //!< Length of prefix.
+  const char *suffix;      //!< Rest of the string, in the job record.
+  size_t suffix_len;       //!< Length of suffix.
+} job_string_t;
+
+
+///
+/// Read a working directory or argument from a job record without copying
+/// it.  In version 4 files, these start with the index plus one of a string
+/// in the string table, or with 0 if they don't start with one.
+///
+static inline job_string_t buf_read_job_string(const char *buf, size_t *offset,
+                                               int version,
+                                               const cram_strings_t *strings) {
+  job_string_t string = { NULL, 0, NULL, 0 };
+  if (version >= 4) {
+    size_t index = buf_read_varint(buf, offset);
+    if (index) {
+      if (!strings || index > (size_t)strings->num_strings) {
+        decode_error("Error: Job record refers to a string that is not in "
+                     "the string table.");
+      }
+      string.prefix     = strings->strings[index - 1];
+      string.prefix_len = strings->lengths[index - 1];
+    }
   }
 
-  int rank;
+  string.suffix_len = buf_read_count(buf, offset, version);
+  string.suffix = &buf[*offset];
+  *offset += string.suffix_len;
+  return string;
+}
+
+
+///
+/// Copy a job string to dest with a null terminator, and return a pointer
+/// to the end of what was written.
+///
+static inline char *put_job_string(job_string_t string, char *dest) {
+  if (string.prefix_len) {
+    memcpy(dest, string.prefix, string.prefix_len);
+    dest += string.prefix_len;
+  }
+  memcpy(dest, string.suffix, string.suffix_len);
+  dest[string.suffix_len] = '\0';
+  return dest + string.suffix_len + 1;
+}
+
+
+///
+/// Size of a job string once decoded, including its null terminator.
+///
+static inline size_t job_string_size(job_string_t string) {
+  return string.prefix_len + string.suffix_len + 1;
+}
+
+
+///
+/// Size of all the strings in a job record once decoded with null
+/// terminators: the working directory, arguments, subtracted keys, and
+/// changed keys and values.
+///
+static size_t decoded_strings_size(const char *job_record, int version,
+                                   const cram_strings_t *strings) {
+  size_t offset = 0;
+  buf_read_count(job_record, &offset, version);    // num_procs
+
+  size_t size = job_string_size(
+    buf_read_job_string(job_record, &offset, version, strings));
+  size_t num_args = buf_read_count(job_record, &offset, version);
+  for (size_t i=0; i < num_args; i++) {
+    size += job_string_size(
+      buf_read_job_string(job_record, &offset, version, strings));
+  }
+
+  // Environment strings are never in the string table.  Their decoded size
+  // is at most their size in the record.
+  size_t num_missing = buf_read_count(job_record, &offset, version);
+  for (size_t i=0; i < num_missing; i++) {
+    size_t len = buf_read_count(job_record, &offset, version);
+    size += len + 1;
+    offset += len;
+  }
+  size_t num_changed = buf_read_count(job_record, &offset, version);
+  for (size_t i=0; i < 2 * num_changed; i++) {
+    size_t len = buf_read_count(job_record, &offset, version);
+    size += len + 1;
+    offset += len;
+  }
+  return size;
+}
+
+
+///
+/// Read a size setting from an environment variable.  Returns the default
+/// if the variable isn't set, and warns (on rank 0) if it isn't a number.
+///
+static size_t get_size_setting(const char *name, size_t default_value) {
+  const char *value_string = getenv(name);
+  if (!value_string) {
+    return default_value;
+  }
+
+  int rank = 0;
+#ifndef CRAM_NO_MPI
   PMPI_Comm_rank(MPI_COMM_WORLD, &rank);
+#endif // CRAM_NO_MPI
 
   char *endptr;
-  size_t bufsize = strtoll(bufsize_string, &endptr, 10);
-  if (*bufsize_string && *endptr == '\0') {
+  size_t value = strtoll(value_string, &endptr, 10);
+  if (*value_string && *endptr == '\0') {
     if (rank == 0) {
-      fprintf(stderr, "Using CRAM_BUFFER_SIZE=%d.\n", bufsize);
+      fprintf(stderr, "Using %s=%zu.\n", name, value);
     }
-    return bufsize;
+    return value;
   } else {
     if (rank == 0) {
-      fprintf(stderr, "Warning: Invalid value for CRAM_BUFFER_SIZE: %s.  "
-              "Using default of %d", bufsize_string, LUSTRE_BUFFER_SIZE);
+      fprintf(stderr, "Warning: Invalid value for %s: %s.  "
+              "Using default of %zu", name, value_string, default_value);
+    }
+    return default_value;
+  }
+}
+
+
+static size_t get_cram_buffer_size() {
+  return get_size_setting("CRAM_BUFFER_SIZE", LUSTRE_BUFFER_SIZE);
+}
+
+
+///
+/// Seconds to wait for a file's header: CRAM_STREAM_TIMEOUT if it is set
+/// (0 waits forever), or HEADER_TIMEOUT.  get_size_setting reports the
+/// setting when the stream is read, so this reads it quietly.
+///
+static size_t get_header_timeout() {
+  const char *value_string = getenv("CRAM_STREAM_TIMEOUT");
+  if (value_string) {
+    char *endptr;
+    size_t value = strtoll(value_string, &endptr, 10);
+    if (*value_string && *endptr == '\0') {
+      return value;
     }
-    return LUSTRE_BUFFER_SIZE;
   }
+  return HEADER_TIMEOUT;
+}
+
+
+///
+/// Gets the environment setup mode from the CRAM_ENV_MODE environment
+/// variable.  Possible values are SWAP (the default) and SETENV.
+///
+static cram_env_mode_t get_env_mode() {
+  const char *mode = getenv("CRAM_ENV_MODE");
+
+  if (mode && strcasecmp(mode, "setenv") == 0) {
+    return cram_env_setenv;
+  }
+  return cram_env_swap;
 }
 
 
@@ -172,30 +545,103 @@ static size_t get_cram_buffer_size() {
 // ------------------------------------------------------------------------
 
 bool cram_file_open(const char *filename, cram_file_t *file) {
-  file->fd = fopen(filename, "r");
+  file->string_table_size = 0;
+  file->string_table = NULL;
+
+  // Open without blocking, so that reads from a job stream in a FIFO can
+  // time out.  This has no effect on regular files.
+  int fd = open(filename, O_RDONLY | O_NONBLOCK);
+  if (fd < 0) {
+    return false;
+  }
+  file->fd = fdopen(fd, "r");
   if (file->fd == NULL) {
+    close(fd);
     return false;
   }
 
   // Try to use a large buffer to read the file fast.
   setvbuf(file->fd, NULL, _IOFBF, get_cram_buffer_size());
 
+  // A job stream's header may not be written yet, so wait for it.
+  size_t timeout = get_header_timeout();
+  uint64_t magic, version;
+  if (!header_read_uint(file, 4, &magic, timeout) ||
+      !header_read_uint(file, 4, &version, timeout)) {
+    fprintf(stderr, "Error: Couldn't read the header of %s.\n", filename);
+    return false;
+  }
+
   // check magic number at start of header
-  int magic = file_read_int(file);
   if (magic != MAGIC) {
     fprintf(stderr, "Error: %s is not a cram file!", filename);
     return false;
   }
 
   // read rest of header after magic check.
-  file->version      = file_read_int(file);
-  file->num_jobs     = file_read_int(file);
-  file->total_procs  = file_read_int(file);
-  file->max_job_size = file_read_int(file);
+  file->version = version;
+  if (version < MIN_VERSION || version > MAX_VERSION) {
+    fprintf(stderr, "Error: %s has version %llu, but this version of Cram "
+            "reads versions %d to %d.\n",
+            filename, (unsigned long long)version, MIN_VERSION, MAX_VERSION);
+    return false;
+  }
+
+  // Header counts are 4 bytes in version 2 files and 8 in version 3.
+  size_t int_size = (file->version >= 3) ? 8 : 4;
+  uint64_t num_jobs, total_procs, max_job_size;
+  if (!header_read_uint(file, int_size, &num_jobs, timeout)    ||
+      !header_read_uint(file, int_size, &total_procs, timeout) ||
+      !header_read_uint(file, int_size, &max_job_size, timeout)) {
+    fprintf(stderr, "Error: Couldn't read the header of %s.\n", filename);
+    return false;
+  }
+  uint64_t flags = 0;
+  if (file->version >= 5 && !header_read_uint(file, int_size, &flags, timeout)) {
+    fprintf(stderr, "Error: Couldn't read the header of %s.\n", filename);
+    return false;
+  }
+  file->flags = flags;
+
+  // A job stream's job count has all bits set.  Its other counts are 0.
+  file->stream = (file->version >= 3 && num_jobs == STREAM_NUM_JOBS);
+  file->num_jobs = file->stream ? 0 : num_jobs;
+
+  // Ranks and MPI counts are ints, so the counts must fit in one.
+  if ((!file->stream && num_jobs > INT_MAX) ||
+      total_procs > INT_MAX || max_job_size > INT_MAX) {
+    fprintf(stderr, "Error: %s is too large.  Jobs, processes, and job "
+            "record sizes must be at most %d.\n", filename, INT_MAX);
+    return false;
+  }
+  file->total_procs = total_procs;
+  file->max_job_size = max_job_size;
 
   file->cur_job_record_size = 0;
   file->cur_job_procs = 0;
   file->cur_job_id = -1;
+  file->base_record = false;
+
+  // Version 4 files have a string table between the header and the jobs.
+  if (file->version >= 4) {
+    uint64_t size;
+    if (!header_read_varint(file, &size, timeout)) {
+      fprintf(stderr, "Error: Couldn't read string table from %s\n", filename);
+      return false;
+    }
+    if (size > INT_MAX) {
+      fprintf(stderr, "Error: %s has a string table of %llu bytes, but "
+              "string tables must be at most %d bytes.\n",
+              filename, (unsigned long long)size, INT_MAX);
+      return false;
+    }
+    file->string_table_size = size;
+    file->string_table = malloc(size);
+    if (!stream_read(file, file->string_table, size, timeout)) {
+      fprintf(stderr, "Error: Couldn't read string table from %s\n", filename);
+      return false;
+    }
+  }
 
   return true;
 }
@@ -203,6 +649,83 @@ bool cram_file_open(const char *filename, cram_file_t *file) {
 
 void cram_file_close(const cram_file_t *file) {
   fclose(file->fd);
+  free(file->string_table);
+}
+
+
+void cram_strings_decode(const char *string_table, int size,
+                         cram_strings_t *strings) {
+  strings->num_strings = 0;
+  strings->strings = NULL;
+  strings->lengths = NULL;
+  strings->buffer = NULL;
+  if (!string_table || size == 0) {
+    return;
+  }
+
+  // Every string takes at least two bytes, so a valid table has at most
+  // size / 2 of them.  This also keeps the arrays' sizes from overflowing.
+  size_t offset = 0;
+  uint64_t num_strings;
+  if (!buf_read_varint_checked(string_table, size, &offset, &num_strings) ||
+      num_strings > (size_t)size / 2) {
+    decode_error("Error: Invalid string table in cram file.");
+  }
+  strings->num_strings = num_strings;
+  strings->strings = malloc(num_strings * sizeof(const char*));
+  strings->lengths = malloc(num_strings * sizeof(size_t));
+  if (num_strings && (!strings->strings || !strings->lengths)) {
+    decode_error("Error: Couldn't allocate the cram file's string table.");
+  }
+
+  // Find the lengths of the strings first, so they can go in one buffer.
+  // Check each one against the table, so the second pass can't overrun it.
+  size_t start = offset;
+  size_t buffer_size = 0;
+  size_t prev_len = 0;
+  for (int i=0; i < strings->num_strings; i++) {
+    uint64_t shared, rest;
+    if (!buf_read_varint_checked(string_table, size, &offset, &shared) ||
+        !buf_read_varint_checked(string_table, size, &offset, &rest)   ||
+        shared > prev_len || rest > size - offset) {
+      decode_error("Error: Invalid string table in cram file.");
+    }
+    offset += rest;
+    strings->lengths[i] = prev_len = shared + rest;
+    if (prev_len >= SIZE_MAX - buffer_size) {
+      decode_error("Error: Invalid string table in cram file.");
+    }
+    buffer_size += prev_len + 1;
+  }
+
+  // Each string starts with part of the one before it.
+  strings->buffer = malloc(buffer_size);
+  if (buffer_size && !strings->buffer) {
+    decode_error("Error: Couldn't allocate the cram file's string table.");
+  }
+  char *dest = strings->buffer;
+  const char *prev = NULL;
+  offset = start;
+  for (int i=0; i < strings->num_strings; i++) {
+    size_t shared = buf_read_varint(string_table, &offset);
+    size_t rest = buf_read_varint(string_table, &offset);
+    if (shared) {
+      memcpy(dest, prev, shared);
+    }
+    memcpy(dest + shared, &string_table[offset], rest);
+    dest[shared + rest] = '\0';
+    offset += rest;
+
+    strings->strings[i] = prev = dest;
+    dest += shared + rest + 1;
+  }
+}
+
+
+void cram_strings_free(cram_strings_t *strings) {
+  free(strings->strings);
+  free(strings->lengths);
+  free(strings->buffer);
 }
 
 
@@ -222,7 +745,7 @@ static inline void decompress(const cram_job_t *base,
   // Figure out how many environemnt variables overlap with base
   int num_overlap = 0;
   for (int i=0; i < num_changed; i++) {
-    if (index_of(base->num_env_vars, base->keys, changed_keys[i])) {
+    if (contains(base->num_env_vars, base->keys, changed_keys[i])) {
       num_overlap++;
     }
   }
@@ -238,8 +761,12 @@ static inline void decompress(const cram_job_t *base,
   // them in O(n) time.
   size_t bx=0, cx=0, mx=0, jx=0;
   while (jx < job->num_env_vars) {
-    int cmp = -1;
-    if (cx < num_changed) {
+    int cmp;
+    if (bx == base->num_env_vars) {
+      cmp = 1;    // only added keys are left.
+    } else if (cx == num_changed) {
+      cmp = -1;   // only base keys are left.
+    } else {
       cmp = strcmp(base->keys[bx], changed_keys[cx]);
     }
 
@@ -271,54 +798,68 @@ static inline void decompress(const cram_job_t *base,
 }
 
 
-void cram_job_decompress(const char *job_record,
+void cram_job_decompress(const char *job_record, int version,
+                         const cram_strings_t *strings,
                          const cram_job_t *base, cram_job_t *job) {
   // start at beginning of job record.
   size_t offset = 0;
 
   // num_procs
-  job->num_procs = buf_read_int(job_record, &offset);
+  job->num_procs = buf_read_count(job_record, &offset, version);
+
+  // Working directory and command line arguments go in one buffer.  Find
+  // its size, then go back and decode them into it.
+  size_t args_offset = offset;
+  size_t args_size = job_string_size(
+    buf_read_job_string(job_record, &offset, version, strings));
+  int num_args = buf_read_count(job_record, &offset, version);
+  for (int i=0; i < num_args; i++) {
+    args_size += job_string_size(
+      buf_read_job_string(job_record, &offset, version, strings));
+  }
 
-  // working directory
-  job->working_dir = buf_read_string(job_record, &offset);
+  char *dest = malloc(args_size);
+  offset = args_offset;
+  job->working_dir = dest;
+  dest = put_job_string(
+    buf_read_job_string(job_record, &offset, version, strings), dest);
 
-  // command line arguments
-  int num_args = buf_read_int(job_record, &offset);
+  buf_read_count(job_record, &offset, version);
   job->num_args = num_args;
   job->args = (const char**) malloc(num_args * sizeof(char*));
-
   for (int i=0; i < num_args; i++) {
-    job->args[i] = buf_read_string(job_record, &offset);
+    job->args[i] = dest;
+    dest = put_job_string(
+      buf_read_job_string(job_record, &offset, version, strings), dest);
   }
 
   // Subtracted environment variables are not in this job but are
   // in the base job.
-  int num_subtracted = buf_read_int(job_record, &offset);
+  int num_subtracted = buf_read_count(job_record, &offset, version);
 
   const char **subtracted_env_vars = NULL;
   if (num_subtracted) {
     // If there is no base job, then there can't be any subtracted vars.
     if (!base) {
-      fprintf(stderr, "Cannot decompress this job without a base job!\n");
-      PMPI_Abort(MPI_COMM_WORLD, 1);
+      decode_error("Cannot decompress this job without a base job!");
     }
 
     subtracted_env_vars = malloc(num_subtracted * sizeof(const char*));
     for (int i=0; i < num_subtracted; i++) {
-      subtracted_env_vars[i] = buf_read_string(job_record, &offset);
+      subtracted_env_vars[i] = buf_read_string(job_record, &offset, version);
     }
   }
 
   // Changed environemnt vars were either added to the base or they're different
   // in job from in base.
-  int num_changed = buf_read_int(job_record, &offset);
+  int num_changed = buf_read_count(job_record, &offset, version);
 
   const char **changed_keys = malloc(num_changed * sizeof(const char*));
   const char **changed_vals = malloc(num_changed * sizeof(const char*));
   for (int i=0; i < num_changed; i++) {
-    changed_keys[i] = buf_read_string(job_record, &offset);
+    changed_keys[i] = buf_read_string(job_record, &offset, version);
 
-    changed_vals[i] = buf_read_string(job_record, &offset);
+    changed_vals[i] = buf_read_string(job_record, &offset, version);
   }
 
   if (base) {
@@ -341,10 +882,11 @@ void cram_job_decompress(const char *job_record,
 
 
 bool cram_file_next_job(cram_file_t *file, char *job_record) {
-  int job_record_size = file_read_int(file);
+  uint64_t job_record_size = (file->version >= 3) ?
+    file_read_varint(file) : (uint32_t)file_read_int(file);
   if (job_record_size > file->max_job_size) {
-    fprintf(stderr, "Error: Invalid job record size: %d > %d",
-            job_record_size, file->max_job_size);
+    fprintf(stderr, "Error: Invalid job record size: %llu > %d",
+            (unsigned long long)job_record_size, file->max_job_size);
     return false;
   }
 
@@ -352,115 +894,1436 @@ bool cram_file_next_job(cram_file_t *file, char *job_record) {
   size_t bytes = fread(job_record, 1, job_record_size, file->fd);
   if (bytes != job_record_size) {
     fprintf(stderr, "Error: Expected to read %d bytes, but got %zd\n",
-            job_record_size, bytes);
+            file->cur_job_record_size, bytes);
     return false;
   }
 
   size_t offset = 0;
-  file->cur_job_procs = buf_read_int(job_record, &offset);
-  file->cur_job_id++;
+  file->cur_job_procs = buf_read_count(job_record, &offset, file->version);
+
+  // A first record with no processes is a base record, not a job.
+  if (file->version >= 3 && file->cur_job_id < 0 && !file->base_record &&
+      file->cur_job_procs == 0) {
+    file->base_record = true;
+  } else {
+    file->cur_job_id++;
+  }
 
   return true;
 }
 
 
-void cram_file_bcast_jobs(cram_file_t *file, int root, cram_job_t *job, int *id,
-                          MPI_Comm comm) {
-  int rank, size;
-  PMPI_Comm_rank(comm, &rank);
-  PMPI_Comm_size(comm, &size);
+bool cram_file_skip_job(cram_file_t *file) {
+  uint64_t job_record_size = (file->version >= 3) ?
+    file_read_varint(file) : (uint32_t)file_read_int(file);
+  if (job_record_size > file->max_job_size) {
+    fprintf(stderr, "Error: Invalid job record size: %llu > %d",
+            (unsigned long long)job_record_size, file->max_job_size);
+    return false;
+  }
 
-  // check total procs and grab the max job size.
-  int max_job_size;
-  if (rank == root) {
-    if (file->total_procs > size) {
-      fprintf(stderr, "Error: This cram file requires %d processes, "
-              "but this communicator has only %d.\n", file->total_procs, size);
-      PMPI_Abort(comm, 1);
+  // Read the number of processes, then seek past the rest of the record.
+  file->cur_job_record_size = job_record_size;
+  size_t procs_size;
+  if (file->version >= 3) {
+    file->cur_job_procs = file_read_varint(file);
+    procs_size = 1;
+    for (uint64_t v = file->cur_job_procs; v >= 0x80; v >>= 7) {
+      procs_size++;
     }
-    max_job_size = file->max_job_size;
+  } else {
+    file->cur_job_procs = file_read_int(file);
+    procs_size = sizeof(int);
   }
 
-  // bcast max job size
-  PMPI_Bcast(&max_job_size, 1, MPI_INT, root, comm);
-  char *job_record = malloc(max_job_size);
+  if (procs_size > job_record_size ||
+      fseeko(file->fd, job_record_size - procs_size, SEEK_CUR) != 0) {
+    fprintf(stderr, "Error: Couldn't skip job record of %llu bytes\n",
+            (unsigned long long)job_record_size);
+    return false;
+  }
 
-  // read in compressed data for first job record
-  if (rank == root) {
-    if (!cram_file_next_job(file, job_record)) {
-      fprintf(stderr, "Error reading job %d from cram file on rank %d\n",
-              0, root);
-      PMPI_Abort(comm, 1);
-    }
+  // A first record with no processes is a base record, not a job.
+  if (file->version >= 3 && file->cur_job_id < 0 && !file->base_record &&
+      file->cur_job_procs == 0) {
+    file->base_record = true;
+  } else {
+    file->cur_job_id++;
   }
 
-  // Bcast and decompress first job.
-  cram_job_t first_job;
-  PMPI_Bcast(job_record, max_job_size, MPI_CHAR, root, comm);
-  cram_job_decompress(job_record, NULL, &first_job);
+  return true;
+}
 
-  // start by sending to the first rank in the second job.
-  int cur_rank = first_job.num_procs;
-  bool in_first_job = rank < cur_rank;
 
-  if (rank == root) {
-    // Root needs to send to all the other jobs
-    // Start by iterating through remaining jobs in the file.
-    while (cram_file_has_more_jobs(file)) {
+bool cram_file_find_job(cram_file_t *file, int id, cram_job_t *job) {
+  char *job_record = malloc(file->max_job_size);
+  bool found = false;
+
+  cram_strings_t strings;
+  cram_strings_decode(file->string_table, file->string_table_size, &strings);
+
+  // The first record is the base that all others are decompressed against.
+  // It is job 0 unless the file has a base record.
+  cram_job_t base;
+  if (cram_file_next_job(file, job_record)) {
+    cram_job_decompress(job_record, file->version, &strings, NULL, &base);
+    if (id == 0 && !file->base_record) {
+      cram_job_copy(&base, job);
+      found = true;
+    }
+
+    while (!found && cram_file_has_more_jobs(file)) {
       if (!cram_file_next_job(file, job_record)) {
-        fprintf(stderr, "Error reading job %d from cram file on rank %d\n",
-                file->cur_job_id + 1, root);
-        PMPI_Abort(comm, 1);
+        break;
       }
-
-      // array of requests for all sends we'll do
-      // max concurrent peers max number of ranks we'll send to at once.
-      int max_requests = MAX_CONCURRENT_PEERS * 2;
-      MPI_Request requests[max_requests];
-
-      // iterate through all ranks in this job, incrementing first_rank as we go.
-      int end_rank = cur_rank + file->cur_job_procs;
-      while (cur_rank < end_rank) {
-        int r = 0;
-        while (r < max_requests && cur_rank < end_rank) {
-          PMPI_Isend(&file->cur_job_id, 1, MPI_INT, cur_rank,
-                     CRAM_TAG, comm, &requests[r++]);
-          PMPI_Isend(job_record, file->cur_job_record_size, MPI_CHAR, cur_rank,
-                     CRAM_TAG, comm, &requests[r++]);
-          cur_rank++;
-        }
-        PMPI_Waitall(r, requests, MPI_STATUSES_IGNORE);
+      if (file->cur_job_id == id) {
+        cram_job_decompress(job_record, file->version, &strings, &base, job);
+        found = true;
       }
     }
+    cram_job_free(&base);
+  }
 
-    // send a job id of -1 to any inactive ranks
-    int inactive_rank_id = -1;
-    for (; cur_rank < size; cur_rank++) {
-      PMPI_Send(&inactive_rank_id, 1, MPI_INT, cur_rank, CRAM_TAG, comm);
-    }
+  cram_strings_free(&strings);
+  free(job_record);
+  return found;
+}
 
-  } else if (!in_first_job) {
-    // Ranks NOT in the first job need to receive their actual job record.
-    // Ranks in the first job already have their job record.
+
+#ifndef CRAM_NO_MPI
+
+// ------------------------------------------------------------------------
+// Shared base job
+// ------------------------------------------------------------------------
+
+#if MPI_VERSION >= 3
+
+///
+/// The first job in a cram file, decoded once per node into an MPI-3
+/// shared memory window.  The node leader writes the job into the window
+/// as a header of counts followed by null-terminated strings; every rank
+/// on the node then points a cram_job_t at those strings instead of
+/// keeping its own copy.
+///
+struct shared_job_t {
+  MPI_Comm node_comm;   //!< Ranks on this node.
+  MPI_Win win;          //!< Window holding the decoded job.
+};
+typedef struct shared_job_t shared_job_t;
+
+
+///
+/// Copy a cram string from a record to dest as a null-terminated string,
+/// and advance dest past it.
+///
+static void decode_string(const char *job_record, size_t *offset, int version,
+                          char **dest) {
+  size_t len = buf_read_count(job_record, offset, version);
+  memcpy(*dest, &job_record[*offset], len);
+  (*dest)[len] = '\0';
+  *dest += len + 1;
+  *offset += len;
+}
+
+
+///
+/// Decode a job record that has no base into buf, which must have room for
+/// three ints and decoded_strings_size() bytes.
+///
+static void decode_base_record(const char *job_record, int version,
+                               const cram_strings_t *strings, char *buf) {
+  size_t offset = 0;
+  int *header = (int*)buf;
+  char *dest = buf + 3 * sizeof(int);
+
+  header[0] = buf_read_count(job_record, &offset, version);  // num_procs
+  dest = put_job_string(                                     // working dir
+    buf_read_job_string(job_record, &offset, version, strings), dest);
+
+  header[1] = buf_read_count(job_record, &offset, version);  // num_args
+  for (int i=0; i < header[1]; i++) {
+    dest = put_job_string(
+      buf_read_job_string(job_record, &offset, version, strings), dest);
+  }
+
+  if (buf_read_count(job_record, &offset, version) != 0) {
+    decode_error("Cannot decompress this job without a base job!");
+  }
+
+  header[2] = buf_read_count(job_record, &offset, version);  // num_env_vars
+  for (int i=0; i < 2 * header[2]; i++) {
+    decode_string(job_record, &offset, version, &dest);      // key, then value
+  }
+}
+
+
+///
+/// Point a job at a base job decoded by decode_base_record.  Only the
+/// pointer arrays are allocated; the strings stay in buf, so free the job
+/// with free_shared_base_job rather than cram_job_free.
+///
+static void attach_base_job(const char *buf, cram_job_t *job) {
+  const int *header = (const int*)buf;
+  const char *str = buf + 3 * sizeof(int);
+
+  job->num_procs    = header[0];
+  job->num_args     = header[1];
+  job->num_env_vars = header[2];
+
+  job->args   = malloc(job->num_args * sizeof(const char*));
+  job->keys   = malloc(job->num_env_vars * sizeof(const char*));
+  job->values = malloc(job->num_env_vars * sizeof(const char*));
+
+  job->working_dir = str;
+  str += strlen(str) + 1;
+
+  for (int i=0; i < job->num_args; i++) {
+    job->args[i] = str;
+    str += strlen(str) + 1;
+  }
+
+  for (int i=0; i < job->num_env_vars; i++) {
+    job->keys[i] = str;
+    str += strlen(str) + 1;
+    job->values[i] = str;
+    str += strlen(str) + 1;
+  }
+}
+
+
+///
+/// Collective.  Distribute the first job record (valid on root) and decode
+/// it once per node into a shared window.  Only node leaders receive the
+/// record.  On return, base points into the window on every rank.
+///
+static void share_base_job(char *job_record, int max_job_size, int version,
+                           const cram_strings_t *strings,
+                           int root, MPI_Comm comm, shared_job_t *shared,
+                           cram_job_t *base) {
+  int rank;
+  PMPI_Comm_rank(comm, &rank);
+
+  // Order root first so that it leads its node and is rank 0 among leaders.
+  int key = (rank == root) ? -1 : rank;
+  PMPI_Comm_split_type(comm, MPI_COMM_TYPE_SHARED, key, MPI_INFO_NULL,
+                       &shared->node_comm);
+  int node_rank;
+  PMPI_Comm_rank(shared->node_comm, &node_rank);
+
+  MPI_Comm leader_comm;
+  PMPI_Comm_split(comm, node_rank == 0 ? 0 : MPI_UNDEFINED, key, &leader_comm);
+
+  // Leaders get the record; everyone else allocates no shared memory.
+  MPI_Aint win_size = 0;
+  char *buf;
+  if (node_rank == 0) {
+    PMPI_Bcast(job_record, max_job_size, MPI_CHAR, 0, leader_comm);
+    PMPI_Comm_free(&leader_comm);
+    win_size = 3 * sizeof(int) +
+      decoded_strings_size(job_record, version, strings);
+  }
+  PMPI_Win_allocate_shared(win_size, 1, MPI_INFO_NULL, shared->node_comm,
+                           &buf, &shared->win);
+
+  PMPI_Win_fence(0, shared->win);
+  if (node_rank == 0) {
+    decode_base_record(job_record, version, strings, buf);
+  }
+  PMPI_Win_fence(0, shared->win);
+
+  int disp_unit;
+  PMPI_Win_shared_query(shared->win, 0, &win_size, &disp_unit, &buf);
+  attach_base_job(buf, base);
+}
+
+
+///
+/// Collective.  Free a job created by share_base_job and its window.
+///
+static void free_shared_base_job(shared_job_t *shared, cram_job_t *base) {
+  free(base->args);
+  free(base->keys);
+  free(base->values);
+  PMPI_Win_free(&shared->win);
+  PMPI_Comm_free(&shared->node_comm);
+}
+
+#endif // MPI_VERSION >= 3
+
+
+// ------------------------------------------------------------------------
+// Pipelined reading
+// ------------------------------------------------------------------------
+
+///
+/// Ring of job record buffers shared by a reader thread and the thread
+/// that sends records.  The reader fills free slots with records from the
+/// cram file while the sender posts sends from full slots, so that disk
+/// and network time overlap.
+///
+/// Slots are used in order.  Starting at head, there are <taken> slots the
+/// sender is using, then <filled> slots waiting to be taken.  The rest
+/// are free for the reader.
+///
+struct record_ring_t {
+  cram_file_t *file;     //!< File the reader thread reads from.
+  int num_slots;         //!< Number of record buffers in the ring.
+  char *records;         //!< num_slots buffers of file->max_job_size bytes.
+  int *sizes;            //!< Size of the record in each slot.
+  int *procs;            //!< Number of processes in each slot's job.
+  int *ids;              //!< Job id of each slot's job.
+
+  int head;              //!< Oldest slot taken by the sender.
+  int taken;             //!< Slots taken by the sender and not yet released.
+  int filled;            //!< Slots read and waiting to be taken.
+  bool done;             //!< Reader has read all jobs in the file.
+  bool failed;           //!< Reader hit an error.
+
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  pthread_t reader;
+};
+typedef struct record_ring_t record_ring_t;
+
+
+static inline char *ring_record(record_ring_t *ring, int slot) {
+  return ring->records + (size_t)slot * ring->file->max_job_size;
+}
+
+
+///
+/// Reader thread body.  Only does file I/O; it makes no MPI calls.
+///
+static void *ring_reader(void *arg) {
+  record_ring_t *ring = arg;
+
+  while (cram_file_has_more_jobs(ring->file)) {
+    // wait for a free slot
+    pthread_mutex_lock(&ring->lock);
+    while (ring->taken + ring->filled == ring->num_slots) {
+      pthread_cond_wait(&ring->changed, &ring->lock);
+    }
+    int slot = (ring->head + ring->taken + ring->filled) % ring->num_slots;
+    pthread_mutex_unlock(&ring->lock);
+
+    // The slot is ours until we mark it filled, so read without the lock.
+    bool ok = cram_file_next_job(ring->file, ring_record(ring, slot));
+
+    pthread_mutex_lock(&ring->lock);
+    if (!ok) {
+      ring->failed = true;
+      pthread_cond_signal(&ring->changed);
+      pthread_mutex_unlock(&ring->lock);
+      return NULL;
+    }
+    ring->sizes[slot] = ring->file->cur_job_record_size;
+    ring->procs[slot] = ring->file->cur_job_procs;
+    ring->ids[slot]   = ring->file->cur_job_id;
+    ring->filled++;
+    pthread_cond_signal(&ring->changed);
+    pthread_mutex_unlock(&ring->lock);
+  }
+
+  pthread_mutex_lock(&ring->lock);
+  ring->done = true;
+  pthread_cond_signal(&ring->changed);
+  pthread_mutex_unlock(&ring->lock);
+  return NULL;
+}
+
+
+static void ring_start(record_ring_t *ring, cram_file_t *file, int num_slots) {
+  ring->file      = file;
+  ring->num_slots = num_slots;
+  ring->records   = malloc((size_t)num_slots * file->max_job_size);
+  ring->sizes     = malloc(num_slots * sizeof(int));
+  ring->procs     = malloc(num_slots * sizeof(int));
+  ring->ids       = malloc(num_slots * sizeof(int));
+
+  ring->head   = 0;
+  ring->taken  = 0;
+  ring->filled = 0;
+  ring->done   = false;
+  ring->failed = false;
+
+  pthread_mutex_init(&ring->lock, NULL);
+  pthread_cond_init(&ring->changed, NULL);
+  pthread_create(&ring->reader, NULL, ring_reader, ring);
+}
+
+
+static void ring_finish(record_ring_t *ring) {
+  pthread_join(ring->reader, NULL);
+  pthread_cond_destroy(&ring->changed);
+  pthread_mutex_destroy(&ring->lock);
+  free(ring->records);
+  free(ring->sizes);
+  free(ring->procs);
+  free(ring->ids);
+}
+
+
+///
+/// Take the next full slot from the ring.  If block is false, returns -1
+/// right away when no record is ready.  Otherwise waits, and returns -1
+/// only once all records have been taken.  Aborts if the reader failed.
+///
+static int ring_take(record_ring_t *ring, bool block, MPI_Comm comm) {
+  pthread_mutex_lock(&ring->lock);
+  while (block && !ring->filled && !ring->done && !ring->failed) {
+    pthread_cond_wait(&ring->changed, &ring->lock);
+  }
+
+  if (!ring->filled && ring->failed) {
+    pthread_mutex_unlock(&ring->lock);
+    fprintf(stderr, "Error reading job %d from cram file.\n",
+            ring->file->cur_job_id + 1);
+    PMPI_Abort(comm, 1);
+  }
+
+  int slot = -1;
+  if (ring->filled) {
+    slot = (ring->head + ring->taken) % ring->num_slots;
+    ring->taken++;
+    ring->filled--;
+  }
+  pthread_mutex_unlock(&ring->lock);
+  return slot;
+}
+
+
+///
+/// Give the oldest <count> taken slots back to the reader.
+///
+static void ring_release(record_ring_t *ring, int count) {
+  pthread_mutex_lock(&ring->lock);
+  ring->head = (ring->head + count) % ring->num_slots;
+  ring->taken -= count;
+  pthread_cond_signal(&ring->changed);
+  pthread_mutex_unlock(&ring->lock);
+}
+
+
+///
+/// Root side of cram_file_bcast_jobs with a reader thread.  Records are
+/// prefetched into a ring of read_ahead buffers, and sends for consecutive
+/// jobs share one Waitall window of up to MAX_CONCURRENT_PEERS ranks, so
+/// many small jobs don't each pay for their own Waitall.  Sends are
+/// completed whenever the window fills, the ring runs out of free slots,
+/// or no record is ready yet.
+///
+/// Returns the first rank after the last job.
+///
+static int pipelined_send_jobs(cram_file_t *file, int read_ahead, int cur_rank,
+                               MPI_Comm comm) {
+  record_ring_t ring;
+  ring_start(&ring, file, read_ahead);
+
+  int max_requests = MAX_CONCURRENT_PEERS * 2;
+  MPI_Request requests[max_requests];
+  int r = 0;
+
+  while (true) {
+    // Don't sit on posted sends while waiting for the disk.
+    int slot = ring_take(&ring, false, comm);
+    if (slot < 0) {
+      PMPI_Waitall(r, requests, MPI_STATUSES_IGNORE);
+      r = 0;
+      ring_release(&ring, ring.taken);
+      slot = ring_take(&ring, true, comm);
+    }
+    if (slot < 0) {
+      break;  // all jobs sent.
+    }
+
+    char *record = ring_record(&ring, slot);
+    int end_rank = cur_rank + ring.procs[slot];
+    while (cur_rank < end_rank) {
+      if (r == max_requests) {
+        // Window is full: everything but the current job can be released.
+        PMPI_Waitall(r, requests, MPI_STATUSES_IGNORE);
+        r = 0;
+        ring_release(&ring, ring.taken - 1);
+      }
+      PMPI_Isend(&ring.ids[slot], 1, MPI_INT, cur_rank,
+                 CRAM_TAG, comm, &requests[r++]);
+      PMPI_Isend(record, ring.sizes[slot], MPI_CHAR, cur_rank,
+                 CRAM_TAG, comm, &requests[r++]);
+      cur_rank++;
+    }
+
+    // The reader needs a free slot to make progress.
+    if (ring.taken == ring.num_slots) {
+      PMPI_Waitall(r, requests, MPI_STATUSES_IGNORE);
+      r = 0;
+      ring_release(&ring, ring.taken);
+    }
+  }
+
+  ring_finish(&ring);
+  return cur_rank;
+}
+
+
+// ------------------------------------------------------------------------
+// Pulled distribution
+// ------------------------------------------------------------------------
+
+//
+// Ways cram_file_bcast_jobs can get job records to the ranks that run them.
+//
+typedef enum {
+  cram_distribute_push,  // Root sends every rank its record.
+  cram_distribute_pull,  // Ranks get their own records from windows on root.
+  cram_distribute_scatter, // Root scatters records to windows of ranks.
+  cram_distribute_node,  // Root sends each node its records in one message.
+} cram_distribution_t;
+
+
+///
+/// Gets the distribution mode from the CRAM_DISTRIBUTION environment
+/// variable.  Possible values are PUSH (the default), PULL, SCATTER, and
+/// NODE.  NODE needs MPI-3, and falls back to PUSH without it.
+///
+static cram_distribution_t get_distribution() {
+  const char *mode = getenv("CRAM_DISTRIBUTION");
+
+  if (mode && strcasecmp(mode, "pull") == 0) {
+    return cram_distribute_pull;
+  } else if (mode && strcasecmp(mode, "scatter") == 0) {
+    return cram_distribute_scatter;
+#if MPI_VERSION >= 3
+  } else if (mode && strcasecmp(mode, "node") == 0) {
+    return cram_distribute_node;
+#endif // MPI_VERSION >= 3
+  }
+  return cram_distribute_push;
+}
+
+
+///
+/// Collective.  Distributes the jobs after the first by letting ranks pull
+/// them.  Root reads the rest of the file, exposes the records and a table
+/// of record offsets in windows, and broadcasts the first rank of each
+/// job.  Every other rank finds its job from those first ranks and gets
+/// its offsets and record from root's windows, so root does no work per
+/// rank and the gets are served in parallel.
+///
+/// cur_rank is the first rank after the first job.  job_record must have
+/// room for max_job_size bytes.
+///
+static void pull_jobs(cram_file_t *file, int root, int cur_rank,
+                      bool in_first_job, char *job_record, int version,
+                      const cram_strings_t *strings, const cram_job_t *base,
+                      cram_job_t *job, int *id, MPI_Comm comm) {
+  int rank;
+  PMPI_Comm_rank(comm, &rank);
+
+  // Root reads all the remaining records into one buffer.  header is the
+  // number of jobs read and the id of the first one.
+  char *records = NULL;
+  MPI_Aint *offsets = NULL;
+  int *first_ranks = NULL;
+  size_t records_size = 0;
+  int header[2] = { 0, 0 };
+
+  if (rank == root) {
+    size_t capacity = 0;
+    int max_jobs = 0;
+    int num_jobs = 0;
+    header[1] = file->cur_job_id + 1;
+
+    while (cram_file_has_more_jobs(file)) {
+      if (capacity - records_size < (size_t)file->max_job_size) {
+        capacity = 2 * capacity + file->max_job_size;
+        records = realloc(records, capacity);
+      }
+      if (num_jobs + 1 >= max_jobs) {
+        max_jobs = 2 * max_jobs + 1024;
+        offsets = realloc(offsets, max_jobs * sizeof(MPI_Aint));
+        first_ranks = realloc(first_ranks, max_jobs * sizeof(int));
+      }
+      if (!cram_file_next_job(file, records + records_size)) {
+        fprintf(stderr, "Error reading job %d from cram file on rank %d\n",
+                file->cur_job_id + 1, root);
+        PMPI_Abort(comm, 1);
+      }
+      offsets[num_jobs] = records_size;
+      first_ranks[num_jobs] = cur_rank;
+      records_size += file->cur_job_record_size;
+      cur_rank += file->cur_job_procs;
+      num_jobs++;
+    }
+
+    // One more entry bounds the last job.
+    if (!offsets) {
+      offsets = malloc(sizeof(MPI_Aint));
+      first_ranks = malloc(sizeof(int));
+    }
+    offsets[num_jobs] = records_size;
+    first_ranks[num_jobs] = cur_rank;
+    header[0] = num_jobs;
+  }
+
+  PMPI_Bcast(header, 2, MPI_INT, root, comm);
+  int num_jobs = header[0];
+  if (rank != root) {
+    first_ranks = malloc((num_jobs + 1) * sizeof(int));
+  }
+  PMPI_Bcast(first_ranks, num_jobs + 1, MPI_INT, root, comm);
+
+  MPI_Win record_win, offset_win;
+  PMPI_Win_create(records, records_size, 1, MPI_INFO_NULL, comm, &record_win);
+  PMPI_Win_create(offsets, (rank == root) ? (num_jobs + 1) * sizeof(MPI_Aint) : 0,
+                  sizeof(MPI_Aint), MPI_INFO_NULL, comm, &offset_win);
+
+  if (!in_first_job) {
+    *id = -1;
+    if (rank < first_ranks[num_jobs]) {
+      // Find the last job starting at or before this rank.
+      int lo = 0, hi = num_jobs - 1;
+      while (lo < hi) {
+        int mid = lo + (hi - lo + 1) / 2;
+        if (first_ranks[mid] <= rank) {
+          lo = mid;
+        } else {
+          hi = mid - 1;
+        }
+      }
+
+      MPI_Aint range[2];
+      PMPI_Win_lock(MPI_LOCK_SHARED, root, 0, offset_win);
+      PMPI_Get(range, 2, MPI_AINT, root, lo, 2, MPI_AINT, offset_win);
+      PMPI_Win_unlock(root, offset_win);
+
+      int record_size = range[1] - range[0];
+      PMPI_Win_lock(MPI_LOCK_SHARED, root, 0, record_win);
+      PMPI_Get(job_record, record_size, MPI_CHAR, root, range[0], record_size,
+               MPI_CHAR, record_win);
+      PMPI_Win_unlock(root, record_win);
+
+      cram_job_decompress(job_record, version, strings, base, job);
+      *id = header[1] + lo;
+    }
+  }
+
+  // Freeing the windows waits for everyone's gets.
+  PMPI_Win_free(&record_win);
+  PMPI_Win_free(&offset_win);
+  free(records);
+  free(offsets);
+  free(first_ranks);
+}
+
+
+// ------------------------------------------------------------------------
+// Scattered distribution
+// ------------------------------------------------------------------------
+
+///
+/// Payloads for one window of ranks, packed by root.  Each rank's payload
+/// is its job id followed by its job record, or just -1 if it has no job.
+/// sizes and displs have an entry for every rank in the communicator, and
+/// are zero outside the window.
+///
+struct scatter_chunk_t {
+  int *sizes;           //!< Size of each rank's payload.
+  int *displs;          //!< Offset of each rank's payload in payloads.
+  int *ones;            //!< 1 for ranks in the window, for scattering sizes.
+  char *payloads;       //!< Payloads for the ranks in the window.
+  size_t capacity;      //!< Allocated size of payloads.
+  int start, count;     //!< First rank in the window and number of ranks.
+};
+typedef struct scatter_chunk_t scatter_chunk_t;
+
+
+///
+/// Scatterv, nonblocking where MPI supports it so that root can pack the
+/// next window while this one is delivered.
+///
+static void start_scatterv(const void *sendbuf, const int *counts,
+                           const int *displs, MPI_Datatype type, void *recvbuf,
+                           int recvcount, int root, MPI_Comm comm,
+                           MPI_Request *request) {
+#if MPI_VERSION >= 3
+  PMPI_Iscatterv(sendbuf, counts, displs, type, recvbuf, recvcount, type,
+                 root, comm, request);
+#else
+  PMPI_Scatterv(sendbuf, counts, displs, type, recvbuf, recvcount, type,
+                root, comm);
+  *request = MPI_REQUEST_NULL;
+#endif // MPI_VERSION >= 3
+}
+
+
+///
+/// Pack payloads for ranks [start, start + count) on root, reading records
+/// from the file as jobs run out of processes.  Ranks before first_rank
+/// are in the first job and get nothing.  procs_left is the number of
+/// ranks still to be given the record in job_record.
+///
+static void pack_scatter_chunk(cram_file_t *file, char *job_record,
+                               int *procs_left, int first_rank, int start,
+                               int count, scatter_chunk_t *chunk,
+                               MPI_Comm comm) {
+  // Clear the previous window this chunk was used for.
+  for (int r = chunk->start; r < chunk->start + chunk->count; r++) {
+    chunk->sizes[r] = chunk->ones[r] = 0;
+  }
+  chunk->start = start;
+  chunk->count = count;
+
+  size_t offset = 0;
+  for (int r = start; r < start + count; r++) {
+    chunk->ones[r] = 1;
+    chunk->displs[r] = offset;
+    if (r < first_rank) {
+      continue;
+    }
+
+    while (*procs_left == 0 && cram_file_has_more_jobs(file)) {
+      if (!cram_file_next_job(file, job_record)) {
+        fprintf(stderr, "Error reading job %d from cram file.\n",
+                file->cur_job_id + 1);
+        PMPI_Abort(comm, 1);
+      }
+      *procs_left = file->cur_job_procs;
+    }
+
+    int id = -1;
+    int record_size = 0;
+    if (*procs_left > 0) {
+      id = file->cur_job_id;
+      record_size = file->cur_job_record_size;
+      (*procs_left)--;
+    }
+
+    size_t size = sizeof(int) + record_size;
+    if (offset + size > chunk->capacity) {
+      chunk->capacity = 2 * chunk->capacity + size;
+      chunk->payloads = realloc(chunk->payloads, chunk->capacity);
+    }
+    memcpy(chunk->payloads + offset, &id, sizeof(int));
+    memcpy(chunk->payloads + offset + sizeof(int), job_record, record_size);
+    chunk->sizes[r] = size;
+    offset += size;
+  }
+}
+
+
+///
+/// Collective.  Distributes the jobs after the first with Scatterv over
+/// windows of CRAM_SCATTER_CHUNK ranks.  For each window, root scatters
+/// the payload sizes and then the payloads, and packs the next window
+/// from the file while the current one is in flight.
+///
+/// cur_rank is the first rank after the first job.  job_record must have
+/// room for max_job_size bytes.
+///
+static void scatter_jobs(cram_file_t *file, int root, int cur_rank,
+                         char *job_record, int max_job_size, int version,
+                         const cram_strings_t *strings, const cram_job_t *base,
+                         cram_job_t *job, int *id, MPI_Comm comm) {
+  int rank, size;
+  PMPI_Comm_rank(comm, &rank);
+  PMPI_Comm_size(comm, &size);
+
+  // Offsets in a window's payloads must fit in an int.
+  size_t chunk_size = get_size_setting("CRAM_SCATTER_CHUNK", DEFAULT_SCATTER_CHUNK);
+  size_t max_chunk = INT_MAX / (sizeof(int) + max_job_size);
+  if (chunk_size > max_chunk) {
+    chunk_size = max_chunk;
+  }
+  if (chunk_size < 1) {
+    chunk_size = 1;
+  }
+  int num_chunks = (size + chunk_size - 1) / chunk_size;
+
+  // Root alternates between two chunks: one in flight, one being packed.
+  // Sizes are scattered straight from each chunk's sizes array.
+  scatter_chunk_t chunks[2];
+  memset(chunks, 0, sizeof(chunks));
+  int *size_displs = NULL;
+  int procs_left = 0;
+  if (rank == root) {
+    size_displs = malloc(size * sizeof(int));
+    for (int r=0; r < size; r++) {
+      size_displs[r] = r;
+    }
+    for (int i=0; i < 2; i++) {
+      chunks[i].sizes  = calloc(size, sizeof(int));
+      chunks[i].displs = calloc(size, sizeof(int));
+      chunks[i].ones   = calloc(size, sizeof(int));
+    }
+    pack_scatter_chunk(file, job_record, &procs_left, cur_rank, 0,
+                       (size < (int)chunk_size) ? size : chunk_size,
+                       &chunks[0], comm);
+  }
+
+  char *payload = malloc(sizeof(int) + max_job_size);
+  int payload_size = 0;
+  int my_chunk = rank / chunk_size;
+  MPI_Request *requests = malloc(2 * num_chunks * sizeof(MPI_Request));
+
+  for (int c=0; c < num_chunks; c++) {
+    scatter_chunk_t *chunk = &chunks[c % 2];
+    bool mine = (c == my_chunk);
+
+    start_scatterv(chunk->sizes, chunk->ones, size_displs, MPI_INT,
+                   &payload_size, mine ? 1 : 0, root, comm, &requests[2*c]);
+    if (mine) {
+      PMPI_Wait(&requests[2*c], MPI_STATUS_IGNORE);
+    }
+    start_scatterv(chunk->payloads, chunk->sizes, chunk->displs, MPI_CHAR,
+                   payload, mine ? payload_size : 0, root, comm,
+                   &requests[2*c + 1]);
+
+    if (rank == root && c + 1 < num_chunks) {
+      // Pack the next window into the other chunk once it's delivered.
+      scatter_chunk_t *next = &chunks[(c + 1) % 2];
+      if (c > 0) {
+        PMPI_Waitall(2, &requests[2*(c - 1)], MPI_STATUSES_IGNORE);
+      }
+      int start = (c + 1) * chunk_size;
+      int count = (size - start < (int)chunk_size) ? size - start : chunk_size;
+      pack_scatter_chunk(file, job_record, &procs_left, cur_rank, start, count,
+                         next, comm);
+    }
+  }
+  PMPI_Waitall(2 * num_chunks, requests, MPI_STATUSES_IGNORE);
+  free(requests);
+
+  if (payload_size > 0) {
+    memcpy(id, payload, sizeof(int));
+    if (*id >= 0) {
+      cram_job_decompress(payload + sizeof(int), version, strings, base, job);
+    }
+  }
+  free(payload);
+
+  if (rank == root) {
+    for (int i=0; i < 2; i++) {
+      free(chunks[i].sizes);
+      free(chunks[i].displs);
+      free(chunks[i].ones);
+      free(chunks[i].payloads);
+    }
+    free(size_displs);
+  }
+}
+
+
+// ------------------------------------------------------------------------
+// Node-aggregated distribution
+// ------------------------------------------------------------------------
+
+#if MPI_VERSION >= 3
+
+///
+/// Records for all the ranks on one node, packed by root.  The batch
+/// starts with a table of two ints per rank on the node, in node rank
+/// order: the rank's job id (-1 for none) and the offset of its job record
+/// in the batch.  The records follow the table.  Ranks on the node that
+/// run the same job share one copy of its record.
+///
+struct node_batch_t {
+  char *buf;            //!< Table followed by records.
+  size_t size;          //!< Bytes used in buf.
+  size_t capacity;      //!< Allocated size of buf.
+  int unassigned;       //!< Ranks on the node still waiting for a job.
+  int last_id;          //!< Job whose record was appended last.
+  int last_offset;      //!< Offset of that record in buf.
+  bool sent;            //!< Whether the batch has been sent.
+};
+typedef struct node_batch_t node_batch_t;
+
+
+///
+/// Give the rank at local_index on a node the current job in the file,
+/// whose record is in job_record.
+///
+static void add_to_batch(node_batch_t *batch, int local_index,
+                         cram_file_t *file, const char *job_record) {
+  if (batch->last_id != file->cur_job_id) {
+    size_t record_size = file->cur_job_record_size;
+    if (batch->size + record_size > batch->capacity) {
+      batch->capacity = 2 * batch->capacity + record_size;
+      batch->buf = realloc(batch->buf, batch->capacity);
+    }
+    memcpy(batch->buf + batch->size, job_record, record_size);
+    batch->last_id = file->cur_job_id;
+    batch->last_offset = batch->size;
+    batch->size += record_size;
+  }
+
+  int *table = (int*)batch->buf;
+  table[2 * local_index]     = batch->last_id;
+  table[2 * local_index + 1] = batch->last_offset;
+  batch->unassigned--;
+}
+
+
+///
+/// Send a node its batch, starting at its leader's rank in comm.
+///
+static void send_batch(node_batch_t *batch, int leader, MPI_Comm comm,
+                       MPI_Request *request) {
+  PMPI_Isend(batch->buf, batch->size, MPI_CHAR, leader, CRAM_TAG, comm, request);
+  batch->sent = true;
+}
+
+
+///
+/// Collective.  Distributes the jobs after the first with one message per
+/// node.  Node leaders send root the ranks on their nodes.  Root then
+/// reads the file, packs each node's records into a batch, and sends the
+/// batch to the node's leader as soon as every rank on the node has a
+/// job.  The leader receives the batch straight into an MPI-3 shared
+/// window, and every rank on the node decompresses its record from there.
+/// Root sends one message per node instead of two per rank.
+///
+/// cur_rank is the first rank after the first job.  job_record must have
+/// room for max_job_size bytes.
+///
+static void node_jobs(cram_file_t *file, int root, int cur_rank,
+                      bool in_first_job, char *job_record, int version,
+                      const cram_strings_t *strings, const cram_job_t *base,
+                      cram_job_t *job, int *id, MPI_Comm comm) {
+  int rank, size;
+  PMPI_Comm_rank(comm, &rank);
+  PMPI_Comm_size(comm, &size);
+
+  // Order root first so that it leads its node and is rank 0 among leaders.
+  int key = (rank == root) ? -1 : rank;
+  MPI_Comm node_comm;
+  PMPI_Comm_split_type(comm, MPI_COMM_TYPE_SHARED, key, MPI_INFO_NULL,
+                       &node_comm);
+  int node_rank, node_size;
+  PMPI_Comm_rank(node_comm, &node_rank);
+  PMPI_Comm_size(node_comm, &node_size);
+
+  MPI_Comm leader_comm;
+  PMPI_Comm_split(comm, node_rank == 0 ? 0 : MPI_UNDEFINED, key, &leader_comm);
+
+  // Leaders collect their nodes' ranks, in node rank order, on root.
+  int *local_ranks = (node_rank == 0) ? malloc(node_size * sizeof(int)) : NULL;
+  PMPI_Gather(&rank, 1, MPI_INT, local_ranks, 1, MPI_INT, 0, node_comm);
+
+  char *batch_buf = NULL;
+  int batch_size = 0;
+  if (node_rank == 0) {
+    int num_nodes;
+    PMPI_Comm_size(leader_comm, &num_nodes);
+
+    int *node_sizes = NULL, *displs = NULL, *node_ranks = NULL;
+    if (rank == root) {
+      node_sizes = malloc(num_nodes * sizeof(int));
+      displs = malloc(num_nodes * sizeof(int));
+      node_ranks = malloc(size * sizeof(int));
+    }
+    PMPI_Gather(&node_size, 1, MPI_INT, node_sizes, 1, MPI_INT, 0, leader_comm);
+    if (rank == root) {
+      for (int n=0, offset=0; n < num_nodes; offset += node_sizes[n++]) {
+        displs[n] = offset;
+      }
+    }
+    PMPI_Gatherv(local_ranks, node_size, MPI_INT, node_ranks, node_sizes,
+                 displs, MPI_INT, 0, leader_comm);
+
+    if (rank == root) {
+      // Node and index on that node of each rank in comm.
+      int *node_of = malloc(size * sizeof(int));
+      int *index_of = malloc(size * sizeof(int));
+      node_batch_t *batches = calloc(num_nodes, sizeof(node_batch_t));
+      MPI_Request *requests = malloc(num_nodes * sizeof(MPI_Request));
+
+      for (int n=0; n < num_nodes; n++) {
+        node_batch_t *batch = &batches[n];
+        batch->size = 2 * node_sizes[n] * sizeof(int);
+        batch->capacity = batch->size;
+        batch->buf = malloc(batch->capacity);
+        memset(batch->buf, 0xff, batch->size);  // All ids -1.
+        batch->last_id = -1;
+
+        for (int i=0; i < node_sizes[n]; i++) {
+          int r = node_ranks[displs[n] + i];
+          node_of[r] = n;
+          index_of[r] = i;
+          if (r >= cur_rank) {
+            batch->unassigned++;
+          }
+        }
+        requests[n] = MPI_REQUEST_NULL;
+      }
+
+      // Batches are sent as soon as they're complete.  Root's own node is
+      // leader 0, and its batch is kept.
+      for (int n=1; n < num_nodes; n++) {
+        if (batches[n].unassigned == 0) {
+          send_batch(&batches[n], node_ranks[displs[n]], comm, &requests[n]);
+        }
+      }
+
+      while (cram_file_has_more_jobs(file)) {
+        if (!cram_file_next_job(file, job_record)) {
+          fprintf(stderr, "Error reading job %d from cram file on rank %d\n",
+                  file->cur_job_id + 1, root);
+          PMPI_Abort(comm, 1);
+        }
+        for (int p=0; p < file->cur_job_procs; p++, cur_rank++) {
+          int n = node_of[cur_rank];
+          add_to_batch(&batches[n], index_of[cur_rank], file, job_record);
+          if (n != 0 && batches[n].unassigned == 0) {
+            send_batch(&batches[n], node_ranks[displs[n]], comm, &requests[n]);
+          }
+        }
+      }
+
+      // Ranks left over have no job.  Send any batches still waiting on them.
+      for (int n=1; n < num_nodes; n++) {
+        if (!batches[n].sent) {
+          send_batch(&batches[n], node_ranks[displs[n]], comm, &requests[n]);
+        }
+      }
+      PMPI_Waitall(num_nodes, requests, MPI_STATUSES_IGNORE);
+
+      batch_buf = batches[0].buf;
+      batch_size = batches[0].size;
+      for (int n=1; n < num_nodes; n++) {
+        free(batches[n].buf);
+      }
+      free(batches);
+      free(requests);
+      free(node_of);
+      free(index_of);
+      free(node_sizes);
+      free(displs);
+      free(node_ranks);
+
+    } else {
+      MPI_Status status;
+      PMPI_Probe(root, CRAM_TAG, comm, &status);
+      PMPI_Get_count(&status, MPI_CHAR, &batch_size);
+    }
+    PMPI_Comm_free(&leader_comm);
+  }
+  free(local_ranks);
+
+  // Leaders receive their batch into the window; other ranks allocate no
+  // shared memory.
+  char *buf;
+  MPI_Win win;
+  PMPI_Win_allocate_shared(batch_size, 1, MPI_INFO_NULL, node_comm, &buf, &win);
+
+  PMPI_Win_fence(0, win);
+  if (node_rank == 0) {
+    if (rank == root) {
+      memcpy(buf, batch_buf, batch_size);
+      free(batch_buf);
+    } else {
+      PMPI_Recv(buf, batch_size, MPI_CHAR, root, CRAM_TAG, comm,
+                MPI_STATUS_IGNORE);
+    }
+  }
+  PMPI_Win_fence(0, win);
+
+  if (!in_first_job) {
+    MPI_Aint win_size;
+    int disp_unit;
+    PMPI_Win_shared_query(win, 0, &win_size, &disp_unit, &buf);
+    const int *table = (const int*)buf;
+    *id = table[2 * node_rank];
+    if (*id >= 0) {
+      cram_job_decompress(buf + table[2 * node_rank + 1], version, strings,
+                          base, job);
+    }
+  }
+
+  // Freeing the window waits for everyone on the node to decompress.
+  PMPI_Win_free(&win);
+  PMPI_Comm_free(&node_comm);
+}
+
+#endif // MPI_VERSION >= 3
+
+
+void cram_file_bcast_jobs(cram_file_t *file, int root, cram_job_t *job, int *id,
+                          MPI_Comm comm) {
+  int rank, size;
+  PMPI_Comm_rank(comm, &rank);
+  PMPI_Comm_size(comm, &size);
+
+  // check total procs and grab the max job size, format version, and size
+  // of the string table, which every rank needs to decode its record.
+  int record_info[3];
+  if (rank == root) {
+    if (file->total_procs > size) {
+      fprintf(stderr, "Error: This cram file requires %d processes, "
+              "but this communicator has only %d.\n", file->total_procs, size);
+      PMPI_Abort(comm, 1);
+    }
+    record_info[0] = file->max_job_size;
+    record_info[1] = file->version;
+    record_info[2] = file->string_table_size;
+  }
+
+  // bcast max job size, version, and string table
+  PMPI_Bcast(record_info, 3, MPI_INT, root, comm);
+  int max_job_size = record_info[0];
+  int version      = record_info[1];
+  int string_table_size = record_info[2];
+  char *job_record = malloc(max_job_size);
+
+  cram_strings_t strings;
+  if (string_table_size) {
+    char *string_table = (rank == root) ?
+      file->string_table : malloc(string_table_size);
+    PMPI_Bcast(string_table, string_table_size, MPI_CHAR, root, comm);
+    cram_strings_decode(string_table, string_table_size, &strings);
+    if (rank != root) {
+      free(string_table);
+    }
+  } else {
+    cram_strings_decode(NULL, 0, &strings);
+  }
+
+  // read in compressed data for first job record
+  if (rank == root) {
+    if (!cram_file_next_job(file, job_record)) {
+      fprintf(stderr, "Error reading job %d from cram file on rank %d\n",
+              0, root);
+      PMPI_Abort(comm, 1);
+    }
+  }
+
+  // Bcast and decompress first job.  With a shared base job, it is decoded
+  // once per node, and ranks only hold pointers into shared memory.
+  cram_job_t first_job;
+#if MPI_VERSION >= 3
+  shared_job_t shared_first_job;
+  bool shared_base = get_size_setting("CRAM_SHARED_BASE", 0);
+  if (shared_base) {
+    share_base_job(job_record, max_job_size, version, &strings, root, comm,
+                   &shared_first_job, &first_job);
+  } else
+#endif // MPI_VERSION >= 3
+  {
+    PMPI_Bcast(job_record, max_job_size, MPI_CHAR, root, comm);
+    cram_job_decompress(job_record, version, &strings, NULL, &first_job);
+  }
+
+  // A base record isn't a job.  If the file has one, the first job is the
+  // next record, which is broadcast too and decompressed against the base.
+  // Root reuses its buffer for sends, so decompress right away.
+  bool base_record = (first_job.num_procs == 0);
+  if (base_record) {
+    if (rank == root && !cram_file_next_job(file, job_record)) {
+      fprintf(stderr, "Error reading job %d from cram file on rank %d\n",
+              0, root);
+      PMPI_Abort(comm, 1);
+    }
+    PMPI_Bcast(job_record, max_job_size, MPI_CHAR, root, comm);
+  }
+
+  // start by sending to the first rank in the second job.
+  size_t offset = 0;
+  int cur_rank = base_record ?
+    buf_read_count(job_record, &offset, version) : first_job.num_procs;
+  bool in_first_job = rank < cur_rank;
+  if (in_first_job && base_record) {
+    cram_job_decompress(job_record, version, &strings, &first_job, job);
+  }
+
+  cram_distribution_t distribution = get_distribution();
+  if (distribution == cram_distribute_pull) {
+    pull_jobs(file, root, cur_rank, in_first_job, job_record, version,
+              &strings, &first_job, job, id, comm);
+
+  } else if (distribution == cram_distribute_scatter) {
+    scatter_jobs(file, root, cur_rank, job_record, max_job_size, version,
+                 &strings, &first_job, job, id, comm);
+
+#if MPI_VERSION >= 3
+  } else if (distribution == cram_distribute_node) {
+    node_jobs(file, root, cur_rank, in_first_job, job_record, version,
+              &strings, &first_job, job, id, comm);
+#endif // MPI_VERSION >= 3
+
+  } else if (rank == root) {
+    // Root needs to send to all the other jobs
+    size_t read_ahead = get_size_setting("CRAM_READ_AHEAD", DEFAULT_READ_AHEAD);
+    if (read_ahead > 0) {
+      cur_rank = pipelined_send_jobs(file, read_ahead, cur_rank, comm);
+    }
+
+    // Otherwise, iterate through remaining jobs in the file.
+    while (cram_file_has_more_jobs(file)) {
+      if (!cram_file_next_job(file, job_record)) {
+        fprintf(stderr, "Error reading job %d from cram file on rank %d\n",
+                file->cur_job_id + 1, root);
+        PMPI_Abort(comm, 1);
+      }
+
+      // array of requests for all sends we'll do
+      // max concurrent peers max number of ranks we'll send to at once.
+      int max_requests = MAX_CONCURRENT_PEERS * 2;
+      MPI_Request requests[max_requests];
+
+      // iterate through all ranks in this job, incrementing first_rank as we go.
+      int end_rank = cur_rank + file->cur_job_procs;
+      while (cur_rank < end_rank) {
+        int r = 0;
+        while (r < max_requests && cur_rank < end_rank) {
+          PMPI_Isend(&file->cur_job_id, 1, MPI_INT, cur_rank,
+                     CRAM_TAG, comm, &requests[r++]);
+          PMPI_Isend(job_record, file->cur_job_record_size, MPI_CHAR, cur_rank,
+                     CRAM_TAG, comm, &requests[r++]);
+          cur_rank++;
+        }
+        PMPI_Waitall(r, requests, MPI_STATUSES_IGNORE);
+      }
+    }
+
+    // send a job id of -1 to any inactive ranks
+    int inactive_rank_id = -1;
+    for (; cur_rank < size; cur_rank++) {
+      PMPI_Send(&inactive_rank_id, 1, MPI_INT, cur_rank, CRAM_TAG, comm);
+    }
+
+  } else if (!in_first_job) {
+    // Ranks NOT in the first job need to receive their actual job record.
+    // Ranks in the first job already have their job record.
     PMPI_Recv(id, 1, MPI_INT, root, CRAM_TAG, comm, MPI_STATUS_IGNORE);
     if (*id >= 0) {
       PMPI_Recv(job_record, max_job_size, MPI_CHAR, root, CRAM_TAG, comm,
                 MPI_STATUS_IGNORE);
+      cram_job_decompress(job_record, version, &strings, &first_job, job);
     }
-    cram_job_decompress(job_record, &first_job, job);
   }
 
   // If this rank is in the first job, then just copy the first job we
-  // got from the bcast.  And set the id to zero.
+  // got from the bcast, unless it was decompressed against a base record
+  // above.  And set the id to zero.
   if (in_first_job) {
-    cram_job_copy(&first_job, job);
+    if (!base_record) {
+      cram_job_copy(&first_job, job);
+    }
     *id = 0;
   }
 
   // Can free the first job now b/c we don't need it.
-  cram_job_free(&first_job);
+#if MPI_VERSION >= 3
+  if (shared_base) {
+    free_shared_base_job(&shared_first_job, &first_job);
+  } else
+#endif // MPI_VERSION >= 3
+  {
+    cram_job_free(&first_job);
+  }
+  cram_strings_free(&strings);
+  free(job_record);
+}
+
+
+// ------------------------------------------------------------------------
+// Job streams
+// ------------------------------------------------------------------------
+
+#if MPI_VERSION >= 3
+
+///
+/// Read the next record from a job stream into *job_record, growing it
+/// and *capacity as needed.  Returns the record's size, 0 at the end of
+/// the stream, or -1 on error.
+///
+static int stream_next_record(cram_file_t *file, char **job_record,
+                              size_t *capacity, size_t timeout) {
+  uint64_t job_record_size = 0;
+  int shift = 0;
+  unsigned char byte;
+  do {
+    if (shift >= 64 || !stream_read(file, (char*)&byte, 1, timeout)) {
+      return -1;
+    }
+    job_record_size |= (uint64_t)(byte & 0x7f) << shift;
+    shift += 7;
+  } while (byte >= 0x80);
+
+  if (job_record_size > INT_MAX) {
+    fprintf(stderr, "Error: Invalid job record size: %llu > %d",
+            (unsigned long long)job_record_size, INT_MAX);
+    return -1;
+  }
+  if (job_record_size > *capacity) {
+    *capacity = job_record_size;
+    *job_record = realloc(*job_record, *capacity);
+  }
+  if (!stream_read(file, *job_record, job_record_size, timeout)) {
+    return -1;
+  }
+
+  if (job_record_size > 0) {
+    size_t offset = 0;
+    file->cur_job_record_size = job_record_size;
+    file->cur_job_procs = buf_read_count(*job_record, &offset, file->version);
+    if (job_record_size > file->max_job_size) {
+      file->max_job_size = job_record_size;
+    }
+  }
+  return job_record_size;
+}
+
+
+void cram_file_stream_jobs(cram_file_t *file, cram_job_t *job, int *id,
+                           MPI_Comm *job_comm, MPI_Comm comm) {
+  int rank, size;
+  PMPI_Comm_rank(comm, &rank);
+  PMPI_Comm_size(comm, &size);
+
+  *id = -1;
+  *job_comm = MPI_COMM_NULL;
+
+  // Everyone gets the first record, which other jobs are decompressed
+  // against, along with the version and string table size.  The record's
+  // size is 0 if the stream ended without any jobs.
+  size_t timeout = get_size_setting("CRAM_STREAM_TIMEOUT", 0);
+  char *job_record = NULL;
+  size_t capacity = 0;
+
+  int record_info[3];
+  if (rank == 0) {
+    record_info[0] = stream_next_record(file, &job_record, &capacity, timeout);
+    if (record_info[0] < 0) {
+      fprintf(stderr, "Error reading the first job from the job stream.\n");
+      PMPI_Abort(comm, 1);
+    }
+    record_info[1] = file->version;
+    record_info[2] = file->string_table_size;
+  }
+  PMPI_Bcast(record_info, 3, MPI_INT, 0, comm);
+  int record_size = record_info[0];
+  int version     = record_info[1];
+  int string_table_size = record_info[2];
+
+  if (record_size == 0) {
+    file->num_jobs = 0;
+    file->total_procs = 0;
+    free(job_record);
+    return;
+  }
+
+  if (rank != 0) {
+    capacity = record_size;
+    job_record = malloc(capacity);
+  }
+  PMPI_Bcast(job_record, record_size, MPI_CHAR, 0, comm);
+
+  cram_strings_t strings;
+  if (string_table_size) {
+    char *string_table = (rank == 0) ?
+      file->string_table : malloc(string_table_size);
+    PMPI_Bcast(string_table, string_table_size, MPI_CHAR, 0, comm);
+    cram_strings_decode(string_table, string_table_size, &strings);
+    if (rank != 0) {
+      free(string_table);
+    }
+  } else {
+    cram_strings_decode(NULL, 0, &strings);
+  }
+
+  if (rank == 0) {
+    // Rank 0 only reads, so jobs start at rank 1.  Unless the first record
+    // is a base record, it is job 0, and is sent like the others.
+    size_t offset = 0;
+    if (buf_read_count(job_record, &offset, version) == 0) {
+      record_size = stream_next_record(file, &job_record, &capacity, timeout);
+    }
+
+    int num_jobs = 0;
+    int cur_rank = 1;
+    while (record_size > 0) {
+      int end_rank = cur_rank + file->cur_job_procs;
+      if (end_rank > size) {
+        fprintf(stderr, "Error: Job %d in the job stream needs %d processes, "
+                "but only %d are left.  It and the rest of the stream will "
+                "not run.\n", num_jobs, file->cur_job_procs, size - cur_rank);
+        break;
+      }
+
+      // Tell each process its job id and the job's first rank, then send
+      // the record, to at most MAX_CONCURRENT_PEERS processes at a time.
+      int job_info[2] = { num_jobs, cur_rank };
+      int max_requests = MAX_CONCURRENT_PEERS * 2;
+      MPI_Request requests[max_requests];
+      while (cur_rank < end_rank) {
+        int r = 0;
+        while (r < max_requests && cur_rank < end_rank) {
+          PMPI_Isend(job_info, 2, MPI_INT, cur_rank, CRAM_TAG, comm,
+                     &requests[r++]);
+          PMPI_Isend(job_record, record_size, MPI_CHAR, cur_rank, CRAM_TAG,
+                     comm, &requests[r++]);
+          cur_rank++;
+        }
+        PMPI_Waitall(r, requests, MPI_STATUSES_IGNORE);
+      }
+
+      num_jobs++;
+      record_size = stream_next_record(file, &job_record, &capacity, timeout);
+    }
+
+    if (record_size < 0) {
+      fprintf(stderr, "Error reading job %d from the job stream.  It and the "
+              "rest of the stream will not run.\n", num_jobs);
+    }
+    file->num_jobs = num_jobs;
+    file->total_procs = cur_rank - 1;
+
+    // send a job id of -1 to any inactive ranks
+    int inactive_info[2] = { -1, -1 };
+    for (; cur_rank < size; cur_rank++) {
+      PMPI_Send(inactive_info, 2, MPI_INT, cur_rank, CRAM_TAG, comm);
+    }
+
+  } else {
+    cram_job_t first_job;
+    cram_job_decompress(job_record, version, &strings, NULL, &first_job);
+
+    int job_info[2];
+    PMPI_Recv(job_info, 2, MPI_INT, 0, CRAM_TAG, comm, MPI_STATUS_IGNORE);
+    *id = job_info[0];
+    if (*id >= 0) {
+      MPI_Status status;
+      PMPI_Probe(0, CRAM_TAG, comm, &status);
+      PMPI_Get_count(&status, MPI_CHAR, &record_size);
+      if (record_size > capacity) {
+        capacity = record_size;
+        job_record = realloc(job_record, capacity);
+      }
+      PMPI_Recv(job_record, record_size, MPI_CHAR, 0, CRAM_TAG, comm,
+                MPI_STATUS_IGNORE);
+      cram_job_decompress(job_record, version, &strings, &first_job, job);
+
+      // Only the job's processes create its communicator, so jobs don't
+      // wait on each other to start.
+      MPI_Group group, job_group;
+      int range[1][3] = { { job_info[1], job_info[1] + job->num_procs - 1, 1 } };
+      PMPI_Comm_group(comm, &group);
+      PMPI_Group_range_incl(group, 1, range, &job_group);
+      PMPI_Comm_create_group(comm, job_group, CRAM_TAG, job_comm);
+      PMPI_Group_free(&job_group);
+      PMPI_Group_free(&group);
+    }
+    cram_job_free(&first_job);
+  }
+
+  cram_strings_free(&strings);
+  free(job_record);
 }
 
+#endif // MPI_VERSION >= 3
+
+#endif // CRAM_NO_MPI
+
 
 static void arg_copy(const cram_job_t *job,
                      int *dest_argc, const char ***dest_argv) {
@@ -473,6 +2336,159 @@ static void arg_copy(const cram_job_t *job,
 }
 
 
+///
+/// Find the key of a "KEY=VALUE" environment entry in the job's sorted
+/// keys.  Returns the index of the key, or -1 if the job doesn't have it.
+///
+static int find_env_key(const cram_job_t *job, const char *entry,
+                        size_t key_len) {
+  int lo = 0, hi = job->num_env_vars - 1;
+  while (lo <= hi) {
+    int mid = lo + (hi - lo) / 2;
+    const char *key = job->keys[mid];
+
+    int cmp = strncmp(entry, key, key_len);
+    if (cmp == 0 && key[key_len] != '\0') {
+      cmp = -1;  // entry's key is a proper prefix of key.
+    }
+
+    if (cmp == 0) {
+      return mid;
+    } else if (cmp < 0) {
+      hi = mid - 1;
+    } else {
+      lo = mid + 1;
+    }
+  }
+  return -1;
+}
+
+
+///
+/// Set the job's environment variables one at a time with setenv().
+///
+static void setenv_vars(const cram_job_t *job) {
+  for (int i=0; i < job->num_env_vars; i++) {
+    setenv(job->keys[i], job->values[i], 1);
+  }
+}
+
+
+// Block that swap_environ last installed as environ, and its size.
+static char **swapped_environ = NULL;
+static size_t swapped_environ_size = 0;
+
+
+///
+/// Whether an environment string is in the block that swap_environ last
+/// installed.
+///
+static inline bool in_swapped_environ(const char *entry) {
+  uintptr_t start = (uintptr_t)swapped_environ;
+  uintptr_t addr = (uintptr_t)entry;
+  return swapped_environ && addr >= start && addr < start + swapped_environ_size;
+}
+
+
+///
+/// Reuse an environment string in a new environ array.  Strings in the
+/// previous swapped block are copied to *strings, so it can be freed.
+///
+static char *reuse_env_entry(char *entry, char **strings) {
+  if (!in_swapped_environ(entry)) {
+    return entry;
+  }
+  size_t size = strlen(entry) + 1;
+  char *copy = *strings;
+  memcpy(copy, entry, size);
+  *strings += size;
+  return copy;
+}
+
+
+///
+/// Install the job's environment by building a complete environ array and
+/// swapping it in, rather than calling setenv() per variable.  setenv()
+/// scans (and may reallocate) environ on every call, which is quadratic in
+/// the size of the environment.
+///
+/// The new array holds the job's variables, in sorted order, followed by
+/// variables from the launching environment that the job does not set.
+/// Variables whose value is the same as in the launching environment reuse
+/// the existing string, so only the diff is copied.  Everything is stored
+/// in a single allocation, which becomes the process's environment.  If
+/// this is called again, e.g. for a retried job, strings still in the
+/// previous allocation are copied, and it is freed.  If the allocation
+/// fails, this falls back to setenv().
+///
+static void swap_environ(const cram_job_t *job) {
+  // First pass: count inherited vars the job doesn't set, and the bytes of
+  // strings that have to move out of the previous block.
+  size_t num_kept = 0;
+  size_t bytes = 0;
+  for (char **entry = environ; entry && *entry; entry++) {
+    const char *eq = strchr(*entry, '=');
+    if (eq && find_env_key(job, *entry, eq - *entry) < 0) {
+      num_kept++;
+    }
+    if (in_swapped_environ(*entry)) {
+      bytes += strlen(*entry) + 1;
+    }
+  }
+
+  for (int i=0; i < job->num_env_vars; i++) {
+    bytes += strlen(job->keys[i]) + strlen(job->values[i]) + 2;
+  }
+
+  // One block: pointer array, then room for strings of vars that changed.
+  size_t num_slots = job->num_env_vars + num_kept + 1;
+  size_t size = num_slots * sizeof(char*) + bytes;
+  char **env = malloc(size);
+  if (!env) {
+    fprintf(stderr, "Warning: Couldn't allocate %zu bytes for the job's "
+            "environment.  Setting variables one at a time.\n", size);
+    setenv_vars(job);
+    return;
+  }
+  char *strings = (char*)(env + num_slots);
+  memset(env, 0, job->num_env_vars * sizeof(char*));
+
+  // Second pass: reuse unchanged strings and keep vars the job doesn't set.
+  size_t kept = job->num_env_vars;
+  for (char **entry = environ; entry && *entry; entry++) {
+    const char *eq = strchr(*entry, '=');
+    if (!eq) continue;
+
+    int j = find_env_key(job, *entry, eq - *entry);
+    if (j < 0) {
+      env[kept++] = reuse_env_entry(*entry, &strings);
+    } else if (strcmp(eq + 1, job->values[j]) == 0) {
+      env[j] = reuse_env_entry(*entry, &strings);
+    }
+  }
+  env[kept] = NULL;
+
+  // Write out KEY=VALUE strings for everything that was added or changed.
+  for (int i=0; i < job->num_env_vars; i++) {
+    if (env[i]) continue;
+
+    size_t key_len = strlen(job->keys[i]);
+    size_t val_len = strlen(job->values[i]);
+    env[i] = strings;
+    memcpy(strings, job->keys[i], key_len);
+    strings[key_len] = '=';
+    memcpy(strings + key_len + 1, job->values[i], val_len + 1);
+    strings += key_len + val_len + 2;
+  }
+
+  // Nothing in the new environment points into the old block any more.
+  free(swapped_environ);
+  swapped_environ = env;
+  swapped_environ_size = size;
+  environ = env;
+}
+
+
 void cram_job_setup(const cram_job_t *job, int *argc, const char ***argv) {
   // change working directory
   chdir(job->working_dir);
@@ -498,15 +2514,17 @@ void cram_job_setup(const cram_job_t *job, int *argc, const char ***argv) {
   arg_copy(job, &cram_argc, &cram_argv);
 
   // Set environment variables based on the job's key/val pairs.
-  for (int i=0; i < job->num_env_vars; i++) {
-    setenv(job->keys[i], job->values[i], 1);
+  if (get_env_mode() == cram_env_setenv) {
+    setenv_vars(job);
+  } else {
+    swap_environ(job);
   }
 }
 
 
 void cram_job_free(cram_job_t *job) {
-  free((char*)job->working_dir);
-  free_string_array(job->num_args, job->args);
+  free((char*)job->working_dir);   // also holds the args.
+  free(job->args);
   free_string_array(job->num_env_vars, job->keys);
   free_string_array(job->num_env_vars, job->values);
 }
@@ -514,10 +2532,22 @@ void cram_job_free(cram_job_t *job) {
 
 void cram_job_copy(const cram_job_t *src, cram_job_t *dest) {
   dest->num_procs    = src->num_procs;
-  dest->working_dir  = strdup(src->working_dir);
+
+  // Working dir and args go in one buffer, as in cram_job_decompress.
+  size_t args_size = strlen(src->working_dir) + 1;
+  for (int i=0; i < src->num_args; i++) {
+    args_size += strlen(src->args[i]) + 1;
+  }
+  char *buf = malloc(args_size);
+  dest->working_dir = buf;
+  buf = stpcpy(buf, src->working_dir) + 1;
 
   dest->num_args     = src->num_args;
-  dest->args         = dup_string_array(src->num_args, src->args);
+  dest->args         = malloc(src->num_args * sizeof(const char*));
+  for (int i=0; i < src->num_args; i++) {
+    dest->args[i] = buf;
+    buf = stpcpy(buf, src->args[i]) + 1;
+  }
 
   dest->num_env_vars = src->num_env_vars;
   dest->keys         = dup_string_array(src->num_env_vars, src->keys);
@@ -525,6 +2555,86 @@ void cram_job_copy(const cram_job_t *src, cram_job_t *dest) {
 }
 
 
+///
+/// Append a version 2 int to a record, and return the end of what was
+/// written.
+///
+static inline char *put_int(char *dest, int value) {
+  uint32_t net_value = htonl(value);
+  memcpy(dest, &net_value, sizeof(net_value));
+  return dest + sizeof(net_value);
+}
+
+
+///
+/// Append a version 2 string (length, then characters) to a record.
+///
+static inline char *put_string(char *dest, const char *str) {
+  size_t len = strlen(str);
+  dest = put_int(dest, len);
+  memcpy(dest, str, len);
+  return dest + len;
+}
+
+
+bool cram_job_write(const cram_job_t *job, FILE *out) {
+  // Standalone records use the version 2 encoding, with no base job or
+  // string table: procs, working dir, args, no subtracted keys, then env.
+  size_t size = 5 * sizeof(int) + strlen(job->working_dir);
+  for (int i=0; i < job->num_args; i++) {
+    size += sizeof(int) + strlen(job->args[i]);
+  }
+  for (int i=0; i < job->num_env_vars; i++) {
+    size += 2 * sizeof(int) + strlen(job->keys[i]) + strlen(job->values[i]);
+  }
+  if (size > INT_MAX) {
+    return false;
+  }
+
+  char *record = malloc(sizeof(int) + size);
+  char *dest = put_int(record, size);
+  dest = put_int(dest, job->num_procs);
+  dest = put_string(dest, job->working_dir);
+  dest = put_int(dest, job->num_args);
+  for (int i=0; i < job->num_args; i++) {
+    dest = put_string(dest, job->args[i]);
+  }
+  dest = put_int(dest, 0);
+  dest = put_int(dest, job->num_env_vars);
+  for (int i=0; i < job->num_env_vars; i++) {
+    dest = put_string(dest, job->keys[i]);
+    dest = put_string(dest, job->values[i]);
+  }
+
+  bool written = (fwrite(record, dest - record, 1, out) == 1);
+  free(record);
+  return written;
+}
+
+
+bool cram_job_read(FILE *in, cram_job_t *job) {
+  uint32_t net_size;
+  if (fread(&net_size, sizeof(net_size), 1, in) != 1) {
+    return false;
+  }
+  size_t size = ntohl(net_size);
+  if (size < 5 * sizeof(int) || size > INT_MAX) {
+    return false;
+  }
+
+  char *record = malloc(size);
+  bool found = (fread(record, size, 1, in) == 1);
+  if (found) {
+    cram_strings_t strings;
+    cram_strings_decode(NULL, 0, &strings);
+    cram_job_decompress(record, 2, &strings, NULL, job);
+    cram_strings_free(&strings);
+  }
+  free(record);
+  return found;
+}
+
+
 void cram_job_print(const cram_job_t *job) {
   printf("  Num procs: %d\n", job->num_procs);
   printf("  Working dir: %s\n", job->working_dir);
@@ -559,20 +2669,25 @@ void cram_file_cat(cram_file_t *file) {
   // space for raw, compressed job record.
   char *job_record = malloc(file->max_job_size);
 
-  // First job is special because we don't have to decompress
+  cram_strings_t strings;
+  cram_strings_decode(file->string_table, file->string_table_size, &strings);
+
+  // First record is special because we don't have to decompress
   cram_job_t first_job;
   cram_file_next_job(file, job_record);
-  cram_job_decompress(job_record, NULL, &first_job);
+  cram_job_decompress(job_record, file->version, &strings, NULL, &first_job);
 
-  // print first job
-  printf("Job %d:\n", file->cur_job_id);
-  cram_job_print(&first_job);
+  // print first job, unless it is a base record.
+  if (!file->base_record) {
+    printf("Job %d:\n", file->cur_job_id);
+    cram_job_print(&first_job);
+  }
 
-  // Rest of jobs are based on first job.
+  // Rest of jobs are based on first record.
   cram_job_t job;
   while (cram_file_has_more_jobs(file)) {
     cram_file_next_job(file, job_record);
-    cram_job_decompress(job_record, &first_job, &job);
+    cram_job_decompress(job_record, file->version, &strings, &first_job, &job);
 
     // print each subsequent job
     printf("Job %d:\n", file->cur_job_id);
@@ -581,6 +2696,168 @@ void cram_file_cat(cram_file_t *file) {
     cram_job_free(&job);
   }
 
+  cram_strings_free(&strings);
   free(job_record);
   cram_job_free(&first_job);
 }
+
+
+// ------------------------------------------------------------------------
+// Readers for other languages
+// ------------------------------------------------------------------------
+
+struct cram_reader_t {
+  cram_file_t file;        //!< File the reader reads from.
+  cram_strings_t strings;  //!< The file's string table.
+  char *job_record;        //!< Buffer for one raw job record.
+  bool first_pending;      //!< First record is a job that wasn't returned yet.
+  char *decoded;           //!< Decoded strings for the last job returned.
+  size_t decoded_size;     //!< Size of the decoded buffer.
+};
+
+
+///
+/// Copy a cram string from a buffer into a string buffer, null-terminated,
+/// and return a pointer to the end of what was written.
+///
+static inline char *buf_copy_string(const char *buf, size_t *offset,
+                                    int version, char *dest) {
+  size_t size = buf_read_count(buf, offset, version);
+  memcpy(dest, &buf[*offset], size);
+  dest[size] = '\0';
+  *offset += size;
+  return dest + size + 1;
+}
+
+
+///
+/// Decode a job record into a buffer of null-terminated strings, as
+/// described for cram_reader_next.  The buffer must have room for
+/// decoded_strings_size() bytes.  Returns the number of bytes written.
+///
+static size_t decode_strings(const char *job_record, int version,
+                             const cram_strings_t *strings,
+                             char *decoded, int *counts) {
+  size_t offset = 0;
+  char *dest = decoded;
+
+  counts[0] = buf_read_count(job_record, &offset, version);
+  dest = put_job_string(
+    buf_read_job_string(job_record, &offset, version, strings), dest);
+
+  counts[1] = buf_read_count(job_record, &offset, version);
+  for (int i=0; i < counts[1]; i++) {
+    dest = put_job_string(
+      buf_read_job_string(job_record, &offset, version, strings), dest);
+  }
+
+  counts[2] = buf_read_count(job_record, &offset, version);
+  for (int i=0; i < counts[2]; i++) {
+    dest = buf_copy_string(job_record, &offset, version, dest);
+  }
+
+  counts[3] = buf_read_count(job_record, &offset, version);
+  for (int i=0; i < 2 * counts[3]; i++) {
+    dest = buf_copy_string(job_record, &offset, version, dest);
+  }
+
+  return dest - decoded;
+}
+
+
+cram_reader_t *cram_reader_open(const char *filename) {
+  cram_reader_t *reader = calloc(1, sizeof(cram_reader_t));
+  if (!cram_file_open(filename, &reader->file)) {
+    if (reader->file.fd) {
+      fclose(reader->file.fd);
+    }
+    free(reader->file.string_table);
+    free(reader);
+    return NULL;
+  }
+
+  cram_strings_decode(reader->file.string_table,
+                      reader->file.string_table_size, &reader->strings);
+  reader->job_record = malloc(reader->file.max_job_size + 1);
+
+  // Read the first record, so that a base record is skipped.
+  if (cram_file_has_more_jobs(&reader->file)) {
+    if (!cram_file_next_job(&reader->file, reader->job_record)) {
+      cram_reader_close(reader);
+      return NULL;
+    }
+    reader->first_pending = !reader->file.base_record;
+  }
+
+  return reader;
+}
+
+
+void cram_reader_header(const cram_reader_t *reader, int *header) {
+  header[0] = reader->file.num_jobs;
+  header[1] = reader->file.total_procs;
+  header[2] = reader->file.version;
+  header[3] = reader->file.max_job_size;
+  header[4] = reader->file.base_record;
+}
+
+
+const char *cram_reader_next(cram_reader_t *reader, int *counts,
+                             size_t *size) {
+  // The first job is already in the record buffer.
+  if (reader->first_pending) {
+    reader->first_pending = false;
+
+  } else if (!cram_file_has_more_jobs(&reader->file) ||
+             !cram_file_next_job(&reader->file, reader->job_record)) {
+    return NULL;
+  }
+
+  // Strings from the string table can make the decoded job larger than
+  // its record, so size the buffer for each job.
+  size_t needed = decoded_strings_size(reader->job_record,
+                                       reader->file.version, &reader->strings);
+  if (needed > reader->decoded_size) {
+    free(reader->decoded);
+    reader->decoded = malloc(needed);
+    reader->decoded_size = needed;
+  }
+
+  *size = decode_strings(reader->job_record, reader->file.version,
+                         &reader->strings, reader->decoded, counts);
+  return reader->decoded;
+}
+
+
+int cram_reader_skip(cram_reader_t *reader, int count, int *procs) {
+  int skipped = 0;
+  if (count > 0 && reader->first_pending) {
+    reader->first_pending = false;
+    if (procs) {
+      size_t offset = 0;
+      procs[skipped] = buf_read_count(reader->job_record, &offset,
+                                      reader->file.version);
+    }
+    skipped++;
+  }
+
+  while (skipped < count && cram_file_has_more_jobs(&reader->file)) {
+    if (!cram_file_skip_job(&reader->file)) {
+      break;
+    }
+    if (procs) {
+      procs[skipped] = reader->file.cur_job_procs;
+    }
+    skipped++;
+  }
+  return skipped;
+}
+
+
+void cram_reader_close(cram_reader_t *reader) {
+  cram_file_close(&reader->file);
+  cram_strings_free(&reader->strings);
+  free(reader->job_record);
+  free(reader->decoded);
+  free(reader);
+}
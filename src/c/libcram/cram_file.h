@@ -25,7 +25,11 @@
 #ifndef cram_cram_file_h
 #define cram_cram_file_h
 
+// Define CRAM_NO_MPI to build the reading and decompression functions
+// without MPI, e.g. for libcramfile, which Python loads with ctypes.
+#ifndef CRAM_NO_MPI
 #include <mpi.h>
+#endif // CRAM_NO_MPI
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -50,14 +54,41 @@ struct cram_file_t {
   int cur_job_record_size; //!< Size of the current job record
   int cur_job_procs;       //!< Number of proceses in the current job.
   int cur_job_id;          //!< Id of the current job.
+  bool base_record;        //!< Whether the file starts with a base record.
+  bool stream;             //!< Whether this is a job stream (see below).
+
+  int string_table_size;   //!< Size of the raw string table, or 0.
+  char *string_table;      //!< Raw string table (version 4), or NULL.
+  int flags;               //!< Header flags (version 5), or 0.
 };
 typedef struct cram_file_t cram_file_t;
 
+/// Header flag set when any job in the file has CRAM_THREADS_PER_RANK.
+#define CRAM_FILE_THREADS 1
+
+
+///
+/// Strings shared by the jobs in a version 4 cram file.  Job records
+/// refer to these by index instead of repeating long working directories
+/// and arguments.  Decode them from cram_file_t's string_table with
+/// cram_strings_decode.
+///
+struct cram_strings_t {
+  int num_strings;         //!< Number of strings in the table.
+  const char **strings;    //!< Strings, all stored in one buffer.
+  size_t *lengths;         //!< Length of each string.
+  char *buffer;            //!< Buffer holding the strings.
+};
+typedef struct cram_strings_t cram_strings_t;
+
 
 ///
 /// Represents a single job in a cram file.  This can be extracted from a
 /// cram_file using cram_file_find_job.
 ///
+/// The working directory and arguments are stored in one buffer, which
+/// starts at working_dir.
+///
 struct cram_job_t {
   int num_procs;            //!< Number of processes in this job.
   const char *working_dir;  //!< Working directory to use for job
@@ -109,6 +140,11 @@ bool cram_file_has_more_jobs(const cram_file_t *file);
 /// Read the next job into the job_record buffer.  Metadata about
 /// the job can be found in the file buffer after this call.
 ///
+/// Version 3 files may start with a base record, which has no processes
+/// and only holds an environment for other jobs to be decompressed
+/// against.  Reading it sets file->base_record and doesn't advance
+/// file->cur_job_id, since it isn't a job.
+///
 /// Return true if successful, false on error.
 ///
 /// @param[in]    file        Cram file to advance.
@@ -119,6 +155,39 @@ bool cram_file_has_more_jobs(const cram_file_t *file);
 bool cram_file_next_job(cram_file_t *file, char *job_record);
 
 
+///
+/// Skip the next job without reading or decompressing its record.  This
+/// only reads the record's size and number of processes, so it is much
+/// faster than cram_file_next_job for scanning a file.  Metadata about the
+/// job is in the file buffer after this call, as with cram_file_next_job.
+///
+/// The first record of a file should be read with cram_file_next_job,
+/// since it is needed to decompress the others.
+///
+/// Return true if successful, false on error.
+///
+/// @param[in]    file        Cram file to advance.
+///
+EXTERN_C
+bool cram_file_skip_job(cram_file_t *file);
+
+
+///
+/// Read the job with the supplied id out of a cram file.  This is a local
+/// operation.  It reads the file from the start, so the file should be
+/// newly opened.
+///
+/// @param[in]  file   Newly opened cram file.
+/// @param[in]  id     Id of the job to find.
+/// @param[out] job    The job, if it was found.  Free with cram_job_free.
+///
+/// @return true if the job was found, false otherwise.
+///
+EXTERN_C
+bool cram_file_find_job(cram_file_t *file, int id, cram_job_t *job);
+
+
+#ifndef CRAM_NO_MPI
 ///
 /// Broadcast a local cram file to all processes on a communicator.
 /// This is a collective operation.
@@ -132,6 +201,32 @@ bool cram_file_next_job(cram_file_t *file, char *job_record);
 EXTERN_C
 void cram_file_bcast_jobs(cram_file_t *file, int root, cram_job_t *job, int *id,
                           MPI_Comm comm);
+#endif // CRAM_NO_MPI
+
+
+#if !defined(CRAM_NO_MPI) && MPI_VERSION >= 3
+///
+/// Distribute jobs from a job stream: a cram file whose jobs are read
+/// while they are still being written, e.g. through a FIFO.  Its header
+/// has no job or process counts, and it ends with an empty record.
+///
+/// Rank 0 reads the stream and doesn't get a job.  Other ranks get jobs
+/// in order as they arrive, and return as soon as theirs has, with a
+/// communicator for the job's processes.  Rank 0 and ranks left over at
+/// the end of the stream return when it ends.  This is collective only
+/// until the first record is broadcast.
+///
+/// @param[in]  file      Stream to read.  Only valid on rank 0, where its
+///                       job and process counts are set on return.
+/// @param[out] job       The job this process should execute.
+/// @param[out] id        Id of this process's job, or -1 if it has none.
+/// @param[out] job_comm  Processes in this process's job, or MPI_COMM_NULL.
+/// @param[in]  comm      Communicator to distribute jobs on.
+///
+EXTERN_C
+void cram_file_stream_jobs(cram_file_t *file, cram_job_t *job, int *id,
+                           MPI_Comm *job_comm, MPI_Comm comm);
+#endif // !CRAM_NO_MPI && MPI_VERSION >= 3
 
 
 ///
@@ -144,6 +239,29 @@ EXTERN_C
 void cram_file_cat(cram_file_t *file);
 
 
+///
+/// Decode the raw string table of a version 4 cram file.  Strings in the
+/// table are sorted, and each is stored as the length of the prefix it
+/// shares with the one before it, followed by the rest of the string.
+/// Aborts if the table is corrupt, i.e. if any count, length, or shared
+/// prefix doesn't fit in it.
+///
+/// @param[in]  string_table  Raw string table, or NULL if there is none.
+/// @param[in]  size          Size of the raw string table.
+/// @param[out] strings       Decoded strings.  Free with cram_strings_free.
+///
+EXTERN_C
+void cram_strings_decode(const char *string_table, int size,
+                         cram_strings_t *strings);
+
+
+///
+/// Free the strings decoded by cram_strings_decode.
+///
+EXTERN_C
+void cram_strings_free(cram_strings_t *strings);
+
+
 ///
 /// Decompress raw bytes from a job record into a cram_job_decompress.
 ///
@@ -152,13 +270,19 @@ void cram_file_cat(cram_file_t *file);
 /// environment.  For these jobs, pass in a pointer to the base job so that
 /// this function can apply differences to the first job.
 ///
+/// In version 4 files, the working directory and arguments may start with
+/// a string from the file's string table.  They are decoded into a single
+/// buffer for the job, so this does not allocate per string.
+///
 /// @param[in]  job_record  Compressed job record from a cram file.
-/// @param[in]  offset      Offset in file.
+/// @param[in]  version     Format version of the file the record came from.
+/// @param[in]  strings     The file's string table, or NULL if it has none.
 /// @param[in]  base        First job in the cram file.  Pass NULL to
 ///                         read the first job out of the file.
 ///
 EXTERN_C
-void cram_job_decompress(const char *job_record,
+void cram_job_decompress(const char *job_record, int version,
+                         const cram_strings_t *strings,
                          const cram_job_t *base, cram_job_t *job);
 
 
@@ -194,6 +318,25 @@ EXTERN_C
 void cram_job_copy(const cram_job_t *src, cram_job_t *dest);
 
 
+///
+/// Write a job to a stream as a standalone record, which cram_job_read
+/// can read back without the cram file the job came from.
+///
+/// @return true if the whole job was written.
+///
+EXTERN_C
+bool cram_job_write(const cram_job_t *job, FILE *out);
+
+
+///
+/// Read a job written by cram_job_write.  Free it with cram_job_free.
+///
+/// @return true if a whole job was read.
+///
+EXTERN_C
+bool cram_job_read(FILE *in, cram_job_t *job);
+
+
 ///
 /// Deallocate all memory for a job output by cram_file_find_job.
 ///
@@ -201,5 +344,81 @@ EXTERN_C
 void cram_job_free(cram_job_t *job);
 
 
+///
+/// cram_reader_t reads the jobs in a cram file one at a time, for use from
+/// other languages.  The Python CramFile loads it from libcramfile with
+/// ctypes.  To keep bindings simple, it is opaque, and each job comes back
+/// as a single buffer of null-terminated strings.
+///
+typedef struct cram_reader_t cram_reader_t;
+
+
+///
+/// Open a cram file for reading with a cram_reader_t.  This reads the
+/// header and the first record, so that a base record can be skipped.
+///
+/// @return a new reader, or NULL if the file could not be read.
+///
+EXTERN_C
+cram_reader_t *cram_reader_open(const char *filename);
+
+
+///
+/// Get header information for the reader's file.
+///
+/// @param[in]  reader  An open reader.
+/// @param[out] header  Array of 5 ints: number of jobs, total processes,
+///                     version, max job record size, and 1 if the file
+///                     has a base record or 0 if it doesn't.
+///
+EXTERN_C
+void cram_reader_header(const cram_reader_t *reader, int *header);
+
+
+///
+/// Decode the next job's record into the reader's string buffer.  The
+/// buffer holds the working directory, the arguments, the names of
+/// environment variables subtracted from the file's first record, then
+/// alternating keys and values of added or changed variables.  It is
+/// valid until the next call on the reader.
+///
+/// This leaves applying the environment differences to the caller, which
+/// is cheap in languages with fast dictionary copies.  Every job but the
+/// first is relative to the first record.  The first job has no
+/// subtracted variables unless the file has a base record.
+///
+/// @param[in]  reader  An open reader.
+/// @param[out] counts  Array of 4 ints: number of processes, arguments,
+///                     subtracted variables, and added or changed variables.
+/// @param[out] size    Number of bytes used in the string buffer.
+///
+/// @return the string buffer, or NULL at the end of the file or on error.
+///
+EXTERN_C
+const char *cram_reader_next(cram_reader_t *reader, int *counts, size_t *size);
+
+
+///
+/// Skip jobs without decompressing them, using cram_file_skip_job.
+///
+/// @param[in]  reader  An open reader.
+/// @param[in]  count   Number of jobs to skip.
+/// @param[out] procs   If not NULL, array of <count> ints that receives
+///                     the number of processes in each skipped job.
+///
+/// @return the number of jobs skipped, which is less than count at the
+///         end of the file or on error.
+///
+EXTERN_C
+int cram_reader_skip(cram_reader_t *reader, int count, int *procs);
+
+
+///
+/// Close the reader's file and free the reader.
+///
+EXTERN_C
+void cram_reader_close(cram_reader_t *reader);
+
+
 
 #endif // cram_cram_file_h
@@ -0,0 +1,69 @@
+//////////////////////////////////////////////////////////////////////////////
+// Copyright (c) 2014, Lawrence Livermore National Security, LLC.
+// Produced at the Lawrence Livermore National Laboratory.
+//
+// This file is part of Cram.
+// Written by Todd Gamblin, tgamblin@llnl.gov, All rights reserved.
+// LLNL-CODE-661100
+//
+// For details, see https://github.com/scalability-llnl/cram.
+// Please also see the LICENSE file for our notice and the LGPL.
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License (as published by
+// the Free Software Foundation) version 2.1 dated February 1999.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the IMPLIED WARRANTY OF
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the terms and
+// conditions of the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program; if not, write to the Free Software Foundation,
+// Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+//
+// This test program causes process 0 to call MPI_Abort if its first
+// argument is "abort".  The other processes keep calling MPI, so with
+// cram they should notice and exit, while other jobs run to completion.
+// With "abort-blocked", the other processes are instead blocked in
+// MPI_Recv on process 0, which never sends.
+//
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <mpi.h>
+
+int main(int argc, char **argv) {
+    MPI_Init(&argc, &argv);
+
+    int rank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+
+    if (argc > 1 && strcmp(argv[1], "abort-blocked") == 0) {
+        if (rank == 0) {
+            sleep(1);
+            MPI_Abort(MPI_COMM_WORLD, 3);
+        }
+        int value;
+        MPI_Recv(&value, 1, MPI_INT, 0, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+    }
+
+    if (argc > 1 && strcmp(argv[1], "abort") == 0) {
+        if (rank == 0) {
+            MPI_Abort(MPI_COMM_WORLD, 3);
+        }
+        while (1) {
+            int flag;
+            MPI_Iprobe(MPI_ANY_SOURCE, 0, MPI_COMM_WORLD, &flag, MPI_STATUS_IGNORE);
+            usleep(1000);
+        }
+    }
+
+    // Give aborting jobs time to go away before finishing.
+    sleep(1);
+    MPI_Barrier(MPI_COMM_WORLD);
+    if (rank == 0) {
+        printf("Finished without aborting.\n");
+    }
+    MPI_Finalize();
+}
@@ -0,0 +1,61 @@
+#!/bin/sh
+#
+# This test packs three 2-process abort-test jobs.  Job 0 calls
+# MPI_Abort while its other process keeps calling MPI, job 1 calls it
+# while its other process is blocked in MPI_Recv, and job 2 runs
+# normally.  It passes only if both aborted jobs end, job 2 finishes,
+# and the whole run exits with 0.
+#
+
+cram="$1"
+abort_test="$2"
+mpiexec="$3"
+np_flag="${4:--n}"
+
+if [ -z "$cram" -o -z "$abort_test" -o -z "$mpiexec" ]; then
+    echo "Usage: cram-abort-test.sh <path-to-cram> <path-to-abort-test> <mpiexec> [np-flag]"
+    exit 1
+fi
+
+# Let Open MPI run as root in containers, and oversubscribe small machines.
+export OMPI_ALLOW_RUN_AS_ROOT=1
+export OMPI_ALLOW_RUN_AS_ROOT_CONFIRM=1
+export OMPI_MCA_rmaps_base_oversubscribe=1
+
+test_dir="$(pwd)/cram-abort-test"
+export CRAM_FILE="$test_dir/abort.job"
+
+rm -rf "$test_dir"
+mkdir -p "$test_dir"
+cd "$test_dir"
+$cram pack -f "$CRAM_FILE" -n 2 abort         || exit 1
+$cram pack -f "$CRAM_FILE" -n 2 abort-blocked || exit 1
+$cram pack -f "$CRAM_FILE" -n 2 run           || exit 1
+
+echo ===== RUNNING ABORT TEST =====================
+$mpiexec $np_flag 6 $abort_test > run.log 2>&1
+status=$?
+cat run.log
+
+if [ $status -ne 0 ]; then
+    echo "FAILED"
+    echo "The run exited with status $status."
+    exit 1
+fi
+if ! grep -q "Finished without aborting" cram.2.out 2>/dev/null; then
+    echo "FAILED"
+    echo "The job that didn't abort didn't finish."
+    exit 1
+fi
+for job in 0 1; do
+    if ! grep -q "Rank 1 on cram job $job exiting because rank 0 aborted" run.log; then
+        echo "FAILED"
+        echo "Rank 1 of job $job didn't exit after rank 0 aborted."
+        exit 1
+    fi
+done
+
+echo "SUCCESS"
+cd ..
+rm -rf "$test_dir"
+exit 0
@@ -38,9 +38,12 @@ void read_entire_cram_file(cram_file_t *file) {
   char *job_record = malloc(file->max_job_size);
 
   // First job is special because we don't have to decompress
+  cram_strings_t strings;
+  cram_strings_decode(file->string_table, file->string_table_size, &strings);
+
   cram_job_t first_job;
   cram_file_next_job(file, job_record);
-  cram_job_decompress(job_record, NULL, &first_job);
+  cram_job_decompress(job_record, file->version, &strings, NULL, &first_job);
 
   // Rest of jobs are based on first job.  Do not decompress any
   // of them. This is just a read benchmark.
@@ -51,6 +54,7 @@ void read_entire_cram_file(cram_file_t *file) {
   // free everything up.
   free(job_record);
   cram_job_free(&first_job);
+  cram_strings_free(&strings);
 }
 
 
@@ -0,0 +1,50 @@
+#!/bin/sh
+#
+# This test runs two 2-process fail-once jobs on 9 processes with
+# CRAM_RETRIES=1.  Every job fails the first time, so it passes only if
+# the coordinator reruns both jobs on spares and they succeed.  It runs
+# three times: once where the reruns call MPI_Finalize, once where they
+# exit without it, and once where the first runs crash with SIGSEGV.
+#
+
+cram="$1"
+fail_once="$2"
+mpiexec="$3"
+np_flag="${4:--n}"
+
+if [ -z "$cram" -o -z "$fail_once" -o -z "$mpiexec" ]; then
+    echo "Usage: cram-retry-test.sh <path-to-cram> <path-to-fail-once> <mpiexec> [np-flag]"
+    exit 1
+fi
+
+# Let Open MPI run as root in containers, and oversubscribe small machines.
+export OMPI_ALLOW_RUN_AS_ROOT=1
+export OMPI_ALLOW_RUN_AS_ROOT_CONFIRM=1
+export OMPI_MCA_rmaps_base_oversubscribe=1
+
+test_dir="$(pwd)/cram-retry-test"
+export CRAM_FILE="$test_dir/retry.job"
+export CRAM_RETRIES=1
+
+for mode in finalize no-finalize crash; do
+    rm -rf "$test_dir"
+    mkdir -p "$test_dir/job0" "$test_dir/job1"
+    (cd "$test_dir/job0" && $cram pack -f "$CRAM_FILE" -n 2 $mode) || exit 1
+    (cd "$test_dir/job1" && $cram pack -f "$CRAM_FILE" -n 2 $mode) || exit 1
+
+    echo ===== RUNNING FAIL-ONCE JOBS: $mode =====================
+    $mpiexec $np_flag 9 $fail_once 2>&1
+
+    for job in 0 1; do
+        out="$test_dir/job$job/cram.$job.out"
+        if ! grep -q "Succeeded with 2 processes" "$out" 2>/dev/null; then
+            echo "FAILED"
+            echo "Job $job was not retried successfully ($mode)."
+            exit 1
+        fi
+    done
+done
+
+echo "SUCCESS"
+rm -rf "$test_dir"
+exit 0
@@ -0,0 +1,75 @@
+#!/bin/sh
+#
+# This test packs two 2-process thread-test jobs, one with --threads 2
+# and one without, and runs them with every process writing its own
+# output.  It passes only if the file is flagged as having threaded jobs,
+# the threaded job's processes get OMP_NUM_THREADS=2 and at most 2 CPUs,
+# the other job's processes don't, and the run exits with 0.
+#
+
+cram="$1"
+thread_test="$2"
+mpiexec="$3"
+np_flag="${4:--n}"
+
+if [ -z "$cram" -o -z "$thread_test" -o -z "$mpiexec" ]; then
+    echo "Usage: cram-thread-test.sh <path-to-cram> <path-to-thread-test> <mpiexec> [np-flag]"
+    exit 1
+fi
+
+# Let Open MPI run as root in containers, and oversubscribe small machines.
+export OMPI_ALLOW_RUN_AS_ROOT=1
+export OMPI_ALLOW_RUN_AS_ROOT_CONFIRM=1
+export OMPI_MCA_rmaps_base_oversubscribe=1
+
+test_dir="$(pwd)/cram-thread-test"
+export CRAM_FILE="$test_dir/thread.job"
+export CRAM_OUTPUT=ALL
+
+rm -rf "$test_dir"
+mkdir -p "$test_dir"
+cd "$test_dir"
+$cram pack -f "$CRAM_FILE" -n 2 --threads 2 threaded || exit 1
+$cram pack -f "$CRAM_FILE" -n 2 unthreaded          || exit 1
+
+if ! $cram info "$CRAM_FILE" | grep -q "Cram version: *5"; then
+    echo "FAILED"
+    echo "cram pack --threads didn't create a version 5 file."
+    exit 1
+fi
+
+echo ===== RUNNING THREAD TEST =====================
+$mpiexec $np_flag 4 $thread_test > run.log 2>&1
+status=$?
+cat run.log
+cat cram.*.out
+
+if [ $status -ne 0 ]; then
+    echo "FAILED"
+    echo "The run exited with status $status."
+    exit 1
+fi
+for rank in 0 1; do
+    out="cram.0.$rank.out"
+    if ! grep -q "OMP_NUM_THREADS=2," "$out" 2>/dev/null; then
+        echo "FAILED"
+        echo "Rank $rank of the threaded job didn't get 2 threads."
+        exit 1
+    fi
+    cpus=$(sed -n 's/.*CPUs://p' "$out" | wc -w)
+    if [ "$cpus" -lt 1 -o "$cpus" -gt 2 ]; then
+        echo "FAILED"
+        echo "Rank $rank of the threaded job is bound to $cpus CPUs, not 1 or 2."
+        exit 1
+    fi
+    if ! grep -q "OMP_NUM_THREADS=unset" "cram.1.$rank.out" 2>/dev/null; then
+        echo "FAILED"
+        echo "Rank $rank of the unthreaded job got a thread count."
+        exit 1
+    fi
+done
+
+echo "SUCCESS"
+cd ..
+rm -rf "$test_dir"
+exit 0
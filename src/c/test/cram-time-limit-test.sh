@@ -0,0 +1,71 @@
+#!/bin/sh
+#
+# This test packs three 2-process sleep-test jobs.  Jobs 0 and 1 have a
+# 2-second time limit but run for 30 seconds: in job 0, rank 0 spins
+# without making MPI calls while rank 1 waits in a barrier, and in job 1,
+# both ranks sleep.  Job 2 sleeps for 1 second with no limit.  It passes
+# only if every process in jobs 0 and 1 times out, job 2 finishes, and
+# the whole run exits with 0 well before the 30 seconds are up.
+#
+
+cram="$1"
+sleep_test="$2"
+mpiexec="$3"
+np_flag="${4:--n}"
+
+if [ -z "$cram" -o -z "$sleep_test" -o -z "$mpiexec" ]; then
+    echo "Usage: cram-time-limit-test.sh <path-to-cram> <path-to-sleep-test> <mpiexec> [np-flag]"
+    exit 1
+fi
+
+# Let Open MPI run as root in containers, and oversubscribe small machines.
+export OMPI_ALLOW_RUN_AS_ROOT=1
+export OMPI_ALLOW_RUN_AS_ROOT_CONFIRM=1
+export OMPI_MCA_rmaps_base_oversubscribe=1
+
+test_dir="$(pwd)/cram-time-limit-test"
+export CRAM_FILE="$test_dir/time-limit.job"
+
+rm -rf "$test_dir"
+mkdir -p "$test_dir"
+cd "$test_dir"
+$cram pack -f "$CRAM_FILE" -n 2 -t 2 30 spin || exit 1
+$cram pack -f "$CRAM_FILE" -n 2 -t 2 30      || exit 1
+$cram pack -f "$CRAM_FILE" -n 2 1            || exit 1
+
+echo ===== RUNNING TIME LIMIT TEST =====================
+start=$(date +%s)
+$mpiexec $np_flag 6 $sleep_test > run.log 2>&1
+status=$?
+elapsed=$(( $(date +%s) - start ))
+cat run.log
+
+if [ $status -ne 0 ]; then
+    echo "FAILED"
+    echo "The run exited with status $status."
+    exit 1
+fi
+if [ $elapsed -ge 20 ]; then
+    echo "FAILED"
+    echo "The run took $elapsed seconds, so the time limits weren't enforced."
+    exit 1
+fi
+if ! grep -q "Slept for 1 seconds" cram.2.out 2>/dev/null; then
+    echo "FAILED"
+    echo "The job without a time limit didn't finish."
+    exit 1
+fi
+for job in 0 1; do
+    for rank in 0 1; do
+        if ! grep -q "Rank $rank on cram job $job exceeded its time limit" run.log; then
+            echo "FAILED"
+            echo "Rank $rank of job $job didn't time out."
+            exit 1
+        fi
+    done
+done
+
+echo "SUCCESS"
+cd ..
+rm -rf "$test_dir"
+exit 0
@@ -0,0 +1,73 @@
+//////////////////////////////////////////////////////////////////////////////
+// Copyright (c) 2014, Lawrence Livermore National Security, LLC.
+// Produced at the Lawrence Livermore National Laboratory.
+//
+// This file is part of Cram.
+// Written by Todd Gamblin, tgamblin@llnl.gov, All rights reserved.
+// LLNL-CODE-661100
+//
+// For details, see https://github.com/scalability-llnl/cram.
+// Please also see the LICENSE file for our notice and the LGPL.
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License (as published by
+// the Free Software Foundation) version 2.1 dated February 1999.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the IMPLIED WARRANTY OF
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the terms and
+// conditions of the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program; if not, write to the Free Software Foundation,
+// Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+//
+// This test program fails with exit(1) on every process the first time
+// it runs in a directory, and succeeds after that.  Use it to test
+// CRAM_RETRIES.  With the argument no-finalize, it exits without calling
+// MPI_Finalize when it succeeds.  With the argument crash, rank 0 fails
+// with SIGSEGV instead, while the other processes wait to hear from it.
+//
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <mpi.h>
+
+#define MARKER "fail-once.marker"
+
+int main(int argc, char **argv) {
+    MPI_Init(&argc, &argv);
+
+    int rank, size;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &size);
+
+    // Everyone checks for the marker before rank 0 creates it.
+    int failed_before = (access(MARKER, F_OK) == 0);
+    MPI_Barrier(MPI_COMM_WORLD);
+
+    int crash = (argc > 1 && strcmp(argv[1], "crash") == 0);
+    if (!failed_before) {
+        if (rank == 0) {
+            FILE *marker = fopen(MARKER, "w");
+            fclose(marker);
+            if (crash) {
+                raise(SIGSEGV);
+            }
+        } else if (crash) {
+            int value;
+            MPI_Recv(&value, 1, MPI_INT, 0, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+        }
+        exit(1);
+    }
+
+    if (rank == 0) {
+        printf("Succeeded with %d processes.\n", size);
+    }
+    if (argc > 1 && strcmp(argv[1], "no-finalize") == 0) {
+        exit(0);
+    }
+    MPI_Finalize();
+}
@@ -0,0 +1,120 @@
+//////////////////////////////////////////////////////////////////////////////
+// Copyright (c) 2014, Lawrence Livermore National Security, LLC.
+// Produced at the Lawrence Livermore National Laboratory.
+//
+// This file is part of Cram.
+// Written by Todd Gamblin, tgamblin@llnl.gov, All rights reserved.
+// LLNL-CODE-661100
+//
+// For details, see https://github.com/scalability-llnl/cram.
+// Please also see the LICENSE file for our notice and the LGPL.
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License (as published by
+// the Free Software Foundation) version 2.1 dated February 1999.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the IMPLIED WARRANTY OF
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the terms and
+// conditions of the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program; if not, write to the Free Software Foundation,
+// Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+//
+// Message-rate microbenchmark.  Ranks are paired up (0-1, 2-3, ...) and
+// each pair exchanges windows of small nonblocking messages, completing
+// every request individually with MPI_Wait.  This is dominated by per-call
+// overhead, so building it both with and without Cram shows what Cram's
+// interceptors cost on hot point-to-point paths.
+//
+// Usage: message-rate [iterations] [window] [msg bytes]
+//
+#include <stdlib.h>
+#include <stdio.h>
+#include <mpi.h>
+
+#define DEFAULT_ITERATIONS 10000
+#define DEFAULT_WINDOW     64
+#define DEFAULT_MSG_SIZE   8
+#define WARMUP_ITERATIONS  100
+
+static int arg_or_default(int argc, char **argv, int i, int dflt) {
+  return (argc > i) ? atoi(argv[i]) : dflt;
+}
+
+static void exchange(int peer, int sender, int window, int msg_size,
+                     char *buf, MPI_Request *requests) {
+  for (int w=0; w < window; w++) {
+    if (sender) {
+      MPI_Isend(&buf[w * msg_size], msg_size, MPI_CHAR, peer, w,
+                MPI_COMM_WORLD, &requests[w]);
+    } else {
+      MPI_Irecv(&buf[w * msg_size], msg_size, MPI_CHAR, peer, w,
+                MPI_COMM_WORLD, &requests[w]);
+    }
+  }
+  for (int w=0; w < window; w++) {
+    MPI_Wait(&requests[w], MPI_STATUS_IGNORE);
+  }
+}
+
+int main(int argc, char **argv) {
+  MPI_Init(&argc, &argv);
+
+  int rank, size;
+  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+  MPI_Comm_size(MPI_COMM_WORLD, &size);
+
+  int iterations = arg_or_default(argc, argv, 1, DEFAULT_ITERATIONS);
+  int window     = arg_or_default(argc, argv, 2, DEFAULT_WINDOW);
+  int msg_size   = arg_or_default(argc, argv, 3, DEFAULT_MSG_SIZE);
+
+  if (size < 2) {
+    if (rank == 0) {
+      fprintf(stderr, "message-rate needs at least 2 processes.\n");
+    }
+    MPI_Finalize();
+    exit(1);
+  }
+
+  // Odd rank out at the end just sits in the barriers.
+  int active = (rank < size - (size % 2));
+  int peer   = rank ^ 1;
+  int sender = !(rank & 1);
+
+  char *buf = calloc(window, msg_size);
+  MPI_Request *requests = malloc(window * sizeof(MPI_Request));
+
+  if (active) {
+    for (int i=0; i < WARMUP_ITERATIONS; i++) {
+      exchange(peer, sender, window, msg_size, buf, requests);
+    }
+  }
+
+  MPI_Barrier(MPI_COMM_WORLD);
+  double start_time = MPI_Wtime();
+  if (active) {
+    for (int i=0; i < iterations; i++) {
+      exchange(peer, sender, window, msg_size, buf, requests);
+    }
+  }
+  double elapsed = MPI_Wtime() - start_time;
+
+  double max_elapsed;
+  MPI_Reduce(&elapsed, &max_elapsed, 1, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+
+  if (rank == 0) {
+    long long pairs = size / 2;
+    long long messages = pairs * (long long)iterations * window;
+    printf("Pairs:           %12lld\n", pairs);
+    printf("Message size:    %12d bytes\n", msg_size);
+    printf("Messages:        %12lld\n", messages);
+    printf("Elapsed:         %12.6f sec\n", max_elapsed);
+    printf("Message rate:    %12.0f msgs/sec\n", messages / max_elapsed);
+  }
+
+  free(requests);
+  free(buf);
+  MPI_Finalize();
+}
@@ -0,0 +1,91 @@
+c
+c     Fortran version of the message-rate benchmark (see message-rate.c).
+c     Ranks are paired up and exchange windows of small nonblocking
+c     messages on MPI_COMM_WORLD, so every call goes through Cram's
+c     Fortran communicator translation when linked with libfcram.
+c
+      program message_rate
+      implicit none
+      include 'mpif.h'
+      integer niters, nwarmup, nwindow
+      parameter (niters=10000, nwarmup=100, nwindow=64)
+      integer ierr, rank, nprocs, peer, i
+      logical active, sender
+      double precision t0, elapsed, max_elapsed, msgs
+
+      call mpi_init(ierr)
+      call mpi_comm_rank(MPI_COMM_WORLD, rank, ierr)
+      call mpi_comm_size(MPI_COMM_WORLD, nprocs, ierr)
+
+      if (nprocs .lt. 2) then
+         if (rank .eq. 0) then
+            write (*, "(a)") "message-rate needs at least 2 processes."
+         end if
+         call mpi_finalize(ierr)
+         stop 1
+      end if
+
+c     Odd rank out at the end just sits in the barriers.
+      active = rank .lt. (nprocs - mod(nprocs, 2))
+      sender = mod(rank, 2) .eq. 0
+      if (sender) then
+         peer = rank + 1
+      else
+         peer = rank - 1
+      end if
+
+      if (active) then
+         do i=1,nwarmup
+            call exchange(peer, sender, nwindow)
+         end do
+      end if
+
+      call mpi_barrier(MPI_COMM_WORLD, ierr)
+      t0 = mpi_wtime()
+      if (active) then
+         do i=1,niters
+            call exchange(peer, sender, nwindow)
+         end do
+      end if
+      elapsed = mpi_wtime() - t0
+
+      call mpi_reduce(elapsed, max_elapsed, 1, MPI_DOUBLE_PRECISION,
+     &                MPI_MAX, 0, MPI_COMM_WORLD, ierr)
+
+      if (rank .eq. 0) then
+         msgs = dble(nprocs / 2) * dble(niters) * dble(nwindow)
+         write (*, "(a, i12)")     "Pairs:           ", nprocs / 2
+         write (*, "(a, f12.0)")   "Messages:        ", msgs
+         write (*, "(a, f12.6, a)") "Elapsed:         ", max_elapsed,
+     &        " sec"
+         write (*, "(a, f12.0, a)") "Message rate:    ",
+     &        msgs / max_elapsed, " msgs/sec"
+      end if
+
+      call mpi_finalize(ierr)
+      end program message_rate
+
+
+      subroutine exchange(peer, sender, nwindow)
+      implicit none
+      include 'mpif.h'
+      integer peer, nwindow
+      logical sender
+      integer w, ierr
+      integer requests(nwindow)
+      integer status(MPI_STATUS_SIZE)
+      double precision buf(nwindow)
+
+      do w=1,nwindow
+         if (sender) then
+            call mpi_isend(buf(w), 1, MPI_DOUBLE_PRECISION, peer, w,
+     &                     MPI_COMM_WORLD, requests(w), ierr)
+         else
+            call mpi_irecv(buf(w), 1, MPI_DOUBLE_PRECISION, peer, w,
+     &                     MPI_COMM_WORLD, requests(w), ierr)
+         end if
+      end do
+      do w=1,nwindow
+         call mpi_wait(requests(w), status, ierr)
+      end do
+      end subroutine exchange
@@ -0,0 +1,59 @@
+//////////////////////////////////////////////////////////////////////////////
+// Copyright (c) 2014, Lawrence Livermore National Security, LLC.
+// Produced at the Lawrence Livermore National Laboratory.
+//
+// This file is part of Cram.
+// Written by Todd Gamblin, tgamblin@llnl.gov, All rights reserved.
+// LLNL-CODE-661100
+//
+// For details, see https://github.com/scalability-llnl/cram.
+// Please also see the LICENSE file for our notice and the LGPL.
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License (as published by
+// the Free Software Foundation) version 2.1 dated February 1999.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the IMPLIED WARRANTY OF
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the terms and
+// conditions of the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program; if not, write to the Free Software Foundation,
+// Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+//
+// This test program sleeps for the number of seconds in its first argument
+// (default 10) between two barriers.  Use it to test job time limits.  If
+// the second argument is "spin", rank 0 spins for that long instead, without
+// making MPI calls, while the other ranks wait in the second barrier.
+//
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <mpi.h>
+
+int main(int argc, char **argv) {
+    MPI_Init(&argc, &argv);
+
+    int rank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    int seconds = (argc > 1) ? atoi(argv[1]) : 10;
+    int spin = (argc > 2) && !strcmp(argv[2], "spin");
+
+    MPI_Barrier(MPI_COMM_WORLD);
+    if (!spin) {
+        sleep(seconds);
+    } else if (rank == 0) {
+        time_t end = time(NULL) + seconds;
+        while (time(NULL) < end) {
+        }
+    }
+    MPI_Barrier(MPI_COMM_WORLD);
+
+    if (rank == 0) {
+        printf("%s for %d seconds.\n", spin ? "Spun" : "Slept", seconds);
+    }
+    MPI_Finalize();
+}
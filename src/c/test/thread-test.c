@@ -0,0 +1,61 @@
+//////////////////////////////////////////////////////////////////////////////
+// Copyright (c) 2014, Lawrence Livermore National Security, LLC.
+// Produced at the Lawrence Livermore National Laboratory.
+//
+// This file is part of Cram.
+// Written by Todd Gamblin, tgamblin@llnl.gov, All rights reserved.
+// LLNL-CODE-661100
+//
+// For details, see https://github.com/scalability-llnl/cram.
+// Please also see the LICENSE file for our notice and the LGPL.
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License (as published by
+// the Free Software Foundation) version 2.1 dated February 1999.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the IMPLIED WARRANTY OF
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the terms and
+// conditions of the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program; if not, write to the Free Software Foundation,
+// Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+//
+//
+// This test program initializes MPI with MPI_Init_thread and prints each
+// process's thread level, OMP_NUM_THREADS, and the CPUs it is bound to.
+// Use it to test hybrid jobs packed with cram pack --threads.
+//
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <sched.h>
+#include <mpi.h>
+
+int main(int argc, char **argv) {
+    int provided;
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
+
+    int rank, size;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &size);
+
+    char cpus[1024] = "";
+    int len = 0;
+    cpu_set_t mask;
+    if (sched_getaffinity(0, sizeof(mask), &mask) == 0) {
+        for (int cpu=0; cpu < CPU_SETSIZE && len < (int)sizeof(cpus) - 8; cpu++) {
+            if (CPU_ISSET(cpu, &mask)) {
+                len += snprintf(cpus + len, sizeof(cpus) - len, " %d", cpu);
+            }
+        }
+    }
+
+    const char *threads = getenv("OMP_NUM_THREADS");
+    printf("Rank %d of %d: thread level %d, OMP_NUM_THREADS=%s, CPUs:%s\n",
+           rank, size, provided, threads ? threads : "unset", cpus);
+
+    MPI_Barrier(MPI_COMM_WORLD);
+    MPI_Finalize();
+}
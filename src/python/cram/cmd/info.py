@@ -24,6 +24,7 @@
 ##############################################################################
 import argparse
 import math
+from collections import defaultdict
 
 import llnl.util.tty as tty
 from cram.cramfile import *
@@ -37,6 +38,9 @@ def setup_parser(subparser):
                            help="Specific job id to display in more detail.")
     subparser.add_argument('-n', type=int, dest='num_lines', default=10,
                            help="Number of job lines to print")
+    subparser.add_argument('-e', "--env-sizes", action='store_true', dest='env_sizes',
+                           help="Print the environment variables that take up "
+                           "the most space in the file.")
     subparser.add_argument('cramfile', help="Cram file to display.")
 
 
@@ -48,6 +52,19 @@ def write_header(args, cf):
     print "Max job record:   %12d" % cf.max_job_size
 
 
+def write_job_sizes(cf):
+    min_procs = max_procs = None
+    for num_procs in cf.job_procs():
+        if min_procs is None or num_procs < min_procs:
+            min_procs = num_procs
+        if max_procs is None or num_procs > max_procs:
+            max_procs = num_procs
+
+    if min_procs is not None:
+        print "Min job procs:    %12d" % min_procs
+        print "Max job procs:    %12d" % max_procs
+
+
 def write_job_summary(args, cf):
     print "Job command lines:"
 
@@ -62,6 +79,10 @@ def write_job_summary(args, cf):
 def write_job_info(job):
     print "  Num procs: %d"   % job.num_procs
     print "  Working dir: %s" % job.working_dir
+    if job.time_limit:
+        print "  Time limit: %d sec" % job.time_limit
+    if job.threads:
+        print "  Threads per process: %d" % job.threads
     print "  Arguments:"
     print "      " + ' '.join(job.args)
     print "  Environment:"
@@ -69,6 +90,28 @@ def write_job_info(job):
         print "      '%s' : '%s'" % (key, job.env[key])
 
 
+def write_env_sizes(args, cf):
+    # Bytes each variable takes up in the records, and how many records
+    # store it.  The first record stores the whole base environment.
+    sizes = defaultdict(int)
+    records = defaultdict(int)
+    for missing, changed in cf.env_records():
+        for key in missing:
+            sizes[key] += len(key)
+            records[key] += 1
+        for key, val in changed.iteritems():
+            sizes[key] += len(key) + len(val)
+            records[key] += 1
+
+    print "Largest environment variables:"
+    print "%14s %10s  %s" % ("Bytes", "Records", "Variable")
+    largest = sorted(sizes, key=lambda k: sizes[k], reverse=True)
+    for key in largest[:args.num_lines]:
+        print "%14d %10d  %s" % (sizes[key], records[key], key)
+    if len(largest) > args.num_lines:
+        print " [%d more]" % (len(largest) - args.num_lines)
+
+
 def info(parser, args):
     if not args.cramfile:
         tty.error("You must specify a file to display with cram info.")
@@ -82,16 +125,19 @@ def info(parser, args):
                 print "Job %d:" % i
                 write_job_info(job)
 
+        elif args.env_sizes:
+            write_header(args, cf)
+            print
+            write_env_sizes(args, cf)
+
         elif args.job is not None:
             if args.job < 0 or args.job >= len(cf):
                 tty.die("No job %d in this cram file." % args.job)
             print "Job %d:" % args.job
-            for i, job in enumerate(cf):
-                if i == args.job:
-                    write_job_info(job)
-                    break
+            write_job_info(cf[args.job])
 
         else:
             write_header(args, cf)
+            write_job_sizes(cf)
             print
             write_job_summary(args, cf)
@@ -0,0 +1,68 @@
+##############################################################################
+# Copyright (c) 2014, Lawrence Livermore National Security, LLC.
+# Produced at the Lawrence Livermore National Laboratory.
+#
+# This file is part of Cram.
+# Written by Todd Gamblin, tgamblin@llnl.gov, All rights reserved.
+# LLNL-CODE-661100
+#
+# For details, see https://github.com/scalability-llnl/cram.
+# Please also see the LICENSE file for our notice and the LGPL.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License (as published by
+# the Free Software Foundation) version 2.1 dated February 1999.
+#
+# This program is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the IMPLIED WARRANTY OF
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the terms and
+# conditions of the GNU General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public License
+# along with this program; if not, write to the Free Software Foundation,
+# Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+##############################################################################
+import os
+from contextlib import closing
+
+import llnl.util.tty as tty
+from cram.cramfile import *
+from cram.output import *
+
+description = "Print the paths of a job's output files."
+
+def setup_parser(subparser):
+    subparser.add_argument('-o', "--output-mode", dest='output_mode',
+                           type=str.lower, choices=output_modes,
+                           help="Output mode the run used.  Default is "
+                           "CRAM_OUTPUT if it is set, otherwise rank0.")
+    subparser.add_argument('-l', "--layout", dest='layout',
+                           type=str.lower, choices=output_layouts,
+                           help="Output layout the run used.  Default is "
+                           "CRAM_OUTPUT_LAYOUT if it is set, otherwise flat.")
+    subparser.add_argument("--shard-size", type=int, dest='shard_size',
+                           help="Jobs per output directory in the sharded "
+                           "layout.  Default is CRAM_OUTPUT_SHARD_SIZE if it "
+                           "is set, otherwise %d." % default_shard_size)
+    subparser.add_argument('cramfile', help="Cram file the run used.")
+    subparser.add_argument('job', type=int, help="Id of the job.")
+
+
+def output(parser, args):
+    if not os.path.isfile(args.cramfile):
+        tty.die("No such file: %s" % args.cramfile)
+
+    with closing(CramFile(args.cramfile, 'r')) as cf:
+        if not 0 <= args.job < cf.num_jobs:
+            tty.die("%s has no job %d.  Job ids are 0 to %d."
+                    % (args.cramfile, args.job, cf.num_jobs - 1))
+        job = cf[args.job]
+
+    mode = get_output_mode(args.output_mode)
+    shard_size = get_shard_size(args.layout, args.shard_size)
+    paths = job_output_paths(job, args.job, mode, shard_size)
+    if not paths:
+        tty.die("Jobs don't write output files in output mode %s." % mode)
+
+    for path in paths:
+        print path
@@ -26,6 +26,7 @@ import argparse
 from contextlib import closing
 
 import llnl.util.tty as tty
+import cram.cramfile as cramfile
 from cram.cramfile import *
 
 description = "Pack a command invocation into a cramfile"
@@ -37,6 +38,33 @@ def setup_parser(subparser):
                            help="File to store command invocation in.  Default is 'cram.job'")
     subparser.add_argument('-e', "--exe", dest='exe', default=USE_APP_EXE,
                            help="Optionally specify the executable name for the cram job.")
+    subparser.add_argument('-t', "--time-limit", type=int, dest='time_limit',
+                           help="Wall-clock limit for the job in seconds.  "
+                           "Cram ends the job if it runs longer.")
+    subparser.add_argument("--threads", type=int, dest='threads',
+                           help="Threads per process for hybrid MPI+threads jobs.  "
+                           "Cram binds each process to this many CPUs.  "
+                           "Requires format version 5.")
+    subparser.add_argument("--format-version", type=int, choices=(2, 3, 4, 5),
+                           dest='version', default=None,
+                           help="File format version to use when creating a new "
+                           "cramfile.  Default is 3, or 5 with --threads; use 2 for "
+                           "older Cram libraries.  Version 4 adds a string table, "
+                           "which cram repack fills in, and version 5 adds header "
+                           "flags.")
+    subparser.add_argument("--env-profile", dest='env_profile', default='full',
+                           choices=sorted(cramfile.env_profiles),
+                           help="Named set of environment variables to leave out.  "
+                           "'minimal' drops shell and module system state.  "
+                           "Default is 'full' (keep everything).")
+    subparser.add_argument("--env-include", action='append', dest='env_include',
+                           metavar='PATTERN',
+                           help="Pack only environment variables matching this "
+                           "shell-style pattern.  Can be repeated.")
+    subparser.add_argument("--env-exclude", action='append', dest='env_exclude',
+                           metavar='PATTERN',
+                           help="Leave out environment variables matching this "
+                           "shell-style pattern.  Can be repeated.")
     subparser.add_argument('arguments', nargs=argparse.REMAINDER,
                            help="Arguments to pass to executable.")
 
@@ -48,8 +76,26 @@ def pack(parser, args):
     if not args.nprocs:
         tty.die("You must supply a number of processes to run with.")
 
+    if args.time_limit is not None and args.time_limit <= 0:
+        tty.die("Time limit must be a positive number of seconds.")
+
+    if args.threads is not None and args.threads <= 0:
+        tty.die("Threads per process must be a positive number.")
+
     if os.path.isdir(args.file):
         tty.die("%s is a directory." % args.file)
 
-    with closing(CramFile(args.file, 'a')) as cf:
-        cf.pack(args.nprocs, os.getcwd(), args.arguments, os.environ, exe=args.exe)
+    if args.threads is not None and args.version and args.version < 5:
+        tty.die("Threads per process require format version 5.")
+
+    version = args.version or (5 if args.threads is not None else cramfile._version)
+    with closing(CramFile(args.file, 'a', version)) as cf:
+        if args.version and cf.version != args.version:
+            tty.die("%s already has format version %d." % (args.file, cf.version))
+        if args.threads is not None and cf.version < 5:
+            tty.die("Threads per process require format version 5, but %s has "
+                    "version %d.  Use cram repack to upgrade it." % (args.file, cf.version))
+        env = cramfile.filter_env(os.environ, args.env_include, args.env_exclude,
+                                  args.env_profile)
+        cf.pack(args.nprocs, os.getcwd(), args.arguments, env,
+                exe=args.exe, time_limit=args.time_limit, threads=args.threads)
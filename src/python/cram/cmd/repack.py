@@ -0,0 +1,89 @@
+##############################################################################
+# Copyright (c) 2014, Lawrence Livermore National Security, LLC.
+# Produced at the Lawrence Livermore National Laboratory.
+#
+# This file is part of Cram.
+# Written by Todd Gamblin, tgamblin@llnl.gov, All rights reserved.
+# LLNL-CODE-661100
+#
+# For details, see https://github.com/scalability-llnl/cram.
+# Please also see the LICENSE file for our notice and the LGPL.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License (as published by
+# the Free Software Foundation) version 2.1 dated February 1999.
+#
+# This program is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the IMPLIED WARRANTY OF
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the terms and
+# conditions of the GNU General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public License
+# along with this program; if not, write to the Free Software Foundation,
+# Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+##############################################################################
+import os
+from contextlib import closing
+
+import llnl.util.tty as tty
+from cram.cramfile import *
+
+description = "Rewrite a cramfile with a base environment and string table that minimize its size."
+
+def setup_parser(subparser):
+    subparser.add_argument('-o', "--output", dest='output',
+                           help="File to write the repacked cramfile to.  "
+                           "Default is to replace the original.")
+    subparser.add_argument('cramfile', help="Cram file to repack.")
+
+
+def repack(parser, args):
+    if not os.path.isfile(args.cramfile):
+        tty.die("No such file: %s" % args.cramfile)
+
+    # First pass: find the best base environment and string table for all
+    # the jobs.  Collect the strings while the environments are scanned.
+    strings = []
+    def job_envs(cf):
+        for job in cf:
+            strings.append(job.working_dir)
+            strings.extend(job.args)
+            yield job.env
+
+    with closing(CramFile(args.cramfile, 'r')) as cf:
+        if cf.num_jobs == 0:
+            tty.die("%s has no jobs to repack." % args.cramfile)
+        old_version = cf.version
+        old_max_job_size = cf.max_job_size
+        base = choose_base_env(job_envs(cf))
+    table = choose_strings(strings)
+    old_size = os.path.getsize(args.cramfile)
+
+    # Second pass: write every job against the new base.  Write to a
+    # temporary file next to the output so the original is never left
+    # half-written.
+    output = args.output or args.cramfile
+    tmp = output + '.repack'
+    try:
+        with closing(CramFile(args.cramfile, 'r')) as cf:
+            with closing(CramFile(tmp, 'w', 5)) as out:
+                out.pack_strings(table)
+                out.pack_base(base)
+                for job in cf:
+                    out.pack(job)
+                new_max_job_size = out.max_job_size
+    except:
+        if os.path.exists(tmp):
+            os.unlink(tmp)
+        raise
+    os.rename(tmp, output)
+    new_size = os.path.getsize(output)
+
+    print "Repacked %s into %s." % (args.cramfile, output)
+    print "Base environment: %d variables" % len(base)
+    print "String table:     %d strings" % len(table)
+    print
+    print "                     Before        After"
+    print "Cram version:   %12d %12d" % (old_version, 5)
+    print "File size:      %12d %12d" % (old_size, new_size)
+    print "Max job record: %12d %12d" % (old_max_job_size, new_max_job_size)
@@ -0,0 +1,122 @@
+##############################################################################
+# Copyright (c) 2014, Lawrence Livermore National Security, LLC.
+# Produced at the Lawrence Livermore National Laboratory.
+#
+# This file is part of Cram.
+# Written by Todd Gamblin, tgamblin@llnl.gov, All rights reserved.
+# LLNL-CODE-661100
+#
+# For details, see https://github.com/scalability-llnl/cram.
+# Please also see the LICENSE file for our notice and the LGPL.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License (as published by
+# the Free Software Foundation) version 2.1 dated February 1999.
+#
+# This program is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the IMPLIED WARRANTY OF
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the terms and
+# conditions of the GNU General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public License
+# along with this program; if not, write to the Free Software Foundation,
+# Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+##############################################################################
+import os
+import time
+from contextlib import closing
+from multiprocessing.pool import ThreadPool
+
+import llnl.util.tty as tty
+from llnl.util.filesystem import mkdirp
+from cram.cramfile import *
+from cram.output import *
+
+description = "Create a cram file's working directories and output files before a run."
+
+def setup_parser(subparser):
+    subparser.add_argument('-o', "--output-mode", dest='output_mode',
+                           type=str.lower, choices=output_modes,
+                           help="Output mode the run will use.  Default is "
+                           "CRAM_OUTPUT if it is set, otherwise rank0.")
+    subparser.add_argument('-l', "--layout", dest='layout',
+                           type=str.lower, choices=output_layouts,
+                           help="Output layout the run will use.  Default is "
+                           "CRAM_OUTPUT_LAYOUT if it is set, otherwise flat.")
+    subparser.add_argument("--shard-size", type=int, dest='shard_size',
+                           help="Jobs per output directory in the sharded "
+                           "layout.  Default is CRAM_OUTPUT_SHARD_SIZE if it "
+                           "is set, otherwise %d." % default_shard_size)
+    subparser.add_argument('-t', "--threads", type=int, dest='threads', default=32,
+                           help="Number of threads creating directories and "
+                           "files at once.  Default is 32.")
+    subparser.add_argument('cramfile', help="Cram file to stage.")
+
+
+def create_file(path):
+    """Create a file, or truncate it if it exists, as the run would."""
+    os.close(os.open(path, os.O_WRONLY | os.O_CREAT | os.O_TRUNC, 0666))
+
+
+def run_parallel(pool, fn, items, what):
+    """Call fn on every item with a pool of threads, and report how fast
+       it went.  Metadata operations release the GIL, so on a parallel
+       filesystem they overlap even in Python.  Dies if any call fails."""
+    errors = []
+    def call(item):
+        try:
+            fn(item)
+        except (IOError, OSError), e:
+            errors.append(e)
+
+    start = time.time()
+    for _ in pool.imap_unordered(call, items, chunksize=64):
+        pass
+    elapsed = time.time() - start
+
+    rate = len(items) / elapsed if elapsed > 0 else 0
+    print "%-12s %10d in %8.3f sec (%.0f/sec)" % (what + ':', len(items), elapsed, rate)
+    if errors:
+        tty.die("Couldn't create %d %s.  First error: %s"
+                % (len(errors), what.lower(), errors[0]))
+
+
+def stage_jobs(cramfile, mode=None, layout=None, shard_size=None, threads=32):
+    """Create the working directories, shard directories, and output
+       files that a run of cramfile will use.  The output mode, layout,
+       and shard size default to the environment, as in libcram."""
+    mode = get_output_mode(mode)
+    shard_size = get_shard_size(layout, shard_size)
+
+    # Sharded output directories are created along with working directories.
+    dirs = set()
+    files = []
+    with closing(CramFile(cramfile, 'r')) as cf:
+        for job_id, job in enumerate(cf):
+            job_files = output_files(job_id, job.num_procs, mode, shard_size)
+            dirs.add(job.working_dir)
+            if job_files and shard_size:
+                dirs.add(os.path.join(job.working_dir, output_dir(job_id, shard_size)))
+            files.extend(os.path.join(job.working_dir, f) for f in job_files)
+
+    layout = 'sharded' if shard_size else 'flat'
+    print "Staging %s for output mode %s, %s layout, with %d threads." % (
+        cramfile, mode, layout, threads)
+    pool = ThreadPool(threads)
+    try:
+        run_parallel(pool, mkdirp, sorted(dirs), 'Directories')
+        if files:
+            run_parallel(pool, create_file, files, 'Files')
+    finally:
+        pool.close()
+        pool.join()
+
+
+def stage(parser, args):
+    if not os.path.isfile(args.cramfile):
+        tty.die("No such file: %s" % args.cramfile)
+    if args.threads < 1:
+        tty.die("Number of threads must be at least 1.")
+
+    stage_jobs(args.cramfile, args.output_mode, args.layout, args.shard_size,
+               args.threads)
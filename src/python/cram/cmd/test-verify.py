@@ -31,6 +31,7 @@ import llnl.util.tty as tty
 from llnl.util.filesystem import mkdirp
 
 from cram import *
+from cram.output import shard_root
 
 description = "Check a test created by cram test-gen."
 
@@ -79,8 +80,9 @@ def verify_test(test_dir):
         tty.die("Cram file had %d procs but expected %d" % (cf.num_procs, num_procs))
     cf.close()
 
+    # Output files may be in shard directories (CRAM_OUTPUT_LAYOUT=SHARDED).
     os.chdir(test_dir)
-    files = glob.glob('*/cram*out')
+    files = glob.glob('*/cram.*out') + glob.glob('*/%s/*/cram.*out' % shard_root)
 
     short_names = set(os.path.basename(f) for f in files)
     for i, rank in enumerate(xrange(0, num_procs, job_size)):
@@ -0,0 +1,95 @@
+##############################################################################
+# Copyright (c) 2014, Lawrence Livermore National Security, LLC.
+# Produced at the Lawrence Livermore National Laboratory.
+#
+# This file is part of Cram.
+# Written by Todd Gamblin, tgamblin@llnl.gov, All rights reserved.
+# LLNL-CODE-661100
+#
+# For details, see https://github.com/scalability-llnl/cram.
+# Please also see the LICENSE file for our notice and the LGPL.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License (as published by
+# the Free Software Foundation) version 2.1 dated February 1999.
+#
+# This program is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the IMPLIED WARRANTY OF
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the terms and
+# conditions of the GNU General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public License
+# along with this program; if not, write to the Free Software Foundation,
+# Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+##############################################################################
+import os
+import sys
+import time
+from contextlib import closing
+
+import llnl.util.tty as tty
+
+description = "Follow the progress file of a running cram job."
+
+def setup_parser(subparser):
+    subparser.add_argument('-i', "--interval", type=float, dest='interval', default=5,
+                           help="Seconds between checks of the progress file.  Default is 5.")
+    subparser.add_argument('-1', "--once", action='store_true', dest='once',
+                           help="Print the current progress once and exit.")
+    subparser.add_argument('progress_file',
+                           help="Progress file written by a cram job run with CRAM_PROGRESS_FILE.")
+
+
+def read_progress(filename):
+    """Read a progress file into a dict of field name -> number.
+       Returns None if the file doesn't exist yet."""
+    if not os.path.exists(filename):
+        return None
+
+    progress = {}
+    with closing(open(filename)) as f:
+        for line in f:
+            key, sep, value = line.partition(':')
+            if sep:
+                progress[key.strip()] = float(value)
+    return progress
+
+
+def format_progress(p):
+    """One-line summary of a progress dict."""
+    jobs = int(p['jobs'])
+    ended = p['finished'] + p['failed'] + p['timed_out']
+    percent = 100.0 * ended / jobs if jobs else 100.0
+
+    line = "[%6d s] %5.1f%%  %d jobs: %d pending, %d running, %d finished, %d failed, %d timed out" % (
+        p['elapsed'], percent, jobs, p['pending'], p['running'],
+        p['finished'], p['failed'], p['timed_out'])
+    if p['finished']:
+        line += "  (duration min %.1fs, mean %.1fs, max %.1fs)" % (
+            p['min_duration'], p['mean_duration'], p['max_duration'])
+    return line
+
+
+def watch(parser, args):
+    last = None
+    while True:
+        try:
+            progress = read_progress(args.progress_file)
+        except (IOError, ValueError), e:
+            tty.die("Couldn't read %s: %s" % (args.progress_file, e))
+
+        if progress is None:
+            if args.once:
+                tty.die("No progress file at %s." % args.progress_file)
+        elif progress != last:
+            print format_progress(progress)
+            sys.stdout.flush()
+            last = progress
+
+            if progress.get('done'):
+                tty.msg("Cram job is done.")
+                break
+
+        if args.once:
+            break
+        time.sleep(args.interval)
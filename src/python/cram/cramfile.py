@@ -32,12 +32,47 @@ The format is designed to be read easily from a C program, so it only
 writes simple ints and strings.  Ints are all unsigned. Strings start
 with an integer length, after which all the characters are written out.
 
+There are four versions of the format.  Version 2 writes every int as
+a 32-bit big-endian value.  Version 3, the default for new files, uses
+64-bit header fields and writes the counts and lengths in job records
+as varints (LEB128: 7 bits per byte, low bits first, high bit set on
+all but the last byte), so that small values take one byte.  Version 4
+adds a string table, described below.  Version 5 adds a flags field to
+the header, which says whether any job sets threads per process, so
+that libcram only binds processes to CPUs when one does.  `cram pack
+--threads` creates version 5 files.  All versions can be read and
+appended to.
+
 CramFiles use a very simple form of compression to store each job's
 environment, since the environment can grow to be very large and is
 usually quite redundant.  For each job appended to a CramFile after
 the first, we compare its environment to the first job's environment,
 and we only store the differences.
 
+Version 3 files may instead start with a base record: a record with
+zero processes that only holds an environment to compare against.  It
+is not a job, and it isn't counted in the number of jobs.  `cram
+repack` writes a base chosen to make the file as small as possible.
+
+Working directories and arguments often share long prefixes, like
+/path/to/ensemble/run-00001234.  Version 4 files have a string table
+after the header, which `cram repack` fills with strings and prefixes
+that many jobs use.  Each working directory and argument in a job
+record starts with the index of the longest table string it begins
+with, and stores only the rest.  The table is sorted and front-coded:
+each string is stored as the length of the prefix it shares with the
+string before it, and the rest of the string.
+
+A job stream is a file that a cram job reads while it is still being
+written, e.g. through a FIFO, so that jobs start as they are generated.
+Since its counts aren't known until the end, a stream's header has all
+bits of the job count set and zeros for the other counts and flags, and
+a record
+size of 0 marks the end of the stream.  Streams use version 3 or later,
+and have an empty string table in version 4.  Open a CramFile with
+stream=True to write one.  Streams can't be read or appended to with
+CramFile; only a cram job reads them.
+
 We could potentially get more compression out of comparing each
 environment to its successor, but that would mean that you'd need to
 read all preceding jobs to decode one.  We wanted a format that would
@@ -52,6 +87,11 @@ Sample usage:
               os.env))        # environment, as a dict.
   cf.close()
 
+To leave variables that applications don't read out of the environment,
+pass it through filter_env first, e.g. filter_env(os.environ,
+profile='minimal').  Smaller environments make every job record, and
+every process's startup, cheaper.
+
 To read from a CramFile, use len and iterate:
 
   cf = CramFile('file.cram')
@@ -60,65 +100,127 @@ To read from a CramFile, use len and iterate:
       # do something with job
   cf.close()
 
-Like regular files, CramFiles do not support indexing.  To do that,
-read all jobs into a list first, then index the list.
+CramFiles can be indexed, e.g. cf[i], but reading job i skips over the
+i jobs before it, so iterate to read many jobs.  Iterating and indexing
+use the C decoder in libcramfile when it is available (see cram.native),
+which is much faster for large files than the pure-Python reader.
 
 Here is the CramFile format.  '*' below means that the section can be
 repeated a variable number of times.
 
+In the table, count means int(4) in version 2 and varint in version 3
+and later.
+
 Type       Name
 ========================================================================
 Header
 ------------------------------------------------------------------------
 int(4)       0x6372616d ('cram')
 int(4)       Version
-int(4)       # of jobs
-int(4)       # of processes
-int(4)       Size of max job record in this file
+int(4|8)     # of jobs                        (int(8) in version 3)
+int(4|8)     # of processes                   (int(8) in version 3)
+int(4|8)     Size of max job record in this file (int(8) in version 3)
+int(8)       Flags (version 5 only): 1 if any job sets threads per process
+
+String table (version 4 and later)
+------------------------------------------------------------------------
+count        Size of the rest of the string table in bytes
+count        Number of strings
+ * count       Length of prefix shared with the previous string
+ * str         Rest of the string
 
 * Job records
 ------------------------------------------------------------------------
-  int(4)     Size of job record in bytes
-  int(4)     Number of processes
-  str        Working dir
+  count      Size of job record in bytes
+  count      Number of processes
+  jstr       Working dir
 
-  int(4)     Number of command line arguments
-   * str       Command line arguments, in original order
+  count      Number of command line arguments
+   * jstr      Command line arguments, in original order
 
-  int(4)     Number of subtracted env var names (0 for first record)
+  count      Number of subtracted env var names (0 for first record)
    * str       Subtracted env vars in sorted order.
-  int(4)     Number of added or changed env vars
+  count      Number of added or changed env vars
    * str      Names of added/changed var
    * str      Corresponding value
 
-Env vars are stored alternating keys and values, in sorted order by key.
+Strings are a count of bytes followed by the bytes.  Env vars are stored
+alternating keys and values, in sorted order by key.  In version 4, a
+jstr is a count holding the index plus one of the string table string
+it starts with (or 0 for none), then a str with the rest of the string.
+Before version 4, a jstr is just a str.
 ========================================================================
 """
 import os
 import re
 
-from collections import defaultdict
+from fnmatch import fnmatchcase
+from collections import defaultdict, Counter
 from contextlib import contextmanager, closing
+from cStringIO import StringIO
 
 from cram.serialization import *
+import cram.native as native
 import llnl.util.tty as tty
 
 # Magic number goes at beginning of file.
 _magic = 0x6372616d
 
 # Increment this when the binary format changes (hopefully infrequent)
-_version = 2
+_version = 3
+
+# Versions this module can read and write.
+_supported_versions = (2, 3, 4, 5)
+
+# Job count in the header of a job stream, whose counts aren't known
+# until it ends.
+_stream_num_jobs = (1 << 64) - 1
+
+# Size of the header fields after the magic number and version.
+_header_int_sizes = { 2 : 4, 3 : 8, 4 : 8, 5 : 8 }
 
-# Offsets of file header fields
-_magic_offset   = 0
-_version_offset = 4
-_njobs_offset   = 8
-_nprocs_offset  = 12
-_max_job_offset = 16
+# Header flag (version 5) set when any job in the file sets THREADS_VAR.
+FLAG_THREADS = 1
+
+# Characters that string table prefixes can end with.
+_prefix_delimiters = frozenset('/-_.=:,')
+
+# Most bytes of strings to put in a string table, counting a null for
+# each as libcram does when it decodes them.  Every process in a cram job
+# decodes the whole table, so it is kept small.  This bounds the decoded
+# strings, not the front-coded table in the file, which is usually smaller.
+_max_string_table_size = 1 << 20
+
+# Bytes a string table reference usually adds to a string, beyond the 0
+# that marks a string without one.
+_string_ref_size = 1
 
 # Default name for cram executable.
 USE_APP_EXE = "<exe>"
 
+# Variable in a job's environment that holds its time limit in seconds.
+# libcram ends the job if it runs longer than this.
+TIME_LIMIT_VAR = "CRAM_TIME_LIMIT"
+
+# Variable in a job's environment that holds its threads per process.
+# libcram sets OpenMP's thread count and binds each process to this many
+# CPUs.
+THREADS_VAR = "CRAM_THREADS_PER_RANK"
+
+# Named sets of environment variables to leave out of packed jobs, as
+# shell-style patterns.  'minimal' drops interactive shell and module
+# system state that MPI applications don't read.
+env_profiles = {
+    'full'    : [],
+    'minimal' : ['LS_COLORS', 'LSCOLORS', 'PS1', 'PS2', 'PS3', 'PS4',
+                 'PROMPT_COMMAND', 'HIST*', 'BASH_FUNC_*', 'OLDPWD', 'SHLVL',
+                 '_', 'TERMCAP', 'COLORTERM', 'LESS*', 'MAIL', 'MAILCHECK',
+                 'WINDOWID', 'DISPLAY', 'XAUTHORITY', 'SSH_*', 'XDG_*',
+                 'DBUS_*', 'LOADEDMODULES', '_LMFILES_', '_ModuleTable*',
+                 '__LMOD_*', 'LMOD_*', '__MODULES_*', 'MODULEPATH*',
+                 'MODULESHOME', 'MODULE_VERSION*'],
+}
+
 
 @contextmanager
 def save_position(stream):
@@ -146,6 +248,117 @@ def compress(base, modified):
     return missing, changed
 
 
+def choose_base_env(envs):
+    """Given an iterable of environment dicts, return the base environment
+       that makes their compressed diffs as small as possible in total.
+
+       Each key's cost is independent of the others, so the base is
+       built one key at a time.  A key is left out of the base, or given
+       the value that saves the most bytes over all environments, counting
+       the bytes to store it in the base itself.
+    """
+    num_envs = 0
+    values = defaultdict(lambda: defaultdict(int))
+    for env in envs:
+        num_envs += 1
+        for key, val in env.iteritems():
+            values[key][val] += 1
+
+    def string_size(string):
+        return varint_size(len(string)) + len(string)
+
+    base = {}
+    for key, counts in values.iteritems():
+        key_size = string_size(key)
+        num_without_key = num_envs - sum(counts.itervalues())
+
+        # Savings from putting key=val in the base: envs with that value no
+        # longer store it, but envs without the key must now subtract it.
+        best_savings, best_val = 0, None
+        for val, count in counts.iteritems():
+            pair_size = key_size + string_size(val)
+            savings = (count * pair_size - num_without_key * key_size
+                       - pair_size)
+            if savings > best_savings:
+                best_savings, best_val = savings, val
+
+        if best_val is not None:
+            base[key] = best_val
+    return base
+
+
+def string_prefixes(string):
+    """Yield a string, then its prefixes that end with a delimiter,
+       longest first.  These are the parts of a working directory or
+       argument that can come from a string table."""
+    yield string
+    for i in xrange(len(string) - 2, -1, -1):
+        if string[i] in _prefix_delimiters:
+            yield string[:i + 1]
+
+
+def choose_strings(strings, max_size=_max_string_table_size):
+    """Given an iterable of jobs' working directories and arguments,
+       return a sorted list of strings for a string table that makes them
+       as small as possible in total.
+
+       Table strings are whole strings or prefixes ending in a delimiter,
+       like '/path/to/run-'.  Each string is encoded with the longest table
+       string it starts with, which saves that string's length each time.
+       Start with every candidate more than one string could use, then
+       drop those that don't save more than they cost in the table, until
+       none are dropped.
+    """
+    counts = Counter(strings)
+
+    candidate_counts = defaultdict(int)
+    for string, count in counts.iteritems():
+        for prefix in string_prefixes(string):
+            candidate_counts[prefix] += count
+    table = set(prefix for prefix, count in candidate_counts.iteritems()
+                if count > 1 and len(prefix) > _string_ref_size)
+
+    while True:
+        savings = defaultdict(int)
+        for string, count in counts.iteritems():
+            for prefix in string_prefixes(string):
+                if prefix in table:
+                    savings[prefix] += count * (len(prefix) - _string_ref_size)
+                    break
+
+        useful = set(prefix for prefix in table if savings[prefix] > len(prefix))
+        if useful == table:
+            break
+        table = useful
+
+    # Keep the strings that save the most, up to the table's size limit.
+    chosen = []
+    size = 0
+    for prefix in sorted(table, key=lambda p: savings[p] - len(p), reverse=True):
+        if size + len(prefix) + 1 <= max_size:
+            chosen.append(prefix)
+            size += len(prefix) + 1
+    return sorted(chosen)
+
+
+def filter_env(env, include=None, exclude=None, profile='full'):
+    """Return a copy of env with only the variables that should be packed.
+       A variable is kept if it matches one of the include patterns (or if
+       there are none), and it matches no exclude pattern and no pattern
+       in the named profile.  Patterns are shell-style, like 'LMOD_*'.
+    """
+    if profile not in env_profiles:
+        raise ValueError("Unknown environment profile: %s" % profile)
+    exclude = list(exclude or []) + env_profiles[profile]
+
+    def keep(key):
+        if include and not any(fnmatchcase(key, p) for p in include):
+            return False
+        return not any(fnmatchcase(key, p) for p in exclude)
+
+    return dict((k, v) for k, v in env.iteritems() if keep(k))
+
+
 def decompress(base, missing, changed):
     """Given the base dict and the output of compress(), reconstruct the
        modified dict."""
@@ -161,7 +374,8 @@ class Job(object):
        This contains all environmental context needed to launch the job
        later from within MPI.
     """
-    def __init__(self, num_procs, working_dir, args, env):
+    def __init__(self, num_procs, working_dir, args, env, time_limit=None,
+                 threads=None):
         """Construct a new Job object.
 
         Arguments:
@@ -169,6 +383,8 @@ class Job(object):
         working_dir -- path to working directory for job.
         args        -- sequence of arguments, INCLUDING the executable name.
         env         -- dict containng environment.
+        time_limit  -- optional wall-clock limit for the job, in seconds.
+        threads     -- optional number of threads per process.
 
         """
 
@@ -181,9 +397,32 @@ class Job(object):
             args = re.split(r'\s+', args)
         self.args = args
 
+        # The time limit and thread count travel with the job in its
+        # environment.  OMP_NUM_THREADS is set too, for tools that read it.
+        if time_limit is not None or threads is not None:
+            env = dict(env)
+        if time_limit is not None:
+            env[TIME_LIMIT_VAR] = str(time_limit)
+        if threads is not None:
+            env[THREADS_VAR] = str(threads)
+            env['OMP_NUM_THREADS'] = str(threads)
         self.env = env
 
 
+    @property
+    def time_limit(self):
+        """Wall-clock limit for this job in seconds, or None if it has none."""
+        limit = self.env.get(TIME_LIMIT_VAR)
+        return int(limit) if limit else None
+
+
+    @property
+    def threads(self):
+        """Threads per process for this job, or None if it doesn't say."""
+        threads = self.env.get(THREADS_VAR)
+        return int(threads) if threads else None
+
+
     def __eq__(self, other):
         return (self.num_procs == other.num_procs and
                 self.working_dir == other.working_dir and
@@ -199,21 +438,44 @@ class CramFile(object):
     """A CramFile compactly stores a number of Jobs, so that they can
        later be run within the same MPI job by cram.
     """
-    def __init__(self, filename, mode='r'):
+    def __init__(self, filename, mode='r', version=_version, stream=False):
         """The CramFile constructor functions much like open().
 
            The constructor takes a filename and an I/O mode, which can
            be 'r', 'w', or 'a', for read, write, or append.
 
            Opening a CramFile for writing will create a file with a
-           simple header containing no jobs.
+           simple header containing no jobs.  New files use the format
+           version passed in; appending keeps the existing file's version.
+
+           With stream=True and mode 'w', the file is written as a job
+           stream, which a cram job can start reading before it is done.
+           Each job is flushed as it is packed, and close() marks the end
+           of the stream.  The file can be a FIFO.
         """
+        # Record that other jobs' environments are compressed against.
+        # This is the first job, unless the file starts with a base record.
+        self.base = None
+        self.has_base_record = False
+
         # Save the first job from the file.
         self.first_job = None
 
+        # Strings that working dirs and args can start with (version 4).
+        self.strings = []
+        self._string_ids = {}
+
+        self.filename = filename
         self.mode = mode
+        self.job_stream = stream
         if mode not in ('r', 'w', 'a'):
             raise ValueError("Mode must be 'r', 'w', or 'a'.")
+        if version not in _supported_versions:
+            raise ValueError("Unsupported cram file version: %s" % version)
+        if stream and mode != 'w':
+            raise ValueError("Job streams can only be opened for writing.")
+        if stream and version < 3:
+            raise ValueError("Job streams require cram file version 3.")
 
         if mode == 'r':
             if not os.path.exists(filename) or os.path.isdir(filename):
@@ -224,11 +486,16 @@ class CramFile(object):
 
         elif mode == 'w' or (mode == 'a' and not os.path.exists(filename)):
             self.stream = open(filename, 'wb')
-            self.version = _version
+            self.version = version
             self.num_jobs = 0
             self.num_procs = 0
             self.max_job_size = 0
+            self.flags = 0
             self._write_header()
+            if self.version >= 4:
+                self._write_string_table()
+            if self.job_stream:
+                self.stream.flush()
 
         elif mode == 'a':
             self.stream = open(filename, 'rb+')
@@ -247,94 +514,261 @@ class CramFile(object):
             raise IOError("%s is not a Cramfile!")
 
         self.version = read_int(self.stream, 4)
-        if self.version != _version:
+        if self.version not in _supported_versions:
             raise IOError(
-                "Version mismatch: File has version %s, but this is version %s"
-                % (self.version, _version))
+                "Version mismatch: File has version %s, but this reads versions %s"
+                % (self.version, ', '.join(str(v) for v in _supported_versions)))
+
+        int_size = _header_int_sizes[self.version]
+        self.num_jobs = read_int(self.stream, int_size)
+        self.num_procs = read_int(self.stream, int_size)
+        self.max_job_size = read_int(self.stream, int_size)
+        self.flags = read_int(self.stream, int_size) if self.version >= 5 else 0
 
-        self.num_jobs = read_int(self.stream, 4)
-        self.num_procs = read_int(self.stream, 4)
-        self.max_job_size = read_int(self.stream, 4)
+        if self.version >= 3 and self.num_jobs == _stream_num_jobs:
+            raise IOError("%s is a job stream, which only a cram job can read."
+                          % self.filename)
 
-        # read in the first job automatically if it is there, since
+        if self.version >= 4:
+            self._read_string_table()
+
+        # read in the first record automatically if it is there, since
         # it is used for compression of subsequent jobs.
-        if self.num_jobs > 0:
+        with save_position(self.stream):
+            self.stream.seek(0, os.SEEK_END)
+            file_size = self.stream.tell()
+        if self.stream.tell() < file_size:
             self._read_job()
 
+        # Where the job after the first one starts, for skipping to jobs.
+        self._second_job_pos = self.stream.tell()
+
 
     def _write_header(self):
-        """Jump to the beginning of the file and write the header."""
+        """Jump to the beginning of the file and write the header.  A job
+           stream's header is written once, when the file is created."""
+        int_size = _header_int_sizes[self.version]
+        if self.job_stream:
+            write_int(self.stream, _magic, 4)
+            write_int(self.stream, self.version, 4)
+            write_int(self.stream, _stream_num_jobs, int_size)
+            write_int(self.stream, 0, int_size)
+            write_int(self.stream, 0, int_size)
+            if self.version >= 5:
+                write_int(self.stream, 0, int_size)
+            return
+
         self.stream.seek(0)
         write_int(self.stream, _magic, 4)
         write_int(self.stream, self.version, 4)
-        write_int(self.stream, self.num_jobs, 4)
-        write_int(self.stream, self.num_procs, 4)
-        write_int(self.stream, self.max_job_size, 4)
+        write_int(self.stream, self.num_jobs, int_size)
+        write_int(self.stream, self.num_procs, int_size)
+        write_int(self.stream, self.max_job_size, int_size)
+        if self.version >= 5:
+            write_int(self.stream, self.flags, int_size)
+
+
+    def _header_size(self):
+        """Size of the header, which the string table follows."""
+        num_ints = 4 if self.version >= 5 else 3
+        return 8 + num_ints * _header_int_sizes[self.version]
+
+
+    def _write_string_table(self):
+        """Write the string table at the current position."""
+        table = StringIO()
+        write_varint(table, len(self.strings))
+        prev = ''
+        for string in self.strings:
+            shared = len(os.path.commonprefix((prev, string)))
+            write_varint(table, shared)
+            write_string(table, string[shared:], write_varint)
+            prev = string
+
+        table = table.getvalue()
+        write_varint(self.stream, len(table))
+        self.stream.write(table)
+
+
+    def _read_string_table(self):
+        """Read the string table at the current position."""
+        table_size = read_varint(self.stream)
+        start_pos = self.stream.tell()
 
+        num_strings = read_varint(self.stream)
+        prev = ''
+        for i in xrange(num_strings):
+            shared = read_varint(self.stream)
+            prev = prev[:shared] + read_string(self.stream, read_varint)
+            self.strings.append(prev)
+        self._string_ids = dict((s, i) for i, s in enumerate(self.strings))
+
+        actual_size = self.stream.tell() - start_pos
+        if actual_size != table_size:
+            raise IOError("Cram file string table size is invalid! "
+                          "Expected %d, found %d" % (table_size, actual_size))
+
+
+    def _write_count(self, stream, count):
+        """Write a count or length in a job record."""
+        if self.version >= 3:
+            return write_varint(stream, count)
+        return write_int(stream, count, 4)
+
+
+    def _read_count(self):
+        """Read a count or length from a job record."""
+        if self.version >= 3:
+            return read_varint(self.stream)
+        return read_int(self.stream, 4)
+
+
+    def _write_string(self, stream, string):
+        return write_string(stream, string, self._write_count)
+
+
+    def _read_string(self):
+        return read_string(self.stream, lambda stream: self._read_count())
 
-    def _pack(self, job):
-        """Appends a job to a cram file, compressing the environment in the
-           process."""
-        if self.mode == 'r':
-            raise IOError("Cannot pack into CramFile opened for reading.")
 
-        # Save offset and write 0 for size to start with
-        start_offset = self.stream.tell()
-        size = 0
-        write_int(self.stream, 0, 4)
+    def _write_job_string(self, stream, string):
+        """Write a working dir or argument.  In version 4, it starts with
+           the longest string in the string table that it can."""
+        if self.version >= 4:
+            index = 0
+            if self._string_ids:
+                for prefix in string_prefixes(string):
+                    if prefix in self._string_ids:
+                        index = self._string_ids[prefix] + 1
+                        string = string[len(prefix):]
+                        break
+            write_varint(stream, index)
+        self._write_string(stream, string)
+
+
+    def _read_job_string(self):
+        """Read a working dir or argument."""
+        prefix = ''
+        if self.version >= 4:
+            index = read_varint(self.stream)
+            if index:
+                prefix = self.strings[index - 1]
+        return prefix + self._read_string()
+
+
+    def _write_record(self, job):
+        """Appends a record for a job to the file, compressing its
+           environment against the base.  Returns the record's size."""
+        # Build the record first, since its size goes in front of it.
+        record = StringIO()
 
         # Number of processes
-        size += write_int(self.stream, job.num_procs, 4)
+        self._write_count(record, job.num_procs)
 
         # Working directory
-        size += write_string(self.stream, job.working_dir)
+        self._write_job_string(record, job.working_dir)
 
         # Command line arguments
-        size += write_int(self.stream, len(job.args), 4)
+        self._write_count(record, len(job.args))
         for arg in job.args:
-            size += write_string(self.stream, arg)
+            self._write_job_string(record, arg)
 
-        # Compress using first dict
+        # Compress using base dict
         missing, changed = compress(
-            self.first_job.env if self.first_job else {}, job.env)
+            self.base.env if self.base else {}, job.env)
 
         # Subtracted env var names
-        size += write_int(self.stream, len(missing), 4)
+        self._write_count(record, len(missing))
         for key in sorted(missing):
-            size += write_string(self.stream, key)
+            self._write_string(record, key)
 
         # Changed environment variables
-        size += write_int(self.stream, len(changed), 4)
+        self._write_count(record, len(changed))
         for key in sorted(changed.keys()):
-            size += write_string(self.stream, key)
-            size += write_string(self.stream, changed[key])
-
-        with save_position(self.stream):
-            # Update job chunk size
-            self.stream.seek(start_offset)
-            write_int(self.stream, size, 4)
-
-            # Update total number of jobs in file.
-            self.num_jobs += 1
-            self.stream.seek(_njobs_offset)
-            write_int(self.stream, self.num_jobs, 4)
-
-            # Update total number of processes in all jobs.
-            self.num_procs += job.num_procs
-            self.stream.seek(_nprocs_offset)
-            write_int(self.stream, self.num_procs, 4)
-
-            # Update max job size if necessary
-            if size > self.max_job_size:
-                self.max_job_size = size
-                self.stream.seek(_max_job_offset)
-                write_int(self.stream, self.max_job_size, 4)
-
-        # Discard all but hte first job after writing.  This conserves
-        # memory when writing cram files.
-        if not self.first_job:
-            self.first_job = Job(
+            self._write_string(record, key)
+            self._write_string(record, changed[key])
+
+        # Write the job record, preceded by its size.
+        record = record.getvalue()
+        size = len(record)
+        self._write_count(self.stream, size)
+        self.stream.write(record)
+
+        # Discard all but the base after writing.  This conserves memory
+        # when writing cram files.
+        if not self.base:
+            self.base = Job(
                 job.num_procs, job.working_dir, list(job.args), job.env.copy())
+        return size
+
+
+    def _pack(self, job):
+        """Appends a job to a cram file, compressing the environment in the
+           process."""
+        if self.mode == 'r':
+            raise IOError("Cannot pack into CramFile opened for reading.")
+
+        size = self._write_record(job)
+
+        # Update the job count, process count, max job size, and flags.
+        self.num_jobs += 1
+        self.num_procs += job.num_procs
+        self.max_job_size = max(self.max_job_size, size)
+        if job.threads:
+            self.flags |= FLAG_THREADS
+        self._finish_record()
+
+
+    def _finish_record(self):
+        """Make a newly written record visible: rewrite the header with
+           the new counts, or flush a job stream so its reader gets it."""
+        if self.job_stream:
+            self.stream.flush()
+        else:
+            with save_position(self.stream):
+                self._write_header()
+
+
+    def pack_strings(self, strings):
+        """Write a string table, which holds strings that jobs' working
+           directories and arguments can start with, so that records
+           needn't repeat them.  The table must be written to a new file
+           before any records, and it requires format version 4.
+        """
+        if self.mode == 'r':
+            raise IOError("Cannot pack into CramFile opened for reading.")
+        if self.version < 4:
+            raise ValueError("String tables require cram file version 4.")
+        if self.base:
+            raise IOError("A string table must be written before any records.")
+        if self.job_stream:
+            raise IOError("Job streams can't have string tables.")
+
+        self.strings = sorted(set(strings))
+        self._string_ids = dict((s, i) for i, s in enumerate(self.strings))
+        self.stream.seek(self._header_size())
+        self._write_string_table()
+        self.stream.truncate()
+
+
+    def pack_base(self, env):
+        """Write a base record, which holds an environment that later jobs'
+           environments are compressed against.  A base record has zero
+           processes and isn't a job, so it is never run and isn't counted
+           in num_jobs.  It must be the first record in a new file, and it
+           requires format version 3.
+        """
+        if self.mode == 'r':
+            raise IOError("Cannot pack into CramFile opened for reading.")
+        if self.version < 3:
+            raise ValueError("Base records require cram file version 3.")
+        if self.base:
+            raise IOError("A base record must be the first record in a file.")
+
+        size = self._write_record(Job(0, '', [], env))
+        self.has_base_record = True
+        self.max_job_size = max(self.max_job_size, size)
+        self._finish_record()
 
 
     def pack(self, *args, **kwargs):
@@ -360,49 +794,49 @@ class CramFile(object):
 
             # By default, cram takes app's exe name.
             exe = kwargs.pop('exe', USE_APP_EXE)
+            time_limit = kwargs.pop('time_limit', None)
+            threads = kwargs.pop('threads', None)
             if kwargs:
                 raise ValueError("%s is an invalid keyword arg for this function!"
                                  % next(iter(kwargs.keys())))
 
             args = [exe] + list(args)
-            self._pack(Job(nprocs, working_dir, args, env))
+            self._pack(Job(nprocs, working_dir, args, env, time_limit, threads))
 
 
-    def _read_job(self):
-        """Read the next job out of the CramFile.
-
-           This is an internal method because it's used to load stuff
-           that isn't already in memory.  Client code should use
-           len(), [], or iterate to read jobs from CramFiles.
+    def _read_record(self):
+        """Read the next job record as it is stored: its number of
+           processes, working directory, arguments, and the environment
+           variables it removes from and changes in the base environment.
         """
         # Size of job record
-        job_bytes   = read_int(self.stream, 4)
+        job_bytes   = self._read_count()
         start_pos = self.stream.tell()
 
         # Number of processes
-        num_procs   = read_int(self.stream, 4)
+        num_procs   = self._read_count()
 
         # Working directory
-        working_dir = read_string(self.stream)
+        working_dir = self._read_job_string()
 
         # Command line arguments
-        num_args    = read_int(self.stream, 4)
+        num_args    = self._read_count()
         args        = []
         for i in xrange(num_args):
-            args.append(read_string(self.stream))
+            args.append(self._read_job_string())
 
         # Subtracted environment variables
-        num_missing = read_int(self.stream, 4)
+        num_missing = self._read_count()
         missing     = []
         for i in xrange(num_missing):
-            missing.append(read_string(self.stream))
+            missing.append(self._read_string())
 
         # Changed environment variables
-        num_changed = read_int(self.stream, 4)
+        num_changed = self._read_count()
         changed = {}
         for i in xrange(num_changed):
-            key = read_string(self.stream)
-            val = read_string(self.stream)
+            key = self._read_string()
+            val = self._read_string()
             changed[key] = val
 
         # validate job record size
@@ -411,31 +845,176 @@ class CramFile(object):
             raise Exception("Cram file job record size is invalid! "+
                             "Expected %d, found %d" % (job_bytes, actual_size))
 
-        # Decompress using first dictionary
-        env = decompress(self.first_job.env if self.first_job else {},
+        return num_procs, working_dir, args, missing, changed
+
+
+    def _read_job(self):
+        """Read the next job out of the CramFile.
+
+           This is an internal method because it's used to load stuff
+           that isn't already in memory.  Client code should use
+           len(), [], or iterate to read jobs from CramFiles.
+        """
+        record_pos = self.stream.tell()
+        num_procs, working_dir, args, missing, changed = self._read_record()
+
+        # Decompress using base dictionary
+        env = decompress(self.base.env if self.base else {},
                          missing, changed)
 
         job = Job(num_procs, working_dir, args, env)
+        if not self.base:
+            self.base = job
+
+            # A base record with no processes isn't a job.  Read the first
+            # job after it, if there is one.
+            if num_procs == 0:
+                self.has_base_record = True
+                return self._read_job() if self.num_jobs > 0 else None
+
         if not self.first_job:
             self.first_job = job
+            self._first_job_pos = record_pos
         return job
 
 
+    def _skip_record(self):
+        """Skip the next job record without decoding it.  Returns the
+           job's number of processes."""
+        job_bytes = self._read_count()
+        start_pos = self.stream.tell()
+        num_procs = self._read_count()
+        self.stream.seek(start_pos + job_bytes)
+        return num_procs
+
+
+    def _native_reader(self):
+        """Open a reader for this file with libcramfile, or return None
+           if libcramfile isn't available."""
+        if not native.available():
+            return None
+        try:
+            return native.Reader(self.filename)
+        except IOError:
+            return None
+
+
+    def _read_native_job(self, reader):
+        """Read the next job after the first one with a native reader."""
+        num_procs, working_dir, args, missing, changed = reader.next_record()
+        return Job(num_procs, working_dir, args,
+                   decompress(self.base.env, missing, changed))
+
+
     def __iter__(self):
         """Iterate over all jobs in the CramFile."""
         if self.mode != 'r':
             raise IOError("Cramfile is not opened for reading.")
 
+        if self.num_jobs == 0:
+            return
+
         yield self.first_job
+
+        reader = self._native_reader()
+        if reader:
+            with closing(reader):
+                reader.skip(1)
+                for i in xrange(1, self.num_jobs):
+                    yield self._read_native_job(reader)
+            return
+
         for i in xrange(1, self.num_jobs):
             yield self._read_job()
 
 
+    def __getitem__(self, index):
+        """Read the job at index.  Jobs before it are skipped without
+           being decoded, but reaching a job late in a large file still
+           takes a scan through the file."""
+        if self.mode != 'r':
+            raise IOError("Cramfile is not opened for reading.")
+
+        if index < 0:
+            index += self.num_jobs
+        if not 0 <= index < self.num_jobs:
+            raise IndexError("CramFile index out of range")
+
+        if index == 0:
+            return self.first_job
+
+        reader = self._native_reader()
+        if reader:
+            with closing(reader):
+                reader.skip(index)
+                return self._read_native_job(reader)
+
+        with save_position(self.stream):
+            self.stream.seek(self._second_job_pos)
+            for i in xrange(index - 1):
+                self._skip_record()
+            return self._read_job()
+
+
+    def job_procs(self):
+        """Iterate over the number of processes in each job.  This only
+           reads the start of each job record, so it is much faster than
+           iterating over the jobs themselves."""
+        if self.mode != 'r':
+            raise IOError("Cramfile is not opened for reading.")
+
+        if self.num_jobs == 0:
+            return
+
+        reader = self._native_reader()
+        if reader:
+            with closing(reader):
+                for num_procs in reader.job_procs():
+                    yield num_procs
+            return
+
+        yield self.first_job.num_procs
+        with save_position(self.stream):
+            self.stream.seek(self._second_job_pos)
+            for i in xrange(1, self.num_jobs):
+                yield self._skip_record()
+
+
+    def env_records(self):
+        """Iterate over the environment of each record as it is stored:
+           a list of the variables it removes from the base environment,
+           and a dict of the variables it adds or changes.  The first
+           record, which may be a base record rather than a job, stores
+           the whole base environment as changes."""
+        if self.mode != 'r':
+            raise IOError("Cramfile is not opened for reading.")
+
+        if self.has_base_record:
+            yield [], self.base.env
+
+        if self.num_jobs == 0:
+            return
+
+        reader = self._native_reader()
+        if reader:
+            with closing(reader):
+                for i in xrange(self.num_jobs):
+                    yield reader.next_record()[3:]
+            return
+
+        with save_position(self.stream):
+            self.stream.seek(self._first_job_pos)
+            for i in xrange(self.num_jobs):
+                yield self._read_record()[3:]
+
+
     def __len__(self):
         """Number of jobs in the file."""
         return self.num_jobs
 
 
     def close(self):
-        """Close the underlying file stream."""
+        """Close the underlying file stream.  This ends a job stream."""
+        if self.job_stream:
+            write_varint(self.stream, 0)
         self.stream.close()
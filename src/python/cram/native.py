@@ -0,0 +1,173 @@
+##############################################################################
+# Copyright (c) 2014, Lawrence Livermore National Security, LLC.
+# Produced at the Lawrence Livermore National Laboratory.
+#
+# This file is part of Cram.
+# Written by Todd Gamblin, tgamblin@llnl.gov, All rights reserved.
+# LLNL-CODE-661100
+#
+# For details, see https://github.com/scalability-llnl/cram.
+# Please also see the LICENSE file for our notice and the LGPL.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License (as published by
+# the Free Software Foundation) version 2.1 dated February 1999.
+#
+# This program is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the IMPLIED WARRANTY OF
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the terms and
+# conditions of the GNU General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public License
+# along with this program; if not, write to the Free Software Foundation,
+# Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+##############################################################################
+"""
+This module loads libcramfile, Cram's C cram file reader built without
+MPI, so that CramFile can decode jobs in C instead of in pure Python.
+Decoding in C is much faster for files with many jobs.
+
+The library is found in the lib directory of the prefix Cram is
+installed in.  Set CRAM_NATIVE_LIB to the path of a library to use a
+different one, or to 'none' to always use the pure-Python reader.  If
+the library can't be loaded, CramFile falls back to pure Python.
+"""
+import os
+import ctypes
+from itertools import izip
+
+# Environment variable that overrides where to find the library.
+LIB_VAR = 'CRAM_NATIVE_LIB'
+
+# Names the library may have in the install prefix's lib directory.
+_lib_names = ('libcramfile.so', 'libcramfile.dylib')
+
+# Number of jobs to skip per call when scanning process counts.
+_scan_chunk_size = 65536
+
+# The loaded library.  False until we've tried to load it.
+_lib = False
+
+
+def _find_lib():
+    """Return the path to libcramfile, or None if there isn't one."""
+    path = os.environ.get(LIB_VAR)
+    if path:
+        return None if path.lower() == 'none' else path
+
+    # This file is in $prefix/lib/pythonX.Y/site-packages/cram when installed.
+    lib_dir = os.path.realpath(os.path.join(
+        os.path.dirname(__file__), '..', '..', '..'))
+    for name in _lib_names:
+        path = os.path.join(lib_dir, name)
+        if os.path.isfile(path):
+            return path
+    return None
+
+
+def load():
+    """Load libcramfile and return it, or return None if it's unavailable."""
+    global _lib
+    if _lib is not False:
+        return _lib
+
+    _lib = None
+    path = _find_lib()
+    if path:
+        try:
+            lib = ctypes.CDLL(path)
+        except OSError:
+            return None
+
+        c_int_p = ctypes.POINTER(ctypes.c_int)
+        lib.cram_reader_open.argtypes = [ctypes.c_char_p]
+        lib.cram_reader_open.restype = ctypes.c_void_p
+        lib.cram_reader_header.argtypes = [ctypes.c_void_p, c_int_p]
+        lib.cram_reader_header.restype = None
+        lib.cram_reader_next.argtypes = [
+            ctypes.c_void_p, c_int_p, ctypes.POINTER(ctypes.c_size_t)]
+        lib.cram_reader_next.restype = ctypes.c_void_p
+        lib.cram_reader_skip.argtypes = [ctypes.c_void_p, ctypes.c_int, c_int_p]
+        lib.cram_reader_skip.restype = ctypes.c_int
+        lib.cram_reader_close.argtypes = [ctypes.c_void_p]
+        lib.cram_reader_close.restype = None
+        _lib = lib
+    return _lib
+
+
+def available():
+    """True if libcramfile can be loaded."""
+    return load() is not None
+
+
+class Reader(object):
+    """Reads job records from a cram file using libcramfile.
+
+       Records are returned as (num_procs, working_dir, args, missing,
+       changed) tuples, where missing and changed are the job's
+       environment differences from the base, as returned by
+       cramfile.compress().  Applying them is left to the caller, since
+       copying a dict is much faster than building one from strings.
+    """
+    def __init__(self, filename):
+        self._lib = load()
+        if not self._lib:
+            raise IOError("libcramfile is not available.")
+
+        self._reader = self._lib.cram_reader_open(filename)
+        if not self._reader:
+            raise IOError("Couldn't read cram file: %s" % filename)
+
+        header = (ctypes.c_int * 5)()
+        self._lib.cram_reader_header(self._reader, header)
+        self.num_jobs, self.num_procs, self.version, self.max_job_size = header[:4]
+        self.has_base_record = bool(header[4])
+
+        self._counts = (ctypes.c_int * 4)()
+        self._size = ctypes.c_size_t()
+        self._size_ref = ctypes.byref(self._size)
+
+
+    def next_record(self):
+        """Decode the next job record in the file."""
+        strings = self._lib.cram_reader_next(
+            self._reader, self._counts, self._size_ref)
+        if not strings:
+            raise IOError("Error reading job from cram file.")
+
+        strings = ctypes.string_at(strings, self._size.value).split('\0')
+        num_procs, num_args, num_missing, num_changed = self._counts
+        missing_start = 1 + num_args
+        changed_start = missing_start + num_missing
+        changed_end = changed_start + 2 * num_changed
+        changed = dict(izip(strings[changed_start : changed_end : 2],
+                            strings[changed_start + 1 : changed_end : 2]))
+        return (num_procs, strings[0], strings[1 : missing_start],
+                strings[missing_start : changed_start], changed)
+
+
+    def skip(self, count):
+        """Skip count jobs without decoding them."""
+        skipped = self._lib.cram_reader_skip(self._reader, count, None)
+        if skipped != count:
+            raise IOError("Error skipping jobs in cram file.")
+
+
+    def job_procs(self):
+        """Iterate over the number of processes in each remaining job,
+           without decoding the jobs."""
+        procs = (ctypes.c_int * _scan_chunk_size)()
+        while True:
+            skipped = self._lib.cram_reader_skip(
+                self._reader, _scan_chunk_size, procs)
+            for num_procs in procs[:skipped]:
+                yield num_procs
+            if skipped < _scan_chunk_size:
+                break
+
+
+    def close(self):
+        """Close the file and free the reader."""
+        if self._reader:
+            self._lib.cram_reader_close(self._reader)
+            self._reader = None
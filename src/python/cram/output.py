@@ -0,0 +1,103 @@
+##############################################################################
+# Copyright (c) 2014, Lawrence Livermore National Security, LLC.
+# Produced at the Lawrence Livermore National Laboratory.
+#
+# This file is part of Cram.
+# Written by Todd Gamblin, tgamblin@llnl.gov, All rights reserved.
+# LLNL-CODE-661100
+#
+# For details, see https://github.com/scalability-llnl/cram.
+# Please also see the LICENSE file for our notice and the LGPL.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License (as published by
+# the Free Software Foundation) version 2.1 dated February 1999.
+#
+# This program is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the IMPLIED WARRANTY OF
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the terms and
+# conditions of the GNU General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public License
+# along with this program; if not, write to the Free Software Foundation,
+# Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+##############################################################################
+"""
+Names of the output files that libcram opens for each job.  These must
+match the names that cram.w uses.
+
+Jobs' output files go in their working directories.  In the sharded
+layout (CRAM_OUTPUT_LAYOUT=SHARDED), they go in subdirectories of a
+cram-out directory there instead, one per range of CRAM_OUTPUT_SHARD_SIZE
+job ids, e.g. cram-out/0012/cram.12345.out for job 12345, so that
+millions of files aren't created in one directory.
+"""
+import os
+import re
+
+# Output modes, as for the CRAM_OUTPUT environment variable.
+output_modes = ('none', 'rank0', 'all', 'system')
+
+# Output layouts, as for the CRAM_OUTPUT_LAYOUT environment variable.
+output_layouts = ('flat', 'sharded')
+
+# Directory in each job's working directory for sharded output.
+shard_root = 'cram-out'
+
+# Default number of jobs whose output files share a shard directory.
+default_shard_size = 1000
+
+
+def get_output_mode(mode=None):
+    """Output mode to use: mode if it is given, otherwise CRAM_OUTPUT.
+       Like libcram, uses rank0 if neither is a valid mode."""
+    mode = (mode or os.environ.get('CRAM_OUTPUT', '')).lower()
+    return mode if mode in output_modes else 'rank0'
+
+
+def atoi(value):
+    """Leading integer in a string, or 0 if there isn't one, like C's atoi."""
+    match = re.match(r'\s*([-+]?\d+)', value)
+    return int(match.group(1)) if match else 0
+
+
+def get_shard_size(layout=None, shard_size=None):
+    """Number of jobs per output directory, or 0 for the flat layout.
+       The layout and shard size default to CRAM_OUTPUT_LAYOUT and
+       CRAM_OUTPUT_SHARD_SIZE, which are parsed as in libcram."""
+    layout = (layout or os.environ.get('CRAM_OUTPUT_LAYOUT', '')).lower()
+    if layout != 'sharded':
+        return 0
+
+    if shard_size is None:
+        shard_size = atoi(os.environ.get('CRAM_OUTPUT_SHARD_SIZE', ''))
+    return shard_size if shard_size > 0 else default_shard_size
+
+
+def output_dir(job_id, shard_size):
+    """Directory for a job's output files, relative to its working
+       directory.  Empty for the flat layout."""
+    if not shard_size:
+        return ''
+    return os.path.join(shard_root, '%04d' % (job_id // shard_size))
+
+
+def output_files(job_id, num_procs, mode, shard_size=0):
+    """Paths of the output files libcram opens for a job in an output
+       mode, relative to the job's working directory."""
+    if mode == 'rank0':
+        names = ['cram.%d.out' % job_id, 'cram.%d.err' % job_id]
+    elif mode == 'all':
+        names = ['cram.%d.%d.%s' % (job_id, rank, ext)
+                 for rank in xrange(num_procs) for ext in ('out', 'err')]
+    else:
+        names = []
+
+    directory = output_dir(job_id, shard_size)
+    return [os.path.join(directory, name) for name in names]
+
+
+def job_output_paths(job, job_id, mode, shard_size=0):
+    """Full paths of the output files libcram opens for a job."""
+    return [os.path.join(job.working_dir, name)
+            for name in output_files(job_id, job.num_procs, mode, shard_size)]
@@ -58,15 +58,53 @@ def read_int(stream, fmt=_default_int_format):
     return struct.unpack(fmt, packed)[0]
 
 
-def write_string(stream, string):
+def write_varint(stream, integer):
+    """Write an unsigned integer in as few bytes as possible.  Each byte
+       holds 7 bits, low bits first, and all but the last byte have their
+       high bit set (LEB128)."""
+    if integer < 0:
+        raise ValueError("Cannot write negative varint: %d" % integer)
+    packed = bytearray()
+    while integer >= 0x80:
+        packed.append((integer & 0x7f) | 0x80)
+        integer >>= 7
+    packed.append(integer)
+    stream.write(str(packed))
+    return len(packed)
+
+
+def varint_size(integer):
+    """Number of bytes write_varint uses for integer."""
+    size = 1
+    while integer >= 0x80:
+        integer >>= 7
+        size += 1
+    return size
+
+
+def read_varint(stream):
+    integer = 0
+    shift = 0
+    while True:
+        byte = stream.read(1)
+        if not byte:
+            raise IOError("Premature end of file")
+        byte = ord(byte)
+        integer |= (byte & 0x7f) << shift
+        if byte < 0x80:
+            return integer
+        shift += 7
+
+
+def write_string(stream, string, write_len=write_int):
     length = len(string)
-    int_len = write_int(stream, length)
+    int_len = write_len(stream, length)
     stream.write(string)
     return len(string) + int_len
 
 
-def read_string(stream):
-    length = read_int(stream)
+def read_string(stream, read_len=read_int):
+    length = read_len(stream)
     string = stream.read(length)
     if len(string) < length:
         raise IOError("Premature end of file")
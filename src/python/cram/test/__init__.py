@@ -32,7 +32,10 @@ _test_module = 'cram.test'
 
 # Names of tests to be included in the test suite
 _test_names = ['serialization',
-               'cramfile']
+               'cramfile',
+               'stage',
+               'output',
+               'watch']
 
 
 def list_tests():
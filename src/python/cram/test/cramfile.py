@@ -29,6 +29,7 @@ import random
 from contextlib import contextmanager, closing
 
 import cram.cramfile as cramfile
+import cram.native as native
 from cram.cramfile import CramFile, Job
 
 many_jobs = 4096
@@ -40,6 +41,17 @@ def tempfile():
     os.unlink(tmp)
 
 
+@contextmanager
+def pure_python():
+    """Make CramFiles read with pure Python, even if libcramfile loads."""
+    saved_lib = native._lib
+    native._lib = None
+    try:
+        yield
+    finally:
+        native._lib = saved_lib
+
+
 def random_jobs(num_jobs):
     """Generate num_jobs random jobs.  The jobs' environments and command
        line arguments will differ slightly"""
@@ -142,3 +154,334 @@ class CramFileTest(unittest.TestCase):
                 self.assertEqual(many_jobs, cf.num_jobs)
                 self.assertEqual(total_procs, cf.num_procs)
                 self.assertListEqual(jobs, [j for j in cf])
+
+
+    def test_versions(self):
+        """Test that version 2 and version 3 files can be written, appended
+           to, and read back, and that version 3 files are smaller."""
+        jobs = random_jobs(64)
+        sizes = {}
+
+        for version in (2, 3):
+            with tempfile() as tmp:
+                with closing(CramFile(tmp, 'w', version)) as cf:
+                    for job in jobs[:32]:
+                        cf.pack(job)
+
+                # Appending keeps the file's version.
+                with closing(CramFile(tmp, 'a')) as cf:
+                    self.assertEqual(version, cf.version)
+                    for job in jobs[32:]:
+                        cf.pack(job)
+
+                with closing(CramFile(tmp, 'r')) as cf:
+                    self.assertEqual(version, cf.version)
+                    self.assertEqual(len(jobs), cf.num_jobs)
+                    self.assertListEqual(jobs, [j for j in cf])
+
+                sizes[version] = os.path.getsize(tmp)
+
+        self.assertLess(sizes[3], sizes[2])
+
+
+    def test_choose_base_env(self):
+        """Test that the base keeps common values and drops rare keys."""
+        envs = [{ 'COMMON' : 'x' * 20, 'RARE' : 'r', 'I' : str(i) }
+                for i in range(10)]
+        envs[0] = { 'ODD' : 'y' * 20 }
+        for env in envs[1:5]:
+            del env['RARE']
+
+        base = cramfile.choose_base_env(envs)
+        self.assertEqual('x' * 20, base['COMMON'])
+        self.assertEqual('r', base['RARE'])
+        self.assertNotIn('ODD', base)
+        self.assertNotIn('I', base)
+
+
+    def test_base_record(self):
+        """Test that a base record isn't read as a job, that jobs are
+           compressed against it, and that appending uses it."""
+        jobs = random_jobs(32)
+        base = cramfile.choose_base_env(job.env for job in jobs)
+
+        with tempfile() as tmp:
+            with closing(CramFile(tmp, 'w')) as cf:
+                cf.pack_base(base)
+                for job in jobs[:16]:
+                    cf.pack(job)
+
+            with closing(CramFile(tmp, 'a')) as cf:
+                self.assertTrue(cf.has_base_record)
+                for job in jobs[16:]:
+                    cf.pack(job)
+
+            with closing(CramFile(tmp, 'r')) as cf:
+                self.assertTrue(cf.has_base_record)
+                self.assertEqual(base, cf.base.env)
+                self.assertEqual(len(jobs), cf.num_jobs)
+                self.assertEqual(sum(j.num_procs for j in jobs), cf.num_procs)
+                self.assertListEqual(jobs, [j for j in cf])
+
+            # Base records can't be written to version 2 files.
+            with closing(CramFile(tmp, 'w', 2)) as cf:
+                self.assertRaises(ValueError, cf.pack_base, base)
+
+
+    def test_string_prefixes(self):
+        """Test that strings split into prefixes at delimiters."""
+        self.assertListEqual(
+            ['/path/to/run-12', '/path/to/run-', '/path/to/', '/path/', '/'],
+            list(cramfile.string_prefixes('/path/to/run-12')))
+        self.assertListEqual(['foo'], list(cramfile.string_prefixes('foo')))
+        self.assertListEqual(['foo/'], list(cramfile.string_prefixes('foo/')))
+
+
+    def test_choose_strings(self):
+        """Test that the string table keeps common strings and the longest
+           shared prefixes, and drops strings no job would use."""
+        strings = ['/path/to/run-%d' % i for i in range(100)]
+        strings += ['-n', '--input=deck.%d' % 7] * 50
+        strings += ['unique-string']
+        table = cramfile.choose_strings(strings)
+
+        self.assertListEqual(['--input=deck.7', '-n', '/path/to/run-'], table)
+        self.assertListEqual(['-n'], cramfile.choose_strings(strings, max_size=8))
+
+
+    def test_string_table(self):
+        """Test that version 4 files with a string table can be written,
+           appended to, and read back, and that the table shrinks them."""
+        jobs = random_jobs(64)
+        table = cramfile.choose_strings(
+            s for job in jobs for s in [job.working_dir] + job.args)
+        self.assertTrue(table)
+        sizes = {}
+
+        for version in (3, 4):
+            with tempfile() as tmp:
+                with closing(CramFile(tmp, 'w', version)) as cf:
+                    if version == 4:
+                        cf.pack_strings(table)
+                    else:
+                        self.assertRaises(ValueError, cf.pack_strings, table)
+                    for job in jobs[:32]:
+                        cf.pack(job)
+                    if version == 4:
+                        self.assertRaises(IOError, cf.pack_strings, table)
+
+                with closing(CramFile(tmp, 'a')) as cf:
+                    self.assertListEqual(table if version == 4 else [], cf.strings)
+                    for job in jobs[32:]:
+                        cf.pack(job)
+
+                with closing(CramFile(tmp, 'r')) as cf:
+                    self.assertListEqual(jobs, [j for j in cf])
+                    self.assertEqual(jobs[40], cf[40])
+                    sizes[version] = (os.path.getsize(tmp), cf.max_job_size)
+
+        self.assertLess(sizes[4][0], sizes[3][0])
+        self.assertLess(sizes[4][1], sizes[3][1])
+
+
+    def test_time_limit(self):
+        """Test that time limits are packed with jobs and read back."""
+        env = { 'foo' : 'bar' }
+
+        with tempfile() as tmp:
+            with closing(CramFile(tmp, 'w')) as cf:
+                cf.pack(Job(4, '/foo', ['a'], env, time_limit=60))
+                cf.pack(2, '/bar', ['b'], env)
+                cf.pack(2, '/baz', ['c'], env, time_limit=5)
+
+            with closing(CramFile(tmp, 'r')) as cf:
+                jobs = [j for j in cf]
+                self.assertEqual(60,   jobs[0].time_limit)
+                self.assertEqual(None, jobs[1].time_limit)
+                self.assertEqual(5,    jobs[2].time_limit)
+                self.assertEqual('bar', jobs[2].env['foo'])
+
+
+    def test_threads(self):
+        """Test that threads per process are packed with jobs and read back."""
+        env = { 'foo' : 'bar' }
+
+        with tempfile() as tmp:
+            with closing(CramFile(tmp, 'w')) as cf:
+                cf.pack(Job(4, '/foo', ['a'], env, threads=8))
+                cf.pack(2, '/bar', ['b'], env)
+                cf.pack(2, '/baz', ['c'], env, time_limit=5, threads=2)
+
+            with closing(CramFile(tmp, 'r')) as cf:
+                jobs = [j for j in cf]
+                self.assertEqual(8,    jobs[0].threads)
+                self.assertEqual('8',  jobs[0].env['OMP_NUM_THREADS'])
+                self.assertEqual(None, jobs[1].threads)
+                self.assertEqual(2,    jobs[2].threads)
+                self.assertEqual(5,    jobs[2].time_limit)
+                self.assertNotIn('CRAM_THREADS_PER_RANK', env)
+
+                # Only version 5 headers have flags.
+                self.assertEqual(0, cf.flags)
+
+
+    def test_header_flags(self):
+        """Test that version 5 files flag jobs with threads per process,
+           and that the flag survives appending."""
+        env = { 'foo' : 'bar' }
+
+        with tempfile() as tmp:
+            with closing(CramFile(tmp, 'w', 5)) as cf:
+                cf.pack(2, '/foo', ['a'], env)
+            with closing(CramFile(tmp, 'r')) as cf:
+                self.assertEqual(5, cf.version)
+                self.assertEqual(0, cf.flags)
+
+            with closing(CramFile(tmp, 'a')) as cf:
+                cf.pack(2, '/bar', ['b'], env, threads=4)
+            with closing(CramFile(tmp, 'a')) as cf:
+                cf.pack(2, '/baz', ['c'], env)
+
+            with closing(CramFile(tmp, 'r')) as cf:
+                self.assertEqual(cramfile.FLAG_THREADS, cf.flags)
+                jobs = [j for j in cf]
+                self.assertEqual(3, len(jobs))
+                self.assertEqual(4, jobs[1].threads)
+                self.assertEqual('/baz', jobs[2].working_dir)
+
+
+    def test_filter_env(self):
+        """Test include and exclude patterns and environment profiles."""
+        env = { 'PATH' : '/bin', 'LS_COLORS' : 'x' * 100, 'PS1' : '$ ',
+                'LMOD_CMD' : 'lmod', 'OMP_NUM_THREADS' : '4', 'HOME' : '/home' }
+
+        self.assertEqual(env, cramfile.filter_env(env))
+        self.assertEqual({ 'PATH' : '/bin', 'OMP_NUM_THREADS' : '4', 'HOME' : '/home' },
+                         cramfile.filter_env(env, profile='minimal'))
+        self.assertEqual({ 'PATH' : '/bin', 'OMP_NUM_THREADS' : '4' },
+                         cramfile.filter_env(env, exclude=['HOME'], profile='minimal'))
+        self.assertEqual({ 'OMP_NUM_THREADS' : '4', 'LMOD_CMD' : 'lmod' },
+                         cramfile.filter_env(env, include=['OMP_*', 'LMOD_*']))
+        self.assertEqual({ 'OMP_NUM_THREADS' : '4' },
+                         cramfile.filter_env(env, include=['OMP_*', 'LMOD_*'],
+                                             profile='minimal'))
+        self.assertRaises(ValueError, cramfile.filter_env, env, profile='nope')
+
+
+    def test_env_records(self):
+        """Test that records' stored environments decompress to the jobs'
+           environments, with or without a base record."""
+        jobs = random_jobs(64)
+
+        with tempfile() as tmp:
+            for base in (None, cramfile.choose_base_env(j.env for j in jobs)):
+                with closing(CramFile(tmp, 'w')) as cf:
+                    if base:
+                        cf.pack_base(base)
+                    for job in jobs:
+                        cf.pack(job)
+
+                with closing(CramFile(tmp, 'r')) as cf:
+                    records = list(cf.env_records())
+                with pure_python():
+                    with closing(CramFile(tmp, 'r')) as cf:
+                        self.assertEqual(records, list(cf.env_records()))
+
+                self.assertEqual(len(jobs) + (1 if base else 0), len(records))
+                missing, base_env = records[0]
+                self.assertEqual([], missing)
+                job_records = records[1:] if base else records
+                for job, (missing, changed) in zip(jobs, job_records):
+                    self.assertEqual(job.env,
+                                     cramfile.decompress(base_env, missing, changed))
+
+
+    def test_job_stream(self):
+        """Test that a job stream has the same records as a regular file,
+           with a stream header and an end marker, and that it can't be
+           read back."""
+        jobs = random_jobs(16)
+        base = cramfile.choose_base_env(job.env for job in jobs)
+
+        with tempfile() as tmp:
+            for version in (3, 4):
+                contents = {}
+                for stream in (False, True):
+                    with closing(CramFile(tmp, 'w', version, stream)) as cf:
+                        cf.pack_base(base)
+                        for job in jobs:
+                            cf.pack(job)
+                    with open(tmp, 'rb') as f:
+                        contents[stream] = f.read()
+                    if stream:
+                        self.assertRaises(IOError, CramFile, tmp, 'r')
+
+                # Only the counts in the header and the end marker differ.
+                regular, stream = contents[False], contents[True]
+                self.assertEqual(regular[:8], stream[:8])
+                self.assertEqual('\xff' * 8 + '\0' * 16, stream[8:32])
+                self.assertEqual(regular[32:], stream[32:-1])
+                self.assertEqual('\0', stream[-1])
+
+            # Streams need varint record sizes, and can't be appended to.
+            self.assertRaises(ValueError, CramFile, tmp, 'w', 2, True)
+            self.assertRaises(ValueError, CramFile, tmp, 'a', 3, True)
+
+
+    def test_indexing(self):
+        """Test that jobs can be read by index and that job sizes can be
+           scanned, with or without a base record."""
+        jobs = random_jobs(64)
+
+        with tempfile() as tmp:
+            for base in (None, cramfile.choose_base_env(j.env for j in jobs)):
+                with closing(CramFile(tmp, 'w')) as cf:
+                    if base:
+                        cf.pack_base(base)
+                    for job in jobs:
+                        cf.pack(job)
+
+                with closing(CramFile(tmp, 'r')) as cf:
+                    for i in (0, 1, 17, 63, -1, -64):
+                        self.assertEqual(jobs[i], cf[i])
+                    self.assertRaises(IndexError, cf.__getitem__, 64)
+                    self.assertRaises(IndexError, cf.__getitem__, -65)
+
+                    # Indexing doesn't disturb iteration.
+                    read_jobs = []
+                    for i, job in enumerate(cf):
+                        read_jobs.append(job)
+                        self.assertEqual(jobs[i // 2], cf[i // 2])
+                    self.assertListEqual(jobs, read_jobs)
+
+                    self.assertListEqual([j.num_procs for j in jobs],
+                                         list(cf.job_procs()))
+
+
+    @unittest.skipIf(not native.available(), "libcramfile is not available")
+    def test_native_reader(self):
+        """Test that libcramfile and pure Python read the same jobs."""
+        jobs = random_jobs(256)
+
+        with tempfile() as tmp:
+            for version in (2, 3):
+                with closing(CramFile(tmp, 'w', version)) as cf:
+                    if version == 3:
+                        cf.pack_base(cramfile.choose_base_env(
+                            j.env for j in jobs[::2]))
+                    for job in jobs:
+                        cf.pack(job)
+
+                with closing(CramFile(tmp, 'r')) as cf:
+                    native_jobs = list(cf)
+                    native_procs = list(cf.job_procs())
+                    native_job = cf[200]
+
+                with pure_python():
+                    with closing(CramFile(tmp, 'r')) as cf:
+                        self.assertListEqual(list(cf), native_jobs)
+                    with closing(CramFile(tmp, 'r')) as cf:
+                        self.assertListEqual(list(cf.job_procs()), native_procs)
+                        self.assertEqual(cf[200], native_job)
+
+                self.assertListEqual(jobs, native_jobs)
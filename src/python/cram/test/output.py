@@ -0,0 +1,125 @@
+##############################################################################
+# Copyright (c) 2014, Lawrence Livermore National Security, LLC.
+# Produced at the Lawrence Livermore National Laboratory.
+#
+# This file is part of Cram.
+# Written by Todd Gamblin, tgamblin@llnl.gov, All rights reserved.
+# LLNL-CODE-661100
+#
+# For details, see https://github.com/scalability-llnl/cram.
+# Please also see the LICENSE file for our notice and the LGPL.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License (as published by
+# the Free Software Foundation) version 2.1 dated February 1999.
+#
+# This program is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the IMPLIED WARRANTY OF
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the terms and
+# conditions of the GNU General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public License
+# along with this program; if not, write to the Free Software Foundation,
+# Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+##############################################################################
+import unittest
+
+from cram.cramfile import Job
+from cram.output import *
+from cram.test.stage import output_environment
+
+
+class OutputTest(unittest.TestCase):
+
+    def test_output_mode(self):
+        with output_environment():
+            self.assertEqual('rank0', get_output_mode())
+            self.assertEqual('all', get_output_mode('all'))
+
+        with output_environment(CRAM_OUTPUT='ALL'):
+            self.assertEqual('all', get_output_mode())
+            self.assertEqual('none', get_output_mode('none'))
+
+        # Like libcram, invalid modes mean rank0.
+        with output_environment(CRAM_OUTPUT='bogus'):
+            self.assertEqual('rank0', get_output_mode())
+
+
+    def test_shard_size(self):
+        with output_environment():
+            self.assertEqual(0, get_shard_size())
+            self.assertEqual(0, get_shard_size('flat', 10))
+            self.assertEqual(default_shard_size, get_shard_size('sharded'))
+            self.assertEqual(10, get_shard_size('sharded', 10))
+            self.assertEqual(default_shard_size, get_shard_size('sharded', 0))
+
+        with output_environment(CRAM_OUTPUT_LAYOUT='SHARDED'):
+            self.assertEqual(default_shard_size, get_shard_size())
+            self.assertEqual(0, get_shard_size('flat'))
+
+        with output_environment(CRAM_OUTPUT_LAYOUT='bogus',
+                                CRAM_OUTPUT_SHARD_SIZE='10'):
+            self.assertEqual(0, get_shard_size())
+
+
+    def test_shard_size_parsing(self):
+        """CRAM_OUTPUT_SHARD_SIZE is parsed with atoi() in libcram, and
+           values that aren't positive mean the default."""
+        expected = { '10'   : 10,
+                     ' 7'   : 7,
+                     '12abc': 12,
+                     '0'    : default_shard_size,
+                     '-5'   : default_shard_size,
+                     'abc'  : default_shard_size,
+                     ''     : default_shard_size }
+        for value, size in expected.items():
+            with output_environment(CRAM_OUTPUT_LAYOUT='sharded',
+                                    CRAM_OUTPUT_SHARD_SIZE=value):
+                self.assertEqual(size, get_shard_size())
+                self.assertEqual(3, get_shard_size(shard_size=3))
+
+
+    def test_output_dir(self):
+        """Shard directories must match cram.w: cram-out/%04d, numbered by
+           job_id / shard_size."""
+        self.assertEqual('', output_dir(12345, 0))
+
+        expected = { 0        : 'cram-out/0000',
+                     999      : 'cram-out/0000',
+                     1000     : 'cram-out/0001',
+                     1999     : 'cram-out/0001',
+                     12345    : 'cram-out/0012',
+                     9999999  : 'cram-out/9999',
+                     10000000 : 'cram-out/10000' }
+        for job_id, directory in expected.items():
+            self.assertEqual(directory, output_dir(job_id, 1000))
+
+        self.assertEqual('cram-out/0000', output_dir(4, 5))
+        self.assertEqual('cram-out/0001', output_dir(5, 5))
+        self.assertEqual('cram-out/0007', output_dir(7, 1))
+
+
+    def test_output_files(self):
+        self.assertEqual(['cram.7.out', 'cram.7.err'],
+                         output_files(7, 3, 'rank0'))
+        self.assertEqual(['cram.7.0.out', 'cram.7.0.err',
+                          'cram.7.1.out', 'cram.7.1.err',
+                          'cram.7.2.out', 'cram.7.2.err'],
+                         output_files(7, 3, 'all'))
+        self.assertEqual([], output_files(7, 3, 'none'))
+        self.assertEqual([], output_files(7, 3, 'system'))
+
+        self.assertEqual(['cram-out/0001/cram.7.out', 'cram-out/0001/cram.7.err'],
+                         output_files(7, 3, 'rank0', 5))
+        self.assertEqual(['cram-out/0001/cram.7.0.out', 'cram-out/0001/cram.7.0.err'],
+                         output_files(7, 1, 'all', 5))
+        self.assertEqual([], output_files(7, 3, 'none', 5))
+
+
+    def test_job_output_paths(self):
+        job = Job(2, '/p/run', ['foo'], {})
+        self.assertEqual(['/p/run/cram.3.out', '/p/run/cram.3.err'],
+                         job_output_paths(job, 3, 'rank0'))
+        self.assertEqual(['/p/run/cram-out/0000/cram.3.1.out',
+                          '/p/run/cram-out/0000/cram.3.1.err'],
+                         job_output_paths(job, 3, 'all', 1000)[2:])
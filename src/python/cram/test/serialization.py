@@ -56,6 +56,25 @@ class SerializationTest(unittest.TestCase):
                 i **= 2
 
 
+    def test_varints(self):
+        """Test writing and reading varints, and that small values are
+           written in one byte."""
+        values = [0, 1, 127, 128, 255, 300, 16383, 16384,
+                  2**32 - 1, 2**32, 2**63, 2**64 - 1]
+
+        stream = StringIO()
+        self.assertEqual(write_varint(stream, 127), 1)
+        self.assertEqual(write_varint(stream, 128), 2)
+        for v in values:
+            write_varint(stream, v)
+
+        stream = StringIO(stream.getvalue())
+        self.assertEqual(read_varint(stream), 127)
+        self.assertEqual(read_varint(stream), 128)
+        for v in values:
+            self.assertEqual(read_varint(stream), v)
+
+
     def test_strings(self):
         """Test writing and reading strings from a stream."""
         # Make 100 random strings of widely varying length
@@ -75,3 +94,16 @@ class SerializationTest(unittest.TestCase):
 
         for s in strings:
             self.assertEqual(read_string(stream), s)
+
+
+    def test_varint_strings(self):
+        """Test writing and reading strings with varint lengths."""
+        strings = ['', 'a', 'x' * 127, 'y' * 128, 'z' * 70000]
+
+        stream = StringIO()
+        for s in strings:
+            write_string(stream, s, write_varint)
+
+        stream = StringIO(stream.getvalue())
+        for s in strings:
+            self.assertEqual(read_string(stream, read_varint), s)
@@ -0,0 +1,176 @@
+##############################################################################
+# Copyright (c) 2014, Lawrence Livermore National Security, LLC.
+# Produced at the Lawrence Livermore National Laboratory.
+#
+# This file is part of Cram.
+# Written by Todd Gamblin, tgamblin@llnl.gov, All rights reserved.
+# LLNL-CODE-661100
+#
+# For details, see https://github.com/scalability-llnl/cram.
+# Please also see the LICENSE file for our notice and the LGPL.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License (as published by
+# the Free Software Foundation) version 2.1 dated February 1999.
+#
+# This program is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the IMPLIED WARRANTY OF
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the terms and
+# conditions of the GNU General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public License
+# along with this program; if not, write to the Free Software Foundation,
+# Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+##############################################################################
+import os
+import sys
+import shutil
+import unittest
+from StringIO import StringIO
+from tempfile import mkdtemp
+from contextlib import contextmanager, closing
+
+import cram.cmd
+from cram.cramfile import CramFile, Job
+
+stage = cram.cmd.get_module('stage')
+
+output_vars = ('CRAM_OUTPUT', 'CRAM_OUTPUT_LAYOUT', 'CRAM_OUTPUT_SHARD_SIZE')
+
+
+@contextmanager
+def output_environment(**values):
+    """Set the output variables in values, and unset the rest."""
+    saved = dict((var, os.environ.get(var)) for var in output_vars)
+    for var in output_vars:
+        os.environ.pop(var, None)
+    os.environ.update(values)
+    try:
+        yield
+    finally:
+        for var, value in saved.items():
+            if value is None:
+                os.environ.pop(var, None)
+            else:
+                os.environ[var] = value
+
+
+def stage_jobs(*args, **kwargs):
+    """Stage without printing progress."""
+    saved_stdout = sys.stdout
+    sys.stdout = StringIO()
+    try:
+        stage.stage_jobs(*args, **kwargs)
+    finally:
+        sys.stdout = saved_stdout
+
+
+class StageTest(unittest.TestCase):
+
+    def setUp(self):
+        """Pack a 2-process job in a/ and a 3-process job in b/."""
+        self.dir = mkdtemp(prefix='cram-stage-test-')
+        self.cramfile = os.path.join(self.dir, 'stage.cram')
+        with closing(CramFile(self.cramfile, 'w')) as cf:
+            cf.pack(Job(2, os.path.join(self.dir, 'a'), ['foo'], {'A' : '1'}))
+            cf.pack(Job(3, os.path.join(self.dir, 'b'), ['bar'], {'B' : '2'}))
+
+
+    def tearDown(self):
+        shutil.rmtree(self.dir)
+
+
+    def created(self):
+        """Paths created in the test directory, besides the cram file."""
+        paths = set()
+        for root, dirs, files in os.walk(self.dir):
+            for name in dirs + files:
+                paths.add(os.path.relpath(os.path.join(root, name), self.dir))
+        paths.discard('stage.cram')
+        return paths
+
+
+    def check_stage(self, mode, expected_files):
+        with output_environment():
+            stage_jobs(self.cramfile, mode, threads=2)
+        self.assertEqual(set(['a', 'b']) | set(expected_files), self.created())
+
+
+    def test_rank0(self):
+        self.check_stage('rank0', ['a/cram.0.out', 'a/cram.0.err',
+                                   'b/cram.1.out', 'b/cram.1.err'])
+
+
+    def test_all(self):
+        self.check_stage('all', ['a/cram.0.0.out', 'a/cram.0.0.err',
+                                 'a/cram.0.1.out', 'a/cram.0.1.err',
+                                 'b/cram.1.0.out', 'b/cram.1.0.err',
+                                 'b/cram.1.1.out', 'b/cram.1.1.err',
+                                 'b/cram.1.2.out', 'b/cram.1.2.err'])
+
+
+    def test_no_files(self):
+        self.check_stage('none', [])
+        shutil.rmtree(os.path.join(self.dir, 'a'))
+        shutil.rmtree(os.path.join(self.dir, 'b'))
+        self.check_stage('system', [])
+
+
+    def test_truncates(self):
+        """Staging empties output files left from an earlier run."""
+        os.mkdir(os.path.join(self.dir, 'a'))
+        old_output = os.path.join(self.dir, 'a', 'cram.0.out')
+        with open(old_output, 'w') as f:
+            f.write('old output\n')
+
+        self.check_stage('rank0', ['a/cram.0.out', 'a/cram.0.err',
+                                   'b/cram.1.out', 'b/cram.1.err'])
+        self.assertEqual(0, os.path.getsize(old_output))
+
+
+    def test_sharded(self):
+        """With one job per shard, each job's files get their own directory."""
+        with output_environment():
+            stage_jobs(self.cramfile, 'rank0', 'sharded', 1, threads=2)
+        self.assertEqual(set(['a', 'a/cram-out', 'a/cram-out/0000',
+                              'a/cram-out/0000/cram.0.out',
+                              'a/cram-out/0000/cram.0.err',
+                              'b', 'b/cram-out', 'b/cram-out/0001',
+                              'b/cram-out/0001/cram.1.out',
+                              'b/cram-out/0001/cram.1.err']),
+                         self.created())
+
+
+    def test_sharded_from_environment(self):
+        """Without files to write, no shard directories are made."""
+        with output_environment(CRAM_OUTPUT='none', CRAM_OUTPUT_LAYOUT='sharded'):
+            stage_jobs(self.cramfile, threads=2)
+        self.assertEqual(set(['a', 'b']), self.created())
+
+        with output_environment(CRAM_OUTPUT_LAYOUT='sharded',
+                                CRAM_OUTPUT_SHARD_SIZE='2'):
+            stage_jobs(self.cramfile, threads=2)
+        self.assertTrue('b/cram-out/0000/cram.1.out' in self.created())
+
+
+    def test_mode_from_environment(self):
+        """Without a mode, CRAM_OUTPUT is used, and rank0 if it's unset or
+           not a valid mode."""
+        with output_environment(CRAM_OUTPUT='NONE'):
+            stage_jobs(self.cramfile, threads=2)
+        self.assertEqual(set(['a', 'b']), self.created())
+
+        with output_environment(CRAM_OUTPUT='bogus'):
+            stage_jobs(self.cramfile, threads=2)
+        self.assertTrue('a/cram.0.out' in self.created())
+        self.assertFalse('a/cram.0.0.out' in self.created())
+
+        shutil.rmtree(os.path.join(self.dir, 'a'))
+        with output_environment():
+            stage_jobs(self.cramfile, threads=2)
+        self.assertTrue('a/cram.0.out' in self.created())
+
+        # An explicit mode wins over the environment.
+        with output_environment(CRAM_OUTPUT='none'):
+            stage_jobs(self.cramfile, 'all', threads=2)
+        self.assertTrue('a/cram.0.1.out' in self.created())
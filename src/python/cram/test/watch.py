@@ -0,0 +1,133 @@
+##############################################################################
+# Copyright (c) 2014, Lawrence Livermore National Security, LLC.
+# Produced at the Lawrence Livermore National Laboratory.
+#
+# This file is part of Cram.
+# Written by Todd Gamblin, tgamblin@llnl.gov, All rights reserved.
+# LLNL-CODE-661100
+#
+# For details, see https://github.com/scalability-llnl/cram.
+# Please also see the LICENSE file for our notice and the LGPL.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License (as published by
+# the Free Software Foundation) version 2.1 dated February 1999.
+#
+# This program is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the IMPLIED WARRANTY OF
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the terms and
+# conditions of the GNU General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public License
+# along with this program; if not, write to the Free Software Foundation,
+# Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+##############################################################################
+import os
+import sys
+import shutil
+import unittest
+from StringIO import StringIO
+from tempfile import mkdtemp
+from contextlib import closing
+
+import cram.cmd
+
+watch = cram.cmd.get_module('watch')
+
+# A progress file as libcram writes it.
+progress_text = """\
+elapsed: 42
+jobs: 8
+pending: 1
+running: 2
+finished: 3
+failed: 1
+timed_out: 1
+min_duration: 1.500
+mean_duration: 2.250
+max_duration: 3.000
+done: %d
+"""
+
+
+class Args(object):
+    def __init__(self, progress_file):
+        self.progress_file = progress_file
+        self.interval = 0
+        self.once = True
+
+
+class WatchTest(unittest.TestCase):
+
+    def setUp(self):
+        self.dir = mkdtemp(prefix='cram-watch-test-')
+        self.progress_file = os.path.join(self.dir, 'progress')
+
+
+    def tearDown(self):
+        shutil.rmtree(self.dir)
+
+
+    def write_progress(self, done):
+        with closing(open(self.progress_file, 'w')) as f:
+            f.write(progress_text % done)
+
+
+    def run_watch(self):
+        """Run cram watch -1 and return what it prints."""
+        saved_stdout, saved_stderr = sys.stdout, sys.stderr
+        sys.stdout, sys.stderr = StringIO(), StringIO()
+        try:
+            watch.watch(None, Args(self.progress_file))
+            return sys.stdout.getvalue()
+        finally:
+            sys.stdout, sys.stderr = saved_stdout, saved_stderr
+
+
+    def test_read_progress(self):
+        self.assertEqual(None, watch.read_progress(self.progress_file))
+
+        self.write_progress(0)
+        progress = watch.read_progress(self.progress_file)
+        self.assertEqual(42, progress['elapsed'])
+        self.assertEqual(8, progress['jobs'])
+        self.assertEqual(1, progress['pending'])
+        self.assertEqual(2, progress['running'])
+        self.assertEqual(3, progress['finished'])
+        self.assertEqual(1, progress['failed'])
+        self.assertEqual(1, progress['timed_out'])
+        self.assertEqual(1.5, progress['min_duration'])
+        self.assertEqual(2.25, progress['mean_duration'])
+        self.assertEqual(3.0, progress['max_duration'])
+        self.assertEqual(0, progress['done'])
+
+
+    def test_format_progress(self):
+        self.write_progress(0)
+        line = watch.format_progress(watch.read_progress(self.progress_file))
+        self.assertEqual("[    42 s]  62.5%  8 jobs: 1 pending, 2 running, 3 finished, "
+                         "1 failed, 1 timed out  (duration min 1.5s, mean 2.2s, max 3.0s)",
+                         line)
+
+
+    def test_format_no_finished(self):
+        progress = { 'elapsed' : 0, 'jobs' : 2, 'pending' : 2, 'running' : 0,
+                     'finished' : 0, 'failed' : 0, 'timed_out' : 0 }
+        self.assertEqual("[     0 s]   0.0%  2 jobs: 2 pending, 0 running, 0 finished, "
+                         "0 failed, 0 timed out",
+                         watch.format_progress(progress))
+
+
+    def test_watch_once(self):
+        self.write_progress(1)
+        self.assertTrue(self.run_watch().startswith("[    42 s]  62.5%"))
+
+
+    def test_watch_missing_file(self):
+        self.assertRaises(SystemExit, self.run_watch)
+
+
+    def test_watch_bad_file(self):
+        with closing(open(self.progress_file, 'w')) as f:
+            f.write("jobs: lots\n")
+        self.assertRaises(SystemExit, self.run_watch)
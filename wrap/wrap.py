@@ -108,6 +108,11 @@ wrapper_includes = '''
 _EXTERN_C_ void *MPIR_ToPointer(int);
 #endif // MPICH_HAS_C2F
 
+/* Number of integers in a Fortran status, for arrays of statuses. */
+#ifndef MPI_F_STATUS_SIZE
+#define MPI_F_STATUS_SIZE (sizeof(MPI_Status) / sizeof(MPI_Fint))
+#endif /* MPI_F_STATUS_SIZE */
+
 #if defined(__GNUC__) || defined(__INTEL_COMPILER) || defined(__PGI) || defined(_CRAYC)
 #if defined(__GNUC__)
 #define WEAK_POSTFIX __attribute__ ((weak))
@@ -303,6 +308,19 @@ def conversion_prefix(handle_type):
     else:
         return handle_type
 
+# Overrides for the functions used to convert particular handle types in
+# fortran wrappers.  Maps handle type -> function name.  See handle_conversion.
+handle_f2c_overrides = {}
+handle_c2f_overrides = {}
+
+def f2c_function(handle_type):
+    """Name of the function that converts a fortran handle of handle_type to C."""
+    return handle_f2c_overrides.get(handle_type, conversion_prefix(handle_type) + "_f2c")
+
+def c2f_function(handle_type):
+    """Name of the function that converts a C handle of handle_type to fortran."""
+    return handle_c2f_overrides.get(handle_type, conversion_prefix(handle_type) + "_c2f")
+
 # Special join function for joining lines together.  Puts "\n" at the end too.
 def joinlines(list, sep="\n"):
     if list:
@@ -958,7 +976,7 @@ def write_fortran_wrappers(out, decl, return_val):
             else:
                 # Non-ptr, non-arr handles need to be converted with MPI_Blah_f2c
                 # No special case for MPI_Status here because MPI_Statuses are never passed by value.
-                call.addActualC2F("%s_f2c(*%s)" % (conversion_prefix(arg.type), arg.name))
+                call.addActualC2F("%s(*%s)" % (f2c_function(arg.type), arg.name))
                 call.addActualMPICH("(%s)(*%s)" % (arg.type, arg.name))
 
         else:
@@ -997,8 +1015,32 @@ def write_fortran_wrappers(out, decl, return_val):
                         call.addWritebackMPICH_C2F("%s_c2f(&%s, %s);" % (conv, temp, arg.name))
                     else:
                         call.addActualC2F("&%s" % temp)
-                        call.addCopy("%s = %s_f2c(*%s);"  % (temp, conv, arg.name))
-                        call.addWriteback("*%s = %s_c2f(%s);" % (arg.name, conv, temp))
+                        call.addCopy("%s = %s(*%s);"  % (temp, f2c_function(arg.type), arg.name))
+                        call.addWriteback("*%s = %s(%s);" % (arg.name, c2f_function(arg.type), temp))
+                elif arg.isStatus():
+                    # Status arrays are output only.  Each Fortran status is
+                    # MPI_F_STATUS_SIZE integers, and MPI-2 callers can pass
+                    # MPI_F_STATUSES_IGNORE.
+                    temp_arr_type = "%s*" % arg.type
+                    call.addTemp(temp_arr_type, temp)
+                    call.addTemp("int", "i")
+
+                    count = "*%s" % arg.countParam().name
+                    alloc = "(%s)malloc(sizeof(%s) * %s)" % (temp_arr_type, arg.type, count)
+                    writeback = "%s_c2f(&%s[i], &%s[i * MPI_F_STATUS_SIZE]);" % (conv, temp, arg.name)
+                    call.addCopyMPI2("%s = (%s == MPI_F_STATUSES_IGNORE) ? MPI_STATUSES_IGNORE : %s;"
+                                     % (temp, arg.name, alloc))
+                    call.addCopyMPICH_C2F("%s = %s;" % (temp, alloc))
+                    call.addActualC2F(temp)
+                    call.addWritebackMPI2("if (%s != MPI_F_STATUSES_IGNORE) {" % arg.name)
+                    call.addWritebackMPI2("    for (i=0; i < %s; i++)" % count)
+                    call.addWritebackMPI2("        %s" % writeback)
+                    call.addWritebackMPI2("    free(%s);" % temp)
+                    call.addWritebackMPI2("}")
+                    call.addWritebackMPICH_C2F("for (i=0; i < %s; i++)" % count)
+                    call.addWritebackMPICH_C2F("    %s" % writeback)
+                    call.addWritebackMPICH_C2F("free(%s);" % temp)
+
                 else:
                     # Make temporary variables for the array and the loop var
                     temp_arr_type = "%s*" % arg.type
@@ -1006,12 +1048,8 @@ def write_fortran_wrappers(out, decl, return_val):
                     call.addTemp("int", "i")
 
                     # generate a copy and a writeback statement for this type of handle
-                    if arg.isStatus():
-                        copy = "    %s_f2c(&%s[i], &%s[i])"  % (conv, arg.name, temp)
-                        writeback = "    %s_c2f(&%s[i], &%s[i])" % (conv, temp, arg.name)
-                    else:
-                        copy = "    temp_%s[i] = %s_f2c(%s[i])"  % (arg.name, conv, arg.name)
-                        writeback = "    %s[i] = %s_c2f(temp_%s[i])" % (arg.name, conv, arg.name)
+                    copy = "    temp_%s[i] = %s(%s[i])"  % (arg.name, f2c_function(arg.type), arg.name)
+                    writeback = "    %s[i] = %s(temp_%s[i])" % (arg.name, c2f_function(arg.type), arg.name)
 
                     # Generate the call surrounded by temp array allocation, copies, writebacks, and temp free
                     count = "*%s" % arg.countParam().name
@@ -1088,6 +1126,48 @@ class TypeApplier:
             if arg.cType() == type:
                 out.write("%s(%s);\n" % (macro_name, arg.name))
 
+class CountApplier:
+    """This class implements a Macro function for applying something callable to
+       each count and datatype pair in a decl.  A count is an int argument that
+       comes right before an MPI_Datatype argument, as in MPI_Send.  The
+       callable also gets the argument before the count, which is the pair's
+       buffer, or NULL if there isn't one.
+
+       Pairs that MPI only reads on the root of a collective (the receive side
+       of gathers and the send side of scatters) are skipped, since other
+       processes may pass garbage.  In collectives with a root, nothing is
+       applied when root is MPI_PROC_NULL.
+    """
+    def __init__(self, decl):
+        self.decl = decl
+
+    def root_only(self, count):
+        name = self.decl.name.lower()
+        return (("gather" in name and count.name.startswith("recv")) or
+                ("scatter" in name and count.name.startswith("send")))
+
+    def __call__(self, out, scope, args, children):
+        len(args) == 1 or syntax_error("Wrong number of args in apply_to_counts macro.")
+        macro_name = args[0]
+        has_root = any(arg.name == "root" for arg in self.decl.args)
+
+        calls = []
+        for i, (count, type) in enumerate(zip(self.decl.args, self.decl.args[1:])):
+            if count.cType() == "int" and type.cType() == "MPI_Datatype":
+                if has_root and self.root_only(count):
+                    continue
+                buf = self.decl.args[i-1].name if i > 0 else "NULL"
+                calls.append("%s(%s, %s, %s);" % (macro_name, buf, count.name, type.name))
+
+        if calls and has_root:
+            out.write("if (root != MPI_PROC_NULL) {\n")
+            for call in calls:
+                out.write("    %s\n" % call)
+            out.write("}\n")
+        else:
+            for call in calls:
+                out.write("%s\n" % call)
+
 def include_decl(scope, decl):
     """This function is used by macros to include attributes MPI declarations in their scope."""
     scope["ret_type"] = decl.retType()
@@ -1095,6 +1175,7 @@ def include_decl(scope, decl):
     scope["types"]    = decl.types()
     scope["formals"]  = decl.formals()
     scope["apply_to_type"] = TypeApplier(decl)
+    scope["apply_to_counts"] = CountApplier(decl)
     scope.function_name  = decl.name
 
     # These are old-stype, deprecated names.
@@ -1110,7 +1191,14 @@ def all_but(fn_list):
     """Return a list of all mpi functions except those in fn_list"""
     all_mpi = set(mpi_functions.keys())
     diff = all_mpi - set(fn_list)
-    return [x for x in diff]
+    return sorted(diff)
+
+def all_with_type(type, fn_list):
+    """Return a list of all mpi functions that take an argument of the given type,
+       except those in fn_list"""
+    def takes_type(fn_name):
+        return any(arg.cType() == type for arg in mpi_functions[fn_name].args)
+    return filter(takes_type, all_but(fn_list))
 
 @macro("foreachfn", has_body=True)
 def foreachfn(out, scope, args, children):
@@ -1304,12 +1392,43 @@ def forallfn(out, scope, args, children):
     args or syntax_error("Error: forallfn requires function name argument.")
     foreachfn(out, scope, [args[0]] + all_but(args[1:]), children)
 
+@macro("forallfn_with_type", has_body=True)
+def forallfn_with_type(out, scope, args, children):
+    """Iterate over all but listed functions that take an argument of a
+       particular type.  Visits the same functions as fnall_with_type.
+    """
+    len(args) >= 2 or syntax_error("Error: forallfn_with_type requires iterator variable and type arguments.")
+    foreachfn(out, scope, [args[0]] + all_with_type(args[1], args[2:]), children)
+
 @macro("fnall", has_body=True)
 def fnall(out, scope, args, children):
     """Iterate over all but listed functions and generate skeleton too."""
     args or syntax_error("Error: fnall requires function name argument.")
     fn(out, scope, [args[0]] + all_but(args[1:]), children)
 
+@macro("fnall_with_type", has_body=True)
+def fnall_with_type(out, scope, args, children):
+    """Iterate over all but listed functions that take an argument of a
+       particular type, and generate skeleton too.  Functions without such an
+       argument are not wrapped at all, so calls to them go straight to MPI.
+    """
+    len(args) >= 2 or syntax_error("Error: fnall_with_type requires iterator variable and type arguments.")
+    fn(out, scope, [args[0]] + all_with_type(args[1], args[2:]), children)
+
+@macro("handle_conversion")
+def handle_conversion(out, scope, args, children):
+    """{{handle_conversion <type> <f2c function> <c2f function>}}
+       Fortran wrappers generated after this will call <f2c function> and
+       <c2f function> instead of MPI_<Type>_f2c and MPI_<Type>_c2f to convert
+       handles of <type>.  Does not apply to MPI_Status.
+    """
+    len(args) == 3 or syntax_error("'handle_conversion' macro takes exactly 3 arguments.")
+    type, f2c, c2f = args
+    if type not in mpi_handle_types or type == "MPI_Status":
+        syntax_error("Invalid handle type in 'handle_conversion' macro: '%s'" % type)
+    handle_f2c_overrides[type] = f2c
+    handle_c2f_overrides[type] = c2f
+
 @macro("sub")
 def sub(out, scope, args, children):
     """{{sub <string> <regexp> <substitution>}}